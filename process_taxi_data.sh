@@ -67,6 +67,14 @@ STEP3_END=$(date +%s)
 STEP3_TIME=$((STEP3_END - STEP3_START))
 echo -e "${GREEN}✓ KD-tree indexing completed in ${STEP3_TIME}s${NC}"
 echo "  Output: $KDTRIP_FILE ($(du -h $KDTRIP_FILE | cut -f1))"
+./build/src/preprocess/build_time_index "$KDTRIP_FILE"
+echo "  Output: $KDTRIP_FILE.tidx ($(du -h $KDTRIP_FILE.tidx | cut -f1))"
+./build/src/preprocess/build_leaf_directory "$KDTRIP_FILE"
+echo "  Output: $KDTRIP_FILE.leaves ($(du -h $KDTRIP_FILE.leaves | cut -f1))"
+./build/src/preprocess/build_od_index "$KDTRIP_FILE"
+echo "  Output: $KDTRIP_FILE.od ($(du -h $KDTRIP_FILE.od | cut -f1))"
+./build/src/preprocess/chain_trips "$KDTRIP_FILE"
+echo "  Output: $KDTRIP_FILE.chain ($(du -h $KDTRIP_FILE.chain | cut -f1))"
 echo ""
 
 # Summary
@@ -0,0 +1,252 @@
+#ifndef ASYNC_BLOCK_READER_HPP
+#define ASYNC_BLOCK_READER_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ThreadPool.hpp"
+#ifdef KDTRIP_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// Brings batches of blocks of a file into the page cache with many reads
+// in flight at once, for traversals that then touch the blocks through a
+// read-only mapping of the same file. A page fault on a cold mapping
+// blocks its thread on one read at a time; here a whole batch is queued
+// at once. The reads go through io_uring when TaxiVis is built with
+// liburing, and otherwise through pread on a pool of I/O threads shared
+// by every reader in the process. Blocks already resident (per mincore)
+// are skipped. The data read is discarded: the page cache is the
+// destination, so reads are not O_DIRECT. The file is only opened by the
+// first fetch. Safe to use from several threads at once.
+class AsyncBlockReader
+{
+public:
+    explicit AsyncBlockReader(const std::string &fileName, size_t blockSize=64*1024, unsigned queueDepth=32):
+        fileName(fileName), fd(-1), opened(false), fileSize(0), blockSize(blockSize),
+        queueDepth(std::max(1u, queueDepth)), mapping(NULL), mappingSize(0)
+    {
+    }
+
+    ~AsyncBlockReader()
+    {
+        if (this->fd>=0)
+            close(this->fd);
+    }
+
+    size_t getBlockSize() const
+    {
+        return this->blockSize;
+    }
+
+    // The mapping of the same file, used to skip blocks already resident
+    void setMapping(const void *data, size_t size)
+    {
+        this->mapping = reinterpret_cast<const char*>(data);
+        this->mappingSize = size;
+    }
+
+    // Reads the given blocks (numbered from the start of the file) and
+    // returns once all of them are in the page cache
+    void fetch(const std::vector<uint64_t> &blocks)
+    {
+        if (blocks.empty() || !this->ensureOpen())
+            return;
+        std::vector<uint64_t> missing;
+        missing.reserve(blocks.size());
+        for (size_t i=0; i<blocks.size(); i++)
+            if (!this->isResident(blocks[i]))
+                missing.push_back(blocks[i]);
+        if (missing.empty())
+            return;
+#ifdef KDTRIP_HAVE_LIBURING
+        std::vector<uint64_t> failed;
+        if (this->fetchIoUring(missing, failed)) {
+            this->fetchThreads(failed);
+            return;
+        }
+#endif
+        this->fetchThreads(missing);
+    }
+
+private:
+    std::string fileName;
+    int         fd;
+    bool        opened;
+    uint64_t    fileSize;
+    size_t      blockSize;
+    unsigned    queueDepth;
+    const char *mapping;
+    size_t      mappingSize;
+    std::mutex  mutex;
+
+    bool ensureOpen()
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        if (!this->opened) {
+            this->opened = true;
+            this->fd = open(this->fileName.c_str(), O_RDONLY);
+            if (this->fd<0)
+                fprintf(stderr, "Cannot open %s for asynchronous reads\n", this->fileName.c_str());
+            else
+                this->fileSize = lseek(this->fd, 0, SEEK_END);
+        }
+        return this->fd>=0;
+    }
+
+    bool isResident(uint64_t block) const
+    {
+        if (!this->mapping || block*this->blockSize>=this->mappingSize)
+            return false;
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        size_t length = std::min<size_t>(this->blockSize, this->mappingSize-block*this->blockSize);
+        std::vector<unsigned char> pages((length+pageSize-1)/pageSize);
+        if (mincore(const_cast<char*>(this->mapping+block*this->blockSize), length, &pages[0])!=0)
+            return false;
+        for (size_t i=0; i<pages.size(); i++)
+            if (!(pages[i]&1))
+                return false;
+        return true;
+    }
+
+    // The I/O threads mostly sleep in the kernel and so are kept apart from
+    // the compute pool; one pool bounds them for all readers together
+    static ThreadPool & ioPool()
+    {
+        static ThreadPool pool(32);
+        return pool;
+    }
+
+    void fetchThreads(const std::vector<uint64_t> &blocks)
+    {
+        ioPool().parallelFor(blocks.size(), [&](size_t i) {
+            std::vector<char> buffer(this->blockSize);
+            ssize_t done = pread(this->fd, &buffer[0], this->blockSize, blocks[i]*this->blockSize);
+            (void)done;
+        });
+    }
+
+#ifdef KDTRIP_HAVE_LIBURING
+    // One ring per thread, shared by every reader that thread fetches for,
+    // so fetches never wait on each other. A ring that fails to submit or
+    // to drain its reads is abandoned with its buffers, which the kernel
+    // may still write to.
+    struct Ring {
+        Ring(): ready(false), broken(false), depth(0), blockSize(0), buffers(NULL) {}
+        ~Ring()
+        {
+            if (this->ready && !this->broken) {
+                io_uring_queue_exit(&this->ring);
+                delete [] this->buffers;
+            }
+        }
+
+        struct io_uring ring;
+        bool            ready;
+        bool            broken;
+        unsigned        depth;
+        size_t          blockSize;
+        char           *buffers;
+    };
+
+    Ring * threadRing()
+    {
+        static thread_local Ring ring;
+        if (ring.broken)
+            return NULL;
+        if (ring.ready && (ring.depth<this->queueDepth || ring.blockSize<this->blockSize)) {
+            io_uring_queue_exit(&ring.ring);
+            delete [] ring.buffers;
+            ring.buffers = NULL;
+            ring.ready = false;
+        }
+        if (!ring.ready) {
+            if (io_uring_queue_init(this->queueDepth, &ring.ring, 0)<0)
+                return NULL;
+            ring.ready = true;
+            ring.depth = this->queueDepth;
+            ring.blockSize = this->blockSize;
+            ring.buffers = new char[ring.depth*ring.blockSize];
+        }
+        return &ring;
+    }
+
+    // Keeps up to queueDepth reads queued on the calling thread's ring.
+    // Blocks whose read failed or came back short are left in failed.
+    // Returns false when the ring cannot be used, to fall back to threads.
+    bool fetchIoUring(const std::vector<uint64_t> &blocks, std::vector<uint64_t> &failed)
+    {
+        Ring *ring = this->threadRing();
+        if (!ring)
+            return false;
+        std::vector<unsigned> freeSlots;
+        std::vector<uint64_t> slotBlocks(ring->depth);
+        for (unsigned i=0; i<ring->depth; i++)
+            freeSlots.push_back(i);
+        size_t next = 0, inFlight = 0;
+        while (next<blocks.size() || inFlight>0) {
+            while (next<blocks.size() && !freeSlots.empty()) {
+                struct io_uring_sqe *sqe = io_uring_get_sqe(&ring->ring);
+                if (!sqe)
+                    break;
+                unsigned slot = freeSlots.back();
+                freeSlots.pop_back();
+                slotBlocks[slot] = blocks[next];
+                io_uring_prep_read(sqe, this->fd, &ring->buffers[slot*ring->blockSize], this->blockSize,
+                                   blocks[next]*this->blockSize);
+                io_uring_sqe_set_data(sqe, reinterpret_cast<void*>((uintptr_t)slot));
+                next++;
+                inFlight++;
+            }
+            if (io_uring_submit(&ring->ring)<0) {
+                ring->broken = true;
+                return false;
+            }
+            struct io_uring_cqe *cqe;
+            int error = io_uring_wait_cqe(&ring->ring, &cqe);
+            if (error==-EINTR)
+                continue;
+            if (error<0) {
+                this->drain(ring, inFlight);
+                return false;
+            }
+            unsigned slot = (unsigned)(uintptr_t)io_uring_cqe_get_data(cqe);
+            uint64_t offset = slotBlocks[slot]*this->blockSize;
+            uint64_t expected = offset<this->fileSize?std::min<uint64_t>(this->blockSize, this->fileSize-offset):0;
+            if (cqe->res<0 || (uint64_t)cqe->res<expected)
+                failed.push_back(slotBlocks[slot]);
+            freeSlots.push_back(slot);
+            io_uring_cqe_seen(&ring->ring, cqe);
+            inFlight--;
+        }
+        return true;
+    }
+
+    // Waits out the reads still in flight so their buffers can be reused;
+    // if even that fails the ring is given up
+    void drain(Ring *ring, size_t inFlight)
+    {
+        while (inFlight>0) {
+            struct io_uring_cqe *cqe;
+            int error = io_uring_wait_cqe(&ring->ring, &cqe);
+            if (error==-EINTR)
+                continue;
+            if (error<0) {
+                ring->broken = true;
+                return;
+            }
+            io_uring_cqe_seen(&ring->ring, cqe);
+            inFlight--;
+        }
+    }
+#endif
+};
+
+#endif
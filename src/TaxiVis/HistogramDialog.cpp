@@ -10,7 +10,9 @@ HistogramDialog::HistogramDialog(GeographicalViewWidget *geo, int numBins)
   this->ui->setupUi(this);
   this->connect(this, SIGNAL(finished(int)), this, SLOT(onFinished(int)));
   
-  this->trips = *this->geoWidget->getSelectedTrips();
+  this->original = this->geoWidget->getSnapshot();
+  this->originalTrips = this->geoWidget->getSelectedTrips();
+  this->trips = *this->originalTrips;
   QDateTime startTime = this->geoWidget->getSelectedStartTime();
   QDateTime endTime = this->geoWidget->getSelectedEndTime();
   SelectionGraph *selectionGraph = this->geoWidget->getSelectionGraph();
@@ -111,7 +113,20 @@ void HistogramDialog::updateSelection(QList<IntervalSelection>)
         descList << desc;
     }
   }
-  this->geoWidget->getSelectedTrips()->swap(out);
+  this->filtered = ResultStore::SnapshotPtr(new ResultStore::Snapshot);
+  if (this->original) {
+    this->filtered->pins = this->original->pins;
+    this->filtered->groups.plan = this->original->groups.plan;
+    KdTrip::TripSet::const_iterator it;
+    for (it=out.begin(); it!=out.end(); ++it) {
+      uint64_t groupMask;
+      if (this->original->groups.maskOf(*it, groupMask))
+        this->filtered->groups.masks[*it] = groupMask;
+    }
+  }
+  this->filtered->trips.swap(out);
+  this->filtered->prunePins();
+  this->geoWidget->showSnapshot(this->filtered);
   this->geoWidget->setQueryDescription(descList);
   this->geoWidget->emitDatasetUpdated();
   this->geoWidget->repaintContents();
@@ -124,8 +139,12 @@ KdTrip::TripSet * HistogramDialog::selectedTrips()
 
 void HistogramDialog::onFinished(int result)
 {
-  if (result==QDialog::Rejected) {
-    this->geoWidget->getSelectedTrips()->swap(this->trips);
+  //unless a query result replaced the filtered trips in the meantime
+  if (result==QDialog::Rejected && this->filtered && this->geoWidget->getSnapshot()==this->filtered) {
+    if (this->original)
+      this->geoWidget->showSnapshot(this->original);
+    else
+      this->geoWidget->setSelectedTripsRepository(this->originalTrips);
     this->geoWidget->setQueryDescription(QStringList());
     this->geoWidget->emitDatasetUpdated();
     this->geoWidget->repaintContents();
@@ -25,6 +25,13 @@ private:
   GeographicalViewWidget         *geoWidget;
   QList<ExtendedHistogram*>       plots;
   KdTrip::TripSet trips;
+  // what the map showed when the dialog opened: the snapshot, or trips
+  // filled elsewhere when it has none
+  ResultStore::SnapshotPtr        original;
+  const KdTrip::TripSet          *originalTrips;
+  // the trips the histograms keep, in a snapshot of their own since the
+  // original one may be shared with linked views and the history
+  ResultStore::SnapshotPtr        filtered;
                                        
 public slots:
   void xAxisRangeChanged(const QCPRange &newRange);
@@ -0,0 +1,398 @@
+#ifndef KD_FIXED_TRIP_HPP
+#define KD_FIXED_TRIP_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/shared_ptr.hpp>
+#include "KdTree.hpp"
+#include "KdTrip.hpp"
+#include "ThreadPool.hpp"
+
+// Fixed-point variant of the trip index: the same tree layout and field
+// order as KdTrip, but pickup and dropoff coordinates are stored as int32
+// microdegrees. Keys are the coordinates with the sign bit flipped and the
+// query predicate is a chain of plain integer compares. Build it with
+// "build_kdtrip <in> <out> fixed". QueryManager mounts it like a kdtrip
+// and gets its trips as KdTrip::Trip (see asTrip).
+class KdFixedTrip
+{
+public:
+    struct Trip {
+        uint32_t  pickup_time;
+        uint32_t  dropoff_time;
+        int32_t   pickup_long;   // in microdegrees
+        int32_t   pickup_lat;    // in microdegrees
+        int32_t   dropoff_long;  // in microdegrees
+        int32_t   dropoff_lat;   // in microdegrees
+        //
+        uint32_t  field1;
+        uint32_t  field2;
+        uint32_t  field3;
+        uint32_t  field4;
+        //
+        uint16_t  id_taxi;
+        uint16_t  distance;     // in 0.01 miles unit
+        uint16_t  fare_amount;  // in cents
+        uint16_t  surcharge;    // in cents
+        uint16_t  mta_tax;      // in cents
+        uint16_t  tip_amount;   // in cents
+        uint16_t  tolls_amount; // in cents
+        uint8_t   payment_type;
+        uint8_t   passengers;
+    };
+
+    typedef KdTree<Trip,
+                   KdMemberKey<Trip, uint32_t, &Trip::pickup_time>,
+                   KdMemberKey<Trip, uint32_t, &Trip::dropoff_time>,
+                   KdInt32Key<Trip, &Trip::pickup_long>,
+                   KdInt32Key<Trip, &Trip::pickup_lat>,
+                   KdInt32Key<Trip, &Trip::dropoff_long>,
+                   KdInt32Key<Trip, &Trip::dropoff_lat>,
+                   KdMemberKey<Trip, uint16_t, &Trip::id_taxi> > Tree;
+
+    // Degrees <-> microdegrees. A float coordinate has a coarser step than
+    // a microdegree wherever |degrees|>=16, which holds for every NYC
+    // latitude and longitude, so there converting a float to microdegrees
+    // and back gives the same float, and both keep the same order.
+    static inline int32_t toMicrodegrees(double degrees)
+    {
+        double micro = floor(degrees*1e6+0.5);
+        if (micro<=INT_MIN) return INT_MIN;
+        if (micro>=INT_MAX) return INT_MAX;
+        return (int32_t)micro;
+    }
+
+    // Correctly rounded, so printing it with 6 decimals gives back the
+    // exact microdegrees
+    static inline double toDegrees(int32_t microdegrees)
+    {
+        return microdegrees/1e6;
+    }
+
+    static Trip fromTrip(const KdTrip::Trip &t)
+    {
+        Trip f;
+        memcpy(&f, &t, sizeof(f));
+        f.pickup_long  = toMicrodegrees(t.pickup_long);
+        f.pickup_lat   = toMicrodegrees(t.pickup_lat);
+        f.dropoff_long = toMicrodegrees(t.dropoff_long);
+        f.dropoff_lat  = toMicrodegrees(t.dropoff_lat);
+        return f;
+    }
+
+    static KdTrip::Trip toTrip(const Trip &f)
+    {
+        KdTrip::Trip t;
+        memcpy(&t, &f, sizeof(t));
+        t.pickup_long  = (float)toDegrees(f.pickup_long);
+        t.pickup_lat   = (float)toDegrees(f.pickup_lat);
+        t.dropoff_long = (float)toDegrees(f.dropoff_long);
+        t.dropoff_lat  = (float)toDegrees(f.dropoff_lat);
+        return t;
+    }
+
+    struct Query
+    {
+        Query() {
+            minPickupTime = minDropoffTime = 0;
+            maxPickupTime = maxDropoffTime = UINT_MAX;
+            minTaxiId = 0;
+            maxTaxiId = USHRT_MAX;
+            minPickupLong = minPickupLat = minDropoffLong = minDropoffLat = INT_MIN;
+            maxPickupLong = maxPickupLat = maxDropoffLong = maxDropoffLat = INT_MAX;
+            sampleStride = 1;
+        }
+
+        // Same selection as q on the fixed-point index
+        explicit Query(const KdTrip::Query &q) {
+            minPickupTime  = q.minPickupTime;
+            maxPickupTime  = q.maxPickupTime;
+            minDropoffTime = q.minDropoffTime;
+            maxDropoffTime = q.maxDropoffTime;
+            minTaxiId      = q.minTaxiId;
+            maxTaxiId      = q.maxTaxiId;
+            minPickupLong  = toMicrodegrees(q.minPickupLong);
+            maxPickupLong  = toMicrodegrees(q.maxPickupLong);
+            minPickupLat   = toMicrodegrees(q.minPickupLat);
+            maxPickupLat   = toMicrodegrees(q.maxPickupLat);
+            minDropoffLong = toMicrodegrees(q.minDropoffLong);
+            maxDropoffLong = toMicrodegrees(q.maxDropoffLong);
+            minDropoffLat  = toMicrodegrees(q.minDropoffLat);
+            maxDropoffLat  = toMicrodegrees(q.maxDropoffLat);
+            timePattern    = q.timePattern;
+            timeRanges     = q.timeRanges;
+            cancelFlag     = q.cancelFlag;
+            sampleStride   = q.sampleStride;
+        }
+
+        bool isCancelled() const
+        {
+            return this->cancelFlag && this->cancelFlag->load(std::memory_order_relaxed);
+        }
+
+        // Non-short-circuit so the compiler can evaluate all compares at once
+        inline bool isMatched(const Trip *trip) const
+        {
+            return ((this->minPickupTime<=trip->pickup_time) & (trip->pickup_time<=this->maxPickupTime) &
+                    (this->minDropoffTime<=trip->dropoff_time) & (trip->dropoff_time<=this->maxDropoffTime) &
+                    (this->minPickupLong<=trip->pickup_long) & (trip->pickup_long<=this->maxPickupLong) &
+                    (this->minPickupLat<=trip->pickup_lat) & (trip->pickup_lat<=this->maxPickupLat) &
+                    (this->minDropoffLong<=trip->dropoff_long) & (trip->dropoff_long<=this->maxDropoffLong) &
+                    (this->minDropoffLat<=trip->dropoff_lat) & (trip->dropoff_lat<=this->maxDropoffLat) &
+                    (this->minTaxiId<=trip->id_taxi) & (trip->id_taxi<=this->maxTaxiId)) &&
+                   (!this->timePattern || this->timePattern->matches(trip->pickup_time, trip->dropoff_time)) &&
+                   (!this->timeRanges || this->timeRanges->matches(trip->pickup_time, trip->dropoff_time));
+        }
+
+        void getRange(uint32_t range[7][2]) const {
+            uint32_t r[7][2] = {
+                {minPickupTime, maxPickupTime},
+                {minDropoffTime, maxDropoffTime},
+                {KdInt32Key<Trip, &Trip::pickup_long>::encode(minPickupLong),
+                 KdInt32Key<Trip, &Trip::pickup_long>::encode(maxPickupLong)},
+                {KdInt32Key<Trip, &Trip::pickup_lat>::encode(minPickupLat),
+                 KdInt32Key<Trip, &Trip::pickup_lat>::encode(maxPickupLat)},
+                {KdInt32Key<Trip, &Trip::dropoff_long>::encode(minDropoffLong),
+                 KdInt32Key<Trip, &Trip::dropoff_long>::encode(maxDropoffLong)},
+                {KdInt32Key<Trip, &Trip::dropoff_lat>::encode(minDropoffLat),
+                 KdInt32Key<Trip, &Trip::dropoff_lat>::encode(maxDropoffLat)},
+                {minTaxiId, maxTaxiId}
+            };
+            memcpy(range, r, sizeof(r));
+        }
+
+        uint32_t minPickupTime, maxPickupTime;
+        uint32_t minDropoffTime, maxDropoffTime;
+        uint16_t minTaxiId, maxTaxiId;
+        int32_t  minPickupLong, maxPickupLong;
+        int32_t  minPickupLat, maxPickupLat;
+        int32_t  minDropoffLong, maxDropoffLong;
+        int32_t  minDropoffLat, maxDropoffLat;
+        boost::shared_ptr<const KdTrip::HourMask> timePattern;
+        boost::shared_ptr<const KdTrip::TimeRanges> timeRanges;
+        boost::shared_ptr<std::atomic<bool> > cancelFlag;
+        unsigned sampleStride;
+    };
+
+    typedef std::vector<const Trip*> TripVector;
+
+public:
+    explicit KdFixedTrip(const std::string &treeFileName): tree(treeFileName)
+    {
+        boost::iostreams::mapped_file_params params(treeFileName);
+        params.flags = boost::iostreams::mapped_file::priv;
+        this->view.open(params);
+    }
+
+    // Trips of q, with the subtrees below SplitDepth searched in parallel
+    // on the pool, or a sample of them as KdTrip::executeSample takes it.
+    // A cancelled query returns what was found so far.
+    boost::shared_ptr<TripVector> execute(const Query &q, ThreadPool &pool=ThreadPool::shared()) const
+    {
+        uint32_t range[7][2];
+        q.getRange(range);
+        std::vector<Tree::Subtree> subtrees;
+        if (q.sampleStride>1) {
+            int subtreeDepth = 0;
+            while (subtreeDepth<KdTrip::SampleSubtreeDepth && (1u<<(subtreeDepth+1))<=q.sampleStride)
+                subtreeDepth++;
+            this->tree.collectSample(0, range, 0, 0, std::max(this->tree.depth()-subtreeDepth, 0),
+                                     q.sampleStride, subtrees);
+        }
+        else
+            this->tree.collectSubtrees(0, range, 0, 0, SplitDepth, subtrees);
+
+        std::vector<TripVector> buffers(subtrees.size());
+        Matcher m = {q};
+        pool.parallelFor(subtrees.size(), [&](size_t i) {
+            if (!q.isCancelled())
+                this->tree.search(subtrees[i].root, range, subtrees[i].dim, m, buffers[i]);
+        });
+        size_t total = 0;
+        for (size_t i=0; i<buffers.size(); i++)
+            total += buffers[i].size();
+        boost::shared_ptr<TripVector> trips(new TripVector());
+        trips->reserve(total);
+        for (size_t i=0; i<buffers.size(); i++)
+            trips->insert(trips->end(), buffers[i].begin(), buffers[i].end());
+        return trips;
+    }
+
+    // Same selection as q on the float index, as KdTrip::Trip
+    KdTrip::QueryResult execute(const KdTrip::Query &q, ThreadPool &pool=ThreadPool::shared()) const
+    {
+        return this->asTrips(*this->execute(Query(q), pool), pool);
+    }
+
+    // The k trips of q closest to (lat, lon), closest first, as
+    // KdTrip::nearest finds them
+    KdTrip::QueryResult nearest(const KdTrip::Query &q, float lat, float lon, bool dropoff, size_t k,
+                                ThreadPool &pool=ThreadPool::shared()) const
+    {
+        Query fq(q);
+        uint32_t range[7][2];
+        fq.getRange(range);
+        std::vector<std::pair<double, const Trip*> > neighbors;
+        Matcher m = {fq};
+        this->tree.nearest(range, k, m, NearestDistance(lat, lon, dropoff), neighbors);
+        TripVector trips(neighbors.size());
+        for (size_t i=0; i<neighbors.size(); i++)
+            trips[i] = neighbors[i].second;
+        return this->asTrips(trips, pool);
+    }
+
+    // Every trip, in tree order, to out.push_back(const Trip*)
+    template <typename Output>
+    void scan(Output &out) const
+    {
+        Query all;
+        uint32_t range[7][2];
+        all.getRange(range);
+        Matcher m = {all};
+        this->tree.search(0, range, 0, m, out);
+    }
+
+    // The trip as the rest of TaxiVis reads it. It is converted the first
+    // time it is asked for into a private copy-on-write mapping of the
+    // index, at the same offset, so a trip always gets the same pointer
+    // and only the pages of trips handed out take memory of their own.
+    // The leaf node header of the copy, which nothing traverses, marks the
+    // trips already converted. Safe to call from several threads.
+    const KdTrip::Trip * asTrip(const Trip *trip) const
+    {
+        uint64_t offset = reinterpret_cast<const char*>(trip)-reinterpret_cast<const char*>(this->tree.begin());
+        char *copy = this->view.data()+offset;
+        std::lock_guard<std::mutex> lock(this->locks[(offset/sizeof(KdTreeNode))%NumLocks]);
+        uint64_t converted;
+        memcpy(&converted, copy-sizeof(uint64_t), sizeof(converted));
+        if (!converted) {
+            KdTrip::Trip t = toTrip(*trip);
+            memcpy(copy, &t, sizeof(t));
+            converted = 1;
+            memcpy(copy-sizeof(uint64_t), &converted, sizeof(converted));
+        }
+        return reinterpret_cast<const KdTrip::Trip*>(copy);
+    }
+
+    // True when trip was handed out by asTrip
+    bool contains(const KdTrip::Trip *trip) const
+    {
+        const char *p = reinterpret_cast<const char*>(trip);
+        return p>=this->mappedBegin() && p<this->mappedEnd();
+    }
+
+    // The copy asTrip hands out trips from
+    const char * mappedBegin() const
+    {
+        return this->view.data();
+    }
+
+    const char * mappedEnd() const
+    {
+        return this->view.data()+this->view.size();
+    }
+
+private:
+    // Levels walked before the remaining subtrees are searched in parallel
+    static const int SplitDepth = 8;
+    static const int NumLocks = 64;
+
+    Tree tree;
+    boost::iostreams::mapped_file view;
+    mutable std::mutex locks[NumLocks];
+
+    struct Matcher {
+        const Query &query;
+        inline bool operator()(const Trip *trip) const { return query.isMatched(trip); }
+    };
+
+    // Distance handed to Tree::nearest, in squared meters, on the same
+    // projection as KdTrip::squaredDistance
+    struct NearestDistance {
+        NearestDistance(float lat, float lon, bool dropoff):
+            lat(lat), lon(lon), cosLat(cos(lat*M_PI/180)), latDim(dropoff?5:3), lonDim(dropoff?4:2) {}
+
+        inline double toPoint(double pointLat, double pointLon) const {
+            double dy = (pointLat-this->lat)*MetersPerDegree;
+            double dx = (pointLon-this->lon)*MetersPerDegree*this->cosLat;
+            return dx*dx+dy*dy;
+        }
+
+        inline double toRecord(const Trip &trip) const {
+            return this->latDim==5?this->toPoint(toDegrees(trip.dropoff_lat), toDegrees(trip.dropoff_long)):
+                                   this->toPoint(toDegrees(trip.pickup_lat), toDegrees(trip.pickup_long));
+        }
+
+        // Distance to the closest point of the location box in bounds
+        inline double toBox(const uint32_t (*bounds)[2]) const {
+            double boxLat = std::min(std::max<double>(this->lat, keyToDegrees(bounds[this->latDim][0])),
+                                     keyToDegrees(bounds[this->latDim][1]));
+            double boxLon = std::min(std::max<double>(this->lon, keyToDegrees(bounds[this->lonDim][0])),
+                                     keyToDegrees(bounds[this->lonDim][1]));
+            return this->toPoint(boxLat, boxLon);
+        }
+
+        static inline double keyToDegrees(uint32_t key) {
+            return toDegrees((int32_t)(key^0x80000000u));
+        }
+
+        static constexpr double MetersPerDegree = 111195.0;
+        double lat, lon, cosLat;
+        int    latDim, lonDim;
+    };
+
+    // Converts trips in parallel chunks (see asTrip)
+    KdTrip::QueryResult asTrips(const TripVector &trips, ThreadPool &pool) const
+    {
+        KdTrip::QueryResult result;
+        result.trips = boost::shared_ptr<KdTrip::TripVector>(new KdTrip::TripVector(trips.size()));
+        KdTrip::TripVector &out = *result.trips;
+        size_t numChunks = std::min<size_t>(4*pool.size(), trips.size()/1024+1);
+        pool.parallelFor(numChunks, [&](size_t c) {
+            for (size_t i=trips.size()*c/numChunks; i<trips.size()*(c+1)/numChunks; i++)
+                out[i] = this->asTrip(trips[i]);
+        });
+        return result;
+    }
+};
+
+
+// fromTrip, toTrip and asTrip copy whole records between the two layouts
+// and only rewrite the four coordinates, so every field must sit at the
+// same offset in both.
+static_assert(sizeof(KdFixedTrip::Trip)==sizeof(KdTrip::Trip),
+              "KdFixedTrip::Trip and KdTrip::Trip must have the same size");
+#define KDFIXEDTRIP_SAME_OFFSET(f) \
+    static_assert(offsetof(KdFixedTrip::Trip, f)==offsetof(KdTrip::Trip, f), \
+                  "KdFixedTrip::Trip::" #f " is not at the offset of KdTrip::Trip::" #f)
+KDFIXEDTRIP_SAME_OFFSET(pickup_time);
+KDFIXEDTRIP_SAME_OFFSET(dropoff_time);
+KDFIXEDTRIP_SAME_OFFSET(pickup_long);
+KDFIXEDTRIP_SAME_OFFSET(pickup_lat);
+KDFIXEDTRIP_SAME_OFFSET(dropoff_long);
+KDFIXEDTRIP_SAME_OFFSET(dropoff_lat);
+KDFIXEDTRIP_SAME_OFFSET(field1);
+KDFIXEDTRIP_SAME_OFFSET(field2);
+KDFIXEDTRIP_SAME_OFFSET(field3);
+KDFIXEDTRIP_SAME_OFFSET(field4);
+KDFIXEDTRIP_SAME_OFFSET(id_taxi);
+KDFIXEDTRIP_SAME_OFFSET(distance);
+KDFIXEDTRIP_SAME_OFFSET(fare_amount);
+KDFIXEDTRIP_SAME_OFFSET(surcharge);
+KDFIXEDTRIP_SAME_OFFSET(mta_tax);
+KDFIXEDTRIP_SAME_OFFSET(tip_amount);
+KDFIXEDTRIP_SAME_OFFSET(tolls_amount);
+KDFIXEDTRIP_SAME_OFFSET(payment_type);
+KDFIXEDTRIP_SAME_OFFSET(passengers);
+#undef KDFIXEDTRIP_SAME_OFFSET
+
+#endif
@@ -0,0 +1,645 @@
+#ifndef KD_TREE_HPP
+#define KD_TREE_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#if defined(__GNUC__)
+#define KDTREE_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define KDTREE_PREFETCH(addr)
+#endif
+
+#pragma pack(push, 1)
+struct KdTreeNode {
+    uint64_t child_node;
+    uint32_t median_value;
+};
+#pragma pack(pop)
+
+// Order-preserving mapping of a float to an unsigned key, so that float
+// dimensions can be compared as integers
+inline uint32_t kdFloatToKey(float f)
+{
+    uint32_t t;
+    memcpy(&t, &f, sizeof(t));
+    return t ^ ((-(t >> 31)) | 0x80000000);
+}
+
+inline float kdKeyToFloat(uint32_t k)
+{
+    uint32_t u = k ^ (((k >> 31) - 1) | 0x80000000);
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// Key accessors: each one reads one dimension of a Record and maps it to an
+// order-preserving uint32_t. They are only used as template arguments, so
+// every access is resolved and inlined at compile time.
+template <typename Record, typename T, T Record::*Member>
+struct KdMemberKey {
+    typedef T value_type;
+    static inline uint32_t encode(T v) { return (uint32_t)v; }
+    static inline uint32_t key(const Record &r) { return encode(r.*Member); }
+};
+
+template <typename Record, float Record::*Member>
+struct KdFloatKey {
+    typedef float value_type;
+    static inline uint32_t encode(float v) { return kdFloatToKey(v); }
+    static inline uint32_t key(const Record &r) { return encode(r.*Member); }
+};
+
+// Signed integers (such as fixed-point coordinates) keep their order once
+// the sign bit is flipped
+template <typename Record, int32_t Record::*Member>
+struct KdInt32Key {
+    typedef int32_t value_type;
+    static inline uint32_t encode(int32_t v) { return (uint32_t)v ^ 0x80000000u; }
+    static inline uint32_t key(const Record &r) { return encode(r.*Member); }
+};
+
+// Compile-time access to the keys of a KdTree
+template <int Dim, typename Key, typename... Keys>
+struct KdKeyAt {
+    typedef typename KdKeyAt<Dim-1, Keys...>::type type;
+};
+
+template <typename Key, typename... Keys>
+struct KdKeyAt<0, Key, Keys...> {
+    typedef Key type;
+};
+
+template <typename Record, int Dim, typename... Keys>
+struct KdKeyList;
+
+template <typename Record, int Dim>
+struct KdKeyList<Record, Dim> {
+    static inline uint32_t key(const Record &, int) { return 0; }
+    static inline bool inRange(const Record &, const uint32_t (*)[2]) { return true; }
+    template <unsigned Mask>
+    static inline bool inRangeMasked(const Record &, const uint32_t (*)[2]) { return true; }
+};
+
+template <typename Record, int Dim, typename Key, typename... Keys>
+struct KdKeyList<Record, Dim, Key, Keys...> {
+    static inline uint32_t key(const Record &r, int dim)
+    {
+        return dim==Dim?Key::key(r):KdKeyList<Record, Dim+1, Keys...>::key(r, dim);
+    }
+    static inline bool inRange(const Record &r, const uint32_t (*range)[2])
+    {
+        uint32_t k = Key::key(r);
+        return range[Dim][0]<=k && k<=range[Dim][1] && KdKeyList<Record, Dim+1, Keys...>::inRange(r, range);
+    }
+    // Only the dimensions set in Mask are tested; the others compile away
+    template <unsigned Mask>
+    static inline bool inRangeMasked(const Record &r, const uint32_t (*range)[2])
+    {
+        return ((Mask & (1u<<Dim))==0 || (range[Dim][0]<=Key::key(r) && Key::key(r)<=range[Dim][1])) &&
+            KdKeyList<Record, Dim+1, Keys...>::template inRangeMasked<Mask>(r, range);
+    }
+};
+
+// Fills the kernel table with one instance per active-dimension mask
+template <typename Tree, unsigned Mask>
+struct KdKernelTable {
+    static void fill(std::vector<typename Tree::Kernel> &table)
+    {
+        table[Mask] = &Tree::template searchFrom<Mask>;
+        KdKernelTable<Tree, Mask-1>::fill(table);
+    }
+};
+
+template <typename Tree>
+struct KdKernelTable<Tree, 0> {
+    static void fill(std::vector<typename Tree::Kernel> &table)
+    {
+        table[0] = &Tree::template searchFrom<0>;
+    }
+};
+
+// Read-only KD-tree over fixed-size records, stored the way build_kdtrip
+// writes it: an array of KdTreeNode where child_node==0 marks a leaf (the
+// record is stored from median_value on, over NodesPerRecord nodes),
+// child_node==-1 an empty subtree, and otherwise child_node is the left
+// child, followed by the right child (after the left child's record if the
+// left child is a leaf). Internal nodes at depth d split on dimension
+// d%NumDims. KdTrip is the instantiation over Trip and its 7 keys; other
+// record types get their own index by instantiating this with their keys.
+template <typename Record, typename... Keys>
+class KdTree
+{
+public:
+    typedef KdTreeNode Node;
+    static constexpr int      NumDims = sizeof...(Keys);
+    static constexpr uint64_t NodesPerRecord = 1+(sizeof(Record)+sizeof(uint64_t))/sizeof(Node);
+    // Depth of a tree of up to 2^64 records with distinct keys. build()
+    // sends every key equal to the median left, so runs of equal keys give
+    // (n-1, 1) splits and a deeper tree: traversals only use this as a hint
+    static constexpr int      MaxDepth = 66;
+
+    template <int Dim>
+    struct Key {
+        typedef typename KdKeyAt<Dim, Keys...>::type type;
+    };
+
+    typedef std::vector<const Record*> RecordVector;
+
+    // Search kernel specialized for one set of active dimensions
+    typedef void (*Kernel)(const KdTree &tree, uint64_t root, const uint32_t (*range)[2], int dim,
+                           RecordVector &out);
+
+    // A subtree still to be searched, as left by collectSubtrees
+    struct Subtree {
+        uint64_t root;
+        int      dim;
+    };
+
+public:
+    KdTree() : nodes(NULL), endNode(NULL) {}
+
+    explicit KdTree(const std::string &fileName)
+    {
+        this->open(fileName);
+    }
+
+    void open(const std::string &fileName)
+    {
+        this->fTree.open(fileName);
+        this->nodes = reinterpret_cast<const Node*>(this->fTree.data());
+        this->endNode = this->nodes+this->fTree.size()/sizeof(Node);
+    }
+
+    const Node * begin() const { return this->nodes; }
+    const Node * end() const { return this->endNode; }
+
+    static inline int nextDim(int dim)
+    {
+        return dim+1==NumDims?0:dim+1;
+    }
+
+    static inline uint32_t key(const Record &r, int dim)
+    {
+        return KdKeyList<Record, 0, Keys...>::key(r, dim);
+    }
+
+    template <int Dim>
+    static inline uint32_t key(const Record &r)
+    {
+        return Key<Dim>::type::key(r);
+    }
+
+    // True when every key of r lies in its [range[d][0], range[d][1]]
+    static inline bool inRange(const Record &r, const uint32_t (*range)[2])
+    {
+        return KdKeyList<Record, 0, Keys...>::inRange(r, range);
+    }
+
+    inline uint64_t nodeIndex(const Record *record) const
+    {
+        return (reinterpret_cast<const char*>(record)-sizeof(uint64_t)-reinterpret_cast<const char*>(this->nodes))/sizeof(Node);
+    }
+
+    inline const Record * recordAtNode(uint64_t index) const
+    {
+        return reinterpret_cast<const Record*>(&(this->nodes[index].median_value));
+    }
+
+    // Right sibling of the node at left
+    inline uint64_t rightOf(uint64_t left) const
+    {
+        return left+1+(this->nodes[left].child_node==0?NodesPerRecord:0);
+    }
+
+    // Depth-first search below root (a node splitting on dim) for the
+    // records within range for which match(record) holds, pushed into out
+    // in tree order. Both children of a node are prefetched before the
+    // split test, and the position of the right child (which depends on
+    // whether the left child is a leaf) is only resolved when it is popped.
+    template <typename Match, typename Output>
+    void search(uint64_t root, const uint32_t (*range)[2], int dim, const Match &match, Output &out) const
+    {
+        std::vector<StackEntry> stack;
+        stack.reserve(128);
+        StackEntry entry = {root, dim, false};
+        stack.push_back(entry);
+        while (!stack.empty()) {
+            entry = stack.back();
+            stack.pop_back();
+            uint64_t index = entry.rightOf?this->rightOf(entry.node):entry.node;
+            const Node *node = this->nodes + index;
+            if (node->child_node==(uint64_t)-1) continue;
+            if (node->child_node==0) {
+                const Record *candidate = reinterpret_cast<const Record*>(&(node->median_value));
+                if (match(candidate))
+                    out.push_back(candidate);
+                continue;
+            }
+            uint64_t left = node->child_node;
+            KDTREE_PREFETCH(this->nodes+left);
+            KDTREE_PREFETCH(this->nodes+left+1);
+            KDTREE_PREFETCH(this->nodes+left+1+NodesPerRecord);
+            uint32_t median = node->median_value;
+            int childDim = nextDim(entry.dim);
+            if (range[entry.dim][1]>median) {
+                StackEntry right = {left, childDim, true};
+                stack.push_back(right);
+            }
+            if (range[entry.dim][0]<=median) {
+                StackEntry next = {left, childDim, false};
+                stack.push_back(next);
+            }
+        }
+    }
+
+    // Search for the same records as search(), for trees that are mostly
+    // not in memory yet. The traversal goes level by level over batches of
+    // up to batchSize nodes: the node ranges holding the children of a
+    // whole batch are handed to fetch(spans) at once (spans of [first,
+    // last) node indices), so they can be read with many requests in
+    // flight, and only then is the batch expanded; the search stops early
+    // when fetch returns false. Batches are taken from the back of the
+    // work list, which keeps it about depth*batchSize long. Records come
+    // out grouped by batch rather than in tree order.
+    template <typename Match, typename Fetch, typename Output>
+    void searchBatched(uint64_t root, const uint32_t (*range)[2], int dim, const Match &match,
+                       Fetch &fetch, Output &out, size_t batchSize=4096) const
+    {
+        uint64_t numNodes = this->endNode-this->nodes;
+        std::vector<std::pair<uint64_t, uint64_t> > spans;
+        spans.push_back(std::make_pair(root, std::min(numNodes, root+1+NodesPerRecord)));
+        if (!fetch(spans))
+            return;
+        std::vector<BatchEntry> work, batch;
+        BatchEntry first = {root, dim};
+        work.push_back(first);
+        while (!work.empty()) {
+            size_t take = std::min(batchSize, work.size());
+            batch.assign(work.end()-take, work.end());
+            work.resize(work.size()-take);
+            spans.clear();
+            for (size_t i=0; i<batch.size(); i++) {
+                const Node *node = this->nodes + batch[i].node;
+                if (node->child_node==(uint64_t)-1 || node->child_node==0)
+                    continue;
+                uint64_t left = node->child_node;
+                spans.push_back(std::make_pair(left, std::min(numNodes, left+2+2*NodesPerRecord)));
+            }
+            if (!fetch(spans))
+                return;
+            for (size_t i=0; i<batch.size(); i++) {
+                const Node *node = this->nodes + batch[i].node;
+                if (node->child_node==(uint64_t)-1) continue;
+                if (node->child_node==0) {
+                    const Record *candidate = reinterpret_cast<const Record*>(&(node->median_value));
+                    if (match(candidate))
+                        out.push_back(candidate);
+                    continue;
+                }
+                uint64_t left = node->child_node;
+                uint32_t median = node->median_value;
+                int childDim = nextDim(batch[i].dim);
+                if (range[batch[i].dim][1]>median) {
+                    BatchEntry right = {this->rightOf(left), childDim};
+                    work.push_back(right);
+                }
+                if (range[batch[i].dim][0]<=median) {
+                    BatchEntry next = {left, childDim};
+                    work.push_back(next);
+                }
+            }
+        }
+    }
+
+    // Recursive search that also tracks the key bounds of the subtree being
+    // visited: bounds[d] starts as the caller's bounds for dimension d and
+    // is narrowed at every split. A child is skipped when visit(bounds, dim)
+    // returns false right after bounds[dim] was narrowed for it, which lets
+    // predicates that are not boxes (a recurring time pattern) prune too.
+    // The right child can hold keys equal to the median, so its lower bound
+    // is the median itself.
+    template <typename Match, typename Visit, typename Output>
+    void searchBounded(uint64_t root, const uint32_t (*range)[2], int dim, uint32_t (*bounds)[2],
+                       const Match &match, const Visit &visit, Output &out) const
+    {
+        const Node *node = this->nodes + root;
+        if (node->child_node==(uint64_t)-1) return;
+        if (node->child_node==0) {
+            const Record *candidate = reinterpret_cast<const Record*>(&(node->median_value));
+            if (match(candidate))
+                out.push_back(candidate);
+            return;
+        }
+        uint64_t left = node->child_node;
+        KDTREE_PREFETCH(this->nodes+left);
+        KDTREE_PREFETCH(this->nodes+left+1);
+        KDTREE_PREFETCH(this->nodes+left+1+NodesPerRecord);
+        uint32_t median = node->median_value;
+        uint32_t lo = bounds[dim][0], hi = bounds[dim][1];
+        if (range[dim][0]<=median) {
+            bounds[dim][1] = std::min(hi, median);
+            if (visit(bounds, dim))
+                this->searchBounded(left, range, nextDim(dim), bounds, match, visit, out);
+            bounds[dim][1] = hi;
+        }
+        if (range[dim][1]>median) {
+            bounds[dim][0] = std::max(lo, median);
+            if (visit(bounds, dim))
+                this->searchBounded(this->rightOf(left), range, nextDim(dim), bounds, match, visit, out);
+            bounds[dim][0] = lo;
+        }
+    }
+
+    // Best-first search for the k records within range closest to some
+    // point, among those for which match(record) holds. distance.toRecord(r)
+    // is the distance of a record and distance.toBox(bounds) a lower bound
+    // on it for every record whose keys lie in bounds (bounds[d] for each
+    // dimension, never wider than range). Subtrees are expanded closest
+    // bound first from a priority queue while the best k so far sit in a
+    // bounded max-heap, and the search stops once no pending subtree can
+    // beat the k-th record. out gets (distance, record), closest first.
+    template <typename Match, typename Distance>
+    void nearest(const uint32_t (*range)[2], size_t k, const Match &match, const Distance &distance,
+                 std::vector<std::pair<double, const Record*> > &out) const
+    {
+        typedef std::pair<double, const Record*> Neighbor;
+        out.clear();
+        if (k==0 || this->nodes==this->endNode)
+            return;
+        std::priority_queue<Neighbor> best;
+        std::priority_queue<NearestEntry, std::vector<NearestEntry>, std::greater<NearestEntry> > pending;
+        NearestEntry root;
+        root.node = 0;
+        root.dim = 0;
+        memcpy(root.bounds, range, sizeof(root.bounds));
+        root.bound = distance.toBox(root.bounds);
+        pending.push(root);
+        while (!pending.empty()) {
+            NearestEntry entry = pending.top();
+            pending.pop();
+            if (best.size()==k && entry.bound>=best.top().first)
+                break;
+            const Node *node = this->nodes + entry.node;
+            if (node->child_node==(uint64_t)-1) continue;
+            if (node->child_node==0) {
+                const Record *candidate = reinterpret_cast<const Record*>(&(node->median_value));
+                if (!match(candidate))
+                    continue;
+                double d = distance.toRecord(*candidate);
+                if (best.size()<k)
+                    best.push(Neighbor(d, candidate));
+                else if (d<best.top().first) {
+                    best.pop();
+                    best.push(Neighbor(d, candidate));
+                }
+                continue;
+            }
+            uint64_t left = node->child_node;
+            uint32_t median = node->median_value;
+            int dim = entry.dim;
+            NearestEntry child = entry;
+            child.dim = nextDim(dim);
+            if (range[dim][0]<=median) {
+                child.node = left;
+                child.bounds[dim][1] = std::min(entry.bounds[dim][1], median);
+                child.bound = distance.toBox(child.bounds);
+                pending.push(child);
+            }
+            if (range[dim][1]>median) {
+                child.node = this->rightOf(left);
+                child.bounds[dim][0] = std::max(entry.bounds[dim][0], median);
+                child.bounds[dim][1] = entry.bounds[dim][1];
+                child.bound = distance.toBox(child.bounds);
+                pending.push(child);
+            }
+        }
+        out.resize(best.size());
+        for (size_t i=out.size(); i>0; i--) {
+            out[i-1] = best.top();
+            best.pop();
+        }
+    }
+
+    // Kernel for the dimensions set in activeMask (bit d for dimension d).
+    // Most queries constrain only a few dimensions: the kernel neither
+    // compares medians at the levels that split on an inactive dimension
+    // nor tests inactive keys at the leaves, so a record is returned when
+    // its active keys are in range. The 2^NumDims instances are generated
+    // at compile time and the table is built once.
+    static Kernel kernel(unsigned activeMask)
+    {
+        static const std::vector<Kernel> table = makeKernelTable();
+        return table[activeMask & ((1u<<NumDims)-1)];
+    }
+
+    template <unsigned Mask>
+    static void searchFrom(const KdTree &tree, uint64_t root, const uint32_t (*range)[2], int dim, RecordVector &out)
+    {
+        tree.template searchActive<Mask>(root, range, dim, out);
+    }
+
+    // The explicit-stack loop of search(), prefetching both children and
+    // resolving the right one when popped, with the tests specialized for
+    // Mask: the leaf test only reads the active keys, and a level
+    // splitting on an inactive dimension takes both children without
+    // comparing its median. The loop goes on with the left child directly
+    // and only stacks right siblings.
+    template <unsigned Mask>
+    void searchActive(uint64_t root, const uint32_t (*range)[2], int dim, RecordVector &out) const
+    {
+        // left siblings of the right children still to visit, at most one
+        // per level
+        std::vector<BatchEntry> stack;
+        stack.reserve(MaxDepth+1);
+        uint64_t index = root;
+        while (true) {
+            const Node *node = this->nodes + index;
+            if (node->child_node!=0 && node->child_node!=(uint64_t)-1) {
+                uint64_t left = node->child_node;
+                KDTREE_PREFETCH(this->nodes+left);
+                KDTREE_PREFETCH(this->nodes+left+1);
+                KDTREE_PREFETCH(this->nodes+left+1+NodesPerRecord);
+                bool active = (Mask & (1u<<dim))!=0;
+                uint32_t median = node->median_value;
+                bool toLeft = !active || range[dim][0]<=median;
+                bool toRight = !active || range[dim][1]>median;
+                dim = nextDim(dim);
+                if (toLeft) {
+                    if (toRight) {
+                        BatchEntry right = {left, dim};
+                        stack.push_back(right);
+                    }
+                    index = left;
+                    continue;
+                }
+                if (toRight) {
+                    index = this->rightOf(left);
+                    continue;
+                }
+            }
+            else if (node->child_node==0) {
+                const Record *candidate = reinterpret_cast<const Record*>(&(node->median_value));
+                if (KdKeyList<Record, 0, Keys...>::template inRangeMasked<Mask>(*candidate, range))
+                    out.push_back(candidate);
+            }
+            if (stack.empty())
+                return;
+            BatchEntry entry = stack.back();
+            stack.pop_back();
+            index = this->rightOf(entry.node);
+            dim = entry.dim;
+        }
+    }
+
+    // Same pruning as search, but stops maxDepth levels below root and
+    // records the subtrees still to be searched instead of descending
+    void collectSubtrees(uint64_t root, const uint32_t (*range)[2], int dim, int depth, int maxDepth,
+                         std::vector<Subtree> &subtrees) const
+    {
+        const Node *node = this->nodes + root;
+        if (node->child_node==(uint64_t)-1) return;
+        if (node->child_node==0 || depth>=maxDepth) {
+            Subtree subtree = {root, dim};
+            subtrees.push_back(subtree);
+            return;
+        }
+        uint32_t median = node->median_value;
+        if (range[dim][0]<=median)
+            collectSubtrees(node->child_node, range, nextDim(dim), depth+1, maxDepth, subtrees);
+        if (range[dim][1]>median)
+            collectSubtrees(this->rightOf(node->child_node), range, nextDim(dim), depth+1, maxDepth, subtrees);
+    }
+
+    // Same walk as collectSubtrees, for a sample of the records: of the
+    // subtrees maxDepth levels below root (and the leaves above them) only
+    // those whose position hashes to a multiple of stride are recorded, so
+    // the rest are never visited. The same record always falls in the same
+    // subtree, whatever the range.
+    void collectSample(uint64_t root, const uint32_t (*range)[2], int dim, int depth, int maxDepth,
+                       unsigned stride, std::vector<Subtree> &subtrees) const
+    {
+        const Node *node = this->nodes + root;
+        if (node->child_node==(uint64_t)-1) return;
+        if (node->child_node==0 || depth>=maxDepth) {
+            if (((root*0x9E3779B97F4A7C15ull)>>32)%stride==0) {
+                Subtree subtree = {root, dim};
+                subtrees.push_back(subtree);
+            }
+            return;
+        }
+        uint32_t median = node->median_value;
+        if (range[dim][0]<=median)
+            collectSample(node->child_node, range, nextDim(dim), depth+1, maxDepth, stride, subtrees);
+        if (range[dim][1]>median)
+            collectSample(this->rightOf(node->child_node), range, nextDim(dim), depth+1, maxDepth, stride, subtrees);
+    }
+
+    // Depth of the tree when balanced, as build() leaves it
+    int depth() const
+    {
+        uint64_t records = (this->endNode-this->nodes)/(NodesPerRecord+1);
+        int d = 0;
+        while (((uint64_t)1<<d)<records)
+            d++;
+        return d;
+    }
+
+    // Upper bound on the number of nodes build() uses for n records
+    static uint64_t maxNodes(uint64_t n)
+    {
+        return (NodesPerRecord+1)*n+n*3/2;
+    }
+
+    // Builds the tree over records (which are reordered) into nodes, using
+    // tmp (n keys) as scratch space; returns the number of nodes written
+    static uint64_t build(Record *records, uint64_t n, Node *nodes, uint32_t *tmp)
+    {
+        uint64_t freeNode = 1;
+        buildNode(nodes, tmp, records, n, 0, 0, freeNode);
+        return freeNode;
+    }
+
+private:
+    boost::iostreams::mapped_file_source fTree;
+    const Node *nodes;
+    const Node *endNode;
+
+    static std::vector<Kernel> makeKernelTable()
+    {
+        std::vector<Kernel> table(1u<<NumDims);
+        KdKernelTable<KdTree, (1u<<NumDims)-1>::fill(table);
+        return table;
+    }
+
+    // A subtree waiting in nearest(), with the key bounds of its records
+    struct NearestEntry {
+        double   bound;
+        uint64_t node;
+        int      dim;
+        uint32_t bounds[NumDims][2];
+        bool operator>(const NearestEntry &e) const { return this->bound>e.bound; }
+    };
+
+    struct BatchEntry {
+        uint64_t node;
+        int      dim;
+    };
+
+    struct StackEntry {
+        uint64_t node;
+        int      dim;
+        bool     rightOf;  // node is the left sibling of the one to visit
+    };
+
+    static void buildNode(Node *nodes, uint32_t *tmp, Record *records, uint64_t n, int dim,
+                          uint64_t thisNode, uint64_t &freeNode)
+    {
+        Node *node = nodes + thisNode;
+        if (n<2) {
+            node->child_node = 0;
+            memcpy(&(node->median_value), records, sizeof(Record));
+            return;
+        }
+        for (uint64_t i=0; i<n; i++)
+            tmp[i] = key(records[i], dim);
+        std::nth_element(tmp, tmp+n/2-1, tmp+n);
+        uint32_t median = tmp[n/2-1];
+        int64_t l = 0;
+        int64_t r = n-1;
+        while (l<r) {
+            while (l<(int64_t)n && key(records[l], dim)<=median) l++;
+            while (r>=0 && key(records[r], dim)>median) r--;
+            if (l<r)
+                std::swap(records[l], records[r]);
+        }
+        uint64_t medianIndex = r;
+        if (medianIndex==n-1)
+            medianIndex = n-2;
+        node->median_value = median;
+        node->child_node = freeNode;
+        freeNode += 2 + ((uint64_t)(medianIndex+1<2))*NodesPerRecord + ((uint64_t)((n-medianIndex-1<2)&&(n-medianIndex-1>0)))*NodesPerRecord;
+        buildNode(nodes, tmp, records, medianIndex+1, nextDim(dim), node->child_node, freeNode);
+        if (medianIndex<n-1)
+            buildNode(nodes, tmp, records + medianIndex+1, n-medianIndex-1, nextDim(dim),
+                      node->child_node+1+((uint64_t)(medianIndex+1<2))*NodesPerRecord, freeNode);
+        else
+            nodes[node->child_node+1].child_node = -1;
+    }
+};
+
+template <typename Record, typename... Keys>
+constexpr int KdTree<Record, Keys...>::NumDims;
+
+template <typename Record, typename... Keys>
+constexpr uint64_t KdTree<Record, Keys...>::NodesPerRecord;
+
+#endif
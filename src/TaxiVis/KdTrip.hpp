@@ -1,15 +1,29 @@
 #ifndef KD_TRIP_QUERY_HPP
 #define KD_TRIP_QUERY_HPP
 
+#include <stdio.h>
 #include <stdint.h>
 #include <time.h>
 #include <limits.h>
 #include <float.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <vector>
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/unordered_set.hpp>
+#include "KdTree.hpp"
+#include "ThreadPool.hpp"
+#include "AsyncBlockReader.hpp"
 
+// A KdTrip is read-only once constructed: the index files are mapped
+// read-only and no query keeps state in the object, so any number of
+// threads may run execute*() and iterate over the same instance at once
+// (the block reader of executeAsync synchronizes internally).
 class KdTrip
 {
 public:
@@ -42,8 +56,226 @@ public:
         // }
     };
     typedef boost::unordered_set<const Trip*> TripSet;
+
+    // The index is the generic KD-tree over Trip with these 7 keys, in the
+    // order build_kdtrip splits on them
+    typedef KdTree<Trip,
+                   KdMemberKey<Trip, uint32_t, &Trip::pickup_time>,
+                   KdMemberKey<Trip, uint32_t, &Trip::dropoff_time>,
+                   KdFloatKey<Trip, &Trip::pickup_long>,
+                   KdFloatKey<Trip, &Trip::pickup_lat>,
+                   KdFloatKey<Trip, &Trip::dropoff_long>,
+                   KdFloatKey<Trip, &Trip::dropoff_lat>,
+                   KdMemberKey<Trip, uint16_t, &Trip::id_taxi> > Tree;
+    typedef KdTreeNode KdNode;
     // typedef std::set<const Trip*> TripSet;
 
+    // Recurring selection in local time, as picked in the TimeWidget: the
+    // hours that fall in one of the years, months, weekdays and hours of
+    // day set below. A trip matches when it is picked up and dropped off
+    // within one run of consecutive selected hours; runs are cut at
+    // midnight unless every hour of the day is selected. These are the
+    // same trips as those of the date/time ranges TimeWidget expands the
+    // pattern into.
+    struct TimePattern {
+        TimePattern(): years(0), months(0), weekdays(0), hours(0) {}
+
+        void addYear(int year)
+        {
+            if (year>=1970 && year<2034)
+                this->years |= 1ull<<(year-1970);
+        }
+
+        bool hasHour(const struct tm &t) const
+        {
+            return ((this->years>>(t.tm_year-70))&1) && ((this->months>>t.tm_mon)&1) &&
+                   ((this->weekdays>>((t.tm_wday+6)%7))&1) && ((this->hours>>t.tm_hour)&1);
+        }
+
+        uint64_t years;     // bit y-1970
+        uint16_t months;    // bit m-1
+        uint8_t  weekdays;  // bit 0 for Monday to bit 6 for Sunday
+        uint32_t hours;     // bit h for h:00 to h:59
+    };
+
+    // A TimePattern unrolled over the hours of its years: bit i of selected
+    // stands for the hour starting at base+i*3600, and bit i of dayStarts
+    // is set when that hour is a local midnight. New York is a whole number
+    // of hours off UTC all year, so these hours are the local clock hours.
+    class HourMask {
+    public:
+        explicit HourMask(const TimePattern &pattern)
+        {
+            this->base = 0;
+            this->numHours = 0;
+            this->firstHour = this->lastHour = 0;
+            this->wholeDays = (pattern.hours&0xFFFFFF)==0xFFFFFF;
+            if (pattern.years==0)
+                return;
+            int firstYear = 1970, lastYear = 2033;
+            while (!((pattern.years>>(firstYear-1970))&1)) firstYear++;
+            while (!((pattern.years>>(lastYear-1970))&1)) lastYear--;
+            this->base = (uint32_t)Query::createTime(firstYear, 1, 1, 0, 0, 0);
+            uint32_t end = (uint32_t)Query::createTime(lastYear+1, 1, 1, 0, 0, 0);
+            this->numHours = (end-this->base)/3600;
+            this->selected.assign(this->numHours/64+1, 0);
+            this->dayStarts.assign(this->numHours/64+1, 0);
+            bool found = false;
+            for (uint64_t h=0; h<this->numHours; h++) {
+                time_t t = this->base+h*3600;
+                struct tm timeinfo;
+                localtime_r(&t, &timeinfo);
+                if (timeinfo.tm_hour==0)
+                    this->dayStarts[h/64] |= 1ull<<(h%64);
+                if (pattern.hasHour(timeinfo)) {
+                    this->selected[h/64] |= 1ull<<(h%64);
+                    if (!found)
+                        this->firstHour = h;
+                    this->lastHour = h;
+                    found = true;
+                }
+            }
+            if (!found)
+                this->numHours = 0;
+        }
+
+        bool isEmpty() const { return this->numHours==0; }
+        // First and last second of the selected hours
+        uint32_t firstTime() const { return this->base+this->firstHour*3600; }
+        uint32_t lastTime() const { return this->base+this->lastHour*3600+3599; }
+
+        bool matches(uint32_t pickupTime, uint32_t dropoffTime) const
+        {
+            uint32_t t0 = std::min(pickupTime, dropoffTime), t1 = std::max(pickupTime, dropoffTime);
+            if (t0<this->base || (t1-this->base)/3600>=this->numHours)
+                return false;
+            uint64_t h0 = (t0-this->base)/3600, h1 = (t1-this->base)/3600;
+            return allSet(this->selected, h0, h1) && (this->wholeDays || !anySet(this->dayStarts, h0+1, h1));
+        }
+
+        // False when no selected hour overlaps [t0, t1]
+        bool intersects(uint32_t t0, uint32_t t1) const
+        {
+            if (this->numHours==0 || t1<this->base || t0>t1)
+                return false;
+            uint64_t h0 = t0<this->base?0:(t0-this->base)/3600;
+            uint64_t h1 = std::min<uint64_t>((t1-this->base)/3600, this->numHours-1);
+            return h0<=h1 && anySet(this->selected, h0, h1);
+        }
+
+        // Maximal [first second, last second] spans of consecutive selected
+        // hours
+        void spans(std::vector<std::pair<uint32_t, uint32_t> > &result) const
+        {
+            uint64_t h = 0;
+            while (h<this->numHours) {
+                if (!((this->selected[h/64]>>(h%64))&1)) {
+                    h++;
+                    continue;
+                }
+                uint64_t first = h;
+                while (h<this->numHours && ((this->selected[h/64]>>(h%64))&1)) h++;
+                result.push_back(std::make_pair(this->base+first*3600, this->base+h*3600-1));
+            }
+        }
+
+    private:
+        uint32_t base;
+        uint64_t numHours;
+        uint64_t firstHour, lastHour;
+        bool     wholeDays;
+        std::vector<uint64_t> selected;
+        std::vector<uint64_t> dayStarts;
+
+        // The bits of word w that stand for hours h0..h1 (inclusive)
+        static uint64_t wordMask(uint64_t h0, uint64_t h1, uint64_t word)
+        {
+            uint64_t lo = word*64<h0?h0-word*64:0;
+            uint64_t hi = std::min<uint64_t>(h1-word*64, 63);
+            return (hi==63?~0ull:((1ull<<(hi+1))-1)) & ~((1ull<<lo)-1);
+        }
+
+        static bool allSet(const std::vector<uint64_t> &bits, uint64_t h0, uint64_t h1)
+        {
+            for (uint64_t w=h0/64; w<=h1/64; w++) {
+                uint64_t mask = wordMask(h0, h1, w);
+                if ((bits[w]&mask)!=mask)
+                    return false;
+            }
+            return true;
+        }
+
+        static bool anySet(const std::vector<uint64_t> &bits, uint64_t h0, uint64_t h1)
+        {
+            for (uint64_t w=h0/64; h0<=h1 && w<=h1/64; w++)
+                if (bits[w]&wordMask(h0, h1, w))
+                    return true;
+            return false;
+        }
+    };
+
+    // A set of [first second, last second] time intervals, as expanded from
+    // a DateTimeList. A trip matches when it is picked up and dropped off
+    // within the same interval, which is what one query per interval would
+    // select. Both tests are a binary search over the intervals sorted by
+    // start, keeping for each the latest end among those up to it.
+    class TimeRanges {
+    public:
+        explicit TimeRanges(std::vector<std::pair<uint32_t, uint32_t> > ranges)
+        {
+            std::sort(ranges.begin(), ranges.end());
+            for (size_t i=0; i<ranges.size(); i++) {
+                if (ranges[i].first>ranges[i].second)
+                    continue;
+                uint32_t end = ranges[i].second;
+                if (!this->maxEnds.empty())
+                    end = std::max(end, this->maxEnds.back());
+                this->starts.push_back(ranges[i].first);
+                this->maxEnds.push_back(end);
+                this->intervals.push_back(ranges[i]);
+            }
+        }
+
+        bool isEmpty() const { return this->starts.empty(); }
+        uint32_t firstTime() const { return this->starts.front(); }
+        uint32_t lastTime() const { return this->maxEnds.back(); }
+
+        bool matches(uint32_t pickupTime, uint32_t dropoffTime) const
+        {
+            return this->spanned(std::min(pickupTime, dropoffTime), std::max(pickupTime, dropoffTime));
+        }
+
+        // False when no interval overlaps [t0, t1]
+        bool intersects(uint32_t t0, uint32_t t1) const
+        {
+            return t0<=t1 && this->spanned(t1, t0);
+        }
+
+        // Maximal [first second, last second] spans covered by the intervals
+        void spans(std::vector<std::pair<uint32_t, uint32_t> > &result) const
+        {
+            for (size_t i=0; i<this->intervals.size(); i++) {
+                if (!result.empty() && this->intervals[i].first<=result.back().second)
+                    result.back().second = std::max(result.back().second, this->intervals[i].second);
+                else
+                    result.push_back(this->intervals[i]);
+            }
+        }
+
+    private:
+        std::vector<uint32_t> starts;
+        std::vector<uint32_t> maxEnds;   // latest end among intervals 0..i
+        std::vector<std::pair<uint32_t, uint32_t> > intervals;
+
+        // True when an interval starting at or before start ends at or
+        // after end
+        bool spanned(uint32_t start, uint32_t end) const
+        {
+            size_t n = std::upper_bound(this->starts.begin(), this->starts.end(), start)-this->starts.begin();
+            return n>0 && this->maxEnds[n-1]>=end;
+        }
+    };
+
     struct Query
     {
         Query() {
@@ -55,6 +287,7 @@ public:
             maxPickupLong = maxPickupLat = FLT_MAX;
             minDropoffLong = minDropoffLat = -FLT_MAX;
             maxDropoffLong = maxDropoffLat = FLT_MAX;
+            sampleStride = 1;
         }
 
         void setPickupTimeInterval(uint64_t t0, uint64_t t1) {
@@ -89,6 +322,79 @@ public:
             this->maxDropoffLong = lon1;
         }
 
+        // Restricts the query to a recurring pattern; the pickup and dropoff
+        // time intervals become the span of the selected hours
+        void setTimePattern(const TimePattern &pattern)
+        {
+            this->timePattern = boost::shared_ptr<const HourMask>(new HourMask(pattern));
+            if (this->timePattern->isEmpty()) {
+                this->setPickupTimeInterval(1, 0);
+                this->setDropoffTimeInterval(1, 0);
+                return;
+            }
+            this->setPickupTimeInterval(this->timePattern->firstTime(), this->timePattern->lastTime());
+            this->setDropoffTimeInterval(this->timePattern->firstTime(), this->timePattern->lastTime());
+        }
+
+        // Restricts the query to a set of time intervals, searched in one
+        // pass; the pickup and dropoff time intervals become their span
+        void setTimeRanges(const std::vector<std::pair<uint32_t, uint32_t> > &ranges)
+        {
+            this->timeRanges = boost::shared_ptr<const TimeRanges>(new TimeRanges(ranges));
+            if (this->timeRanges->isEmpty()) {
+                this->setPickupTimeInterval(1, 0);
+                this->setDropoffTimeInterval(1, 0);
+                return;
+            }
+            this->setPickupTimeInterval(this->timeRanges->firstTime(), this->timeRanges->lastTime());
+            this->setDropoffTimeInterval(this->timeRanges->firstTime(), this->timeRanges->lastTime());
+        }
+
+        // Lets another thread abandon the query by setting flag: the
+        // traversals check it between subtrees and return what they found
+        // so far, which the caller is expected to throw away
+        void setCancelFlag(const boost::shared_ptr<std::atomic<bool> > &flag)
+        {
+            this->cancelFlag = flag;
+        }
+
+        bool isCancelled() const
+        {
+            return this->cancelFlag && this->cancelFlag->load(std::memory_order_relaxed);
+        }
+
+        // Asks for a sample of about 1 in stride of the trips, for previews:
+        // the traversal only descends into that share of the small subtrees
+        // near the leaves (see executeSample), so it does that much less
+        // work. 1 (the default) returns every trip.
+        void setSampleStride(unsigned stride)
+        {
+            this->sampleStride = std::max(stride, 1u);
+        }
+
+        // True when only the time windows are constrained, which is what the
+        // empty SelectionGraph asks for; these can be served by the time index
+        bool isTimeOnly() const
+        {
+            return (this->minPickupLong==-FLT_MAX && this->maxPickupLong==FLT_MAX &&
+                    this->minPickupLat==-FLT_MAX && this->maxPickupLat==FLT_MAX &&
+                    this->minDropoffLong==-FLT_MAX && this->maxDropoffLong==FLT_MAX &&
+                    this->minDropoffLat==-FLT_MAX && this->maxDropoffLat==FLT_MAX &&
+                    this->minTaxiId==0 && this->maxTaxiId==USHRT_MAX);
+        }
+
+        // Bit d is set when the d-th key of Tree is constrained
+        unsigned activeMask() const
+        {
+            return ((this->minPickupTime>0 || this->maxPickupTime<UINT_MAX)?1u:0u) |
+                   ((this->minDropoffTime>0 || this->maxDropoffTime<UINT_MAX)?2u:0u) |
+                   ((this->minPickupLong>-FLT_MAX || this->maxPickupLong<FLT_MAX)?4u:0u) |
+                   ((this->minPickupLat>-FLT_MAX || this->maxPickupLat<FLT_MAX)?8u:0u) |
+                   ((this->minDropoffLong>-FLT_MAX || this->maxDropoffLong<FLT_MAX)?16u:0u) |
+                   ((this->minDropoffLat>-FLT_MAX || this->maxDropoffLat<FLT_MAX)?32u:0u) |
+                   ((this->minTaxiId>0 || this->maxTaxiId<USHRT_MAX)?64u:0u);
+        }
+
         bool isMatched(const Trip *trip) const
         {
             return (this->minPickupTime<=trip->pickup_time && trip->pickup_time<=this->maxPickupTime &&
@@ -97,7 +403,9 @@ public:
                     this->minPickupLat<=trip->pickup_lat && trip->pickup_lat<=this->maxPickupLat &&
                     this->minDropoffLong<=trip->dropoff_long && trip->dropoff_long<=this->maxDropoffLong &&
                     this->minDropoffLat<=trip->dropoff_lat && trip->dropoff_lat<=this->maxDropoffLat &&
-                    this->minTaxiId<=trip->id_taxi && trip->id_taxi<=this->maxTaxiId);
+                    this->minTaxiId<=trip->id_taxi && trip->id_taxi<=this->maxTaxiId &&
+                    (!this->timePattern || this->timePattern->matches(trip->pickup_time, trip->dropoff_time)) &&
+                    (!this->timeRanges || this->timeRanges->matches(trip->pickup_time, trip->dropoff_time)));
         }
 
         uint32_t minPickupTime, maxPickupTime;
@@ -107,6 +415,11 @@ public:
         float    minPickupLat, maxPickupLat;
         float    minDropoffLong, maxDropoffLong;
         float    minDropoffLat, maxDropoffLat;
+        // shared so that copying a query stays cheap
+        boost::shared_ptr<const HourMask> timePattern;
+        boost::shared_ptr<const TimeRanges> timeRanges;
+        boost::shared_ptr<std::atomic<bool> > cancelFlag;
+        unsigned sampleStride;
 
         inline static uint64_t createTime(int year, int month, int day, int hour, int min, int sec) {
             struct tm timeinfo;
@@ -132,8 +445,8 @@ public:
         inline const Trip *  operator->() { return *(this->iter); }
         inline QueryIterator operator++() { this->iter++; return *this; }
         inline QueryIterator operator--() { this->iter--; return *this; }
-        inline QueryIterator operator+=(int dif) { this->iter+=dif; return *this; }
-        inline QueryIterator operator-=(int dif) { this->iter-=dif; return *this; }
+        inline QueryIterator operator+=(ptrdiff_t dif) { this->iter+=dif; return *this; }
+        inline QueryIterator operator-=(ptrdiff_t dif) { this->iter-=dif; return *this; }
         inline QueryIterator operator++(int) { this->iter++; return *this; }
         inline QueryIterator operator--(int) { this->iter--; return *this; }
         inline ptrdiff_t     operator-(const QueryIterator &it) { return this->iter-it.iter;}
@@ -155,22 +468,125 @@ public:
     };
 
 #pragma pack(push, 1)
-    struct KdNode {
-        uint64_t child_node;
-        uint32_t median_value;
+    // Companion index (<tree>.tidx) holding the node offset of every trip
+    // sorted by pickup time, plus a coarse directory mapping each
+    // bucketSeconds-wide time bucket to its first entry:
+    //   TimeIndexHeader
+    //   uint64_t directory[numBuckets+1]
+    //   uint64_t nodes[numTrips]
+    //   uint32_t pickupTimes[numTrips]
+    struct TimeIndexHeader {
+        char     magic[4];
+        uint32_t version;
+        uint64_t numTrips;
+        uint32_t baseTime;
+        uint32_t bucketSeconds;
+        uint64_t numBuckets;
+    };
+
+    // Leaf directory (<tree>.leaves): the node offset of every trip in the
+    // order the trips are laid out in the tree file, so the n-th trip can be
+    // reached in O(1) and a full scan can be cut into equal ranges:
+    //   LeafDirectoryHeader
+    //   uint64_t nodes[numTrips]
+    struct LeafDirectoryHeader {
+        char     magic[4];
+        uint32_t version;
+        uint64_t numTrips;
+    };
+
+    // Origin-destination index (<tree>.od): trips grouped by (pickup cell,
+    // dropoff cell) on a uniform lat/long grid, each group sorted by pickup
+    // time. Cell r*cols+c covers [minLat+r*cellSize, minLat+(r+1)*cellSize)
+    // x [minLong+c*cellSize, ...); cell rows*cols collects everything
+    // outside the grid. Only the pairs that occur are stored:
+    //   OdIndexHeader
+    //   uint64_t pairKeys[numPairs]       (pickupCell*(numCells+1)+dropoffCell, sorted)
+    //   uint64_t pairOffsets[numPairs+1]  (first entry of each pair)
+    //   uint64_t nodes[numTrips]
+    //   uint32_t pickupTimes[numTrips]
+    struct OdIndexHeader {
+        char     magic[4];
+        uint32_t version;
+        uint64_t numTrips;
+        float    minLat;
+        float    minLong;
+        float    cellSize;
+        uint32_t rows;
+        uint32_t cols;
+        uint32_t reserved;
+        uint64_t numPairs;
+    };
+
+    // Trip chain table (<tree>.chain), in leaf directory order: for every
+    // trip, the ordinal of the same taxi's next trip (NoNextTrip for its
+    // last one), the seconds from this dropoff to that pickup and the
+    // straight-line distance between them:
+    //   ChainHeader
+    //   ChainEntry entries[numTrips]
+    struct ChainHeader {
+        char     magic[4];
+        uint32_t version;
+        uint64_t numTrips;
+    };
+
+    struct ChainEntry {
+        uint64_t next;
+        int32_t  gapSeconds;
+        float    gapMeters;
     };
 #pragma pack(pop)
 
+    static const uint64_t NoNextTrip = (uint64_t)-1;
+
+    // Depth at which executeKdTree splits a cancellable query, giving up
+    // to 2^depth points where the cancel flag is checked
+    static const int CancelSplitDepth = 10;
+
+    // Sampled queries keep or skip whole subtrees of up to 2^depth trips
+    static const int SampleSubtreeDepth = 5;
+
+    // Idle time between a dropoff and the same taxi's next pickup, summed
+    // over the gaps of one region and hour of day. Gaps longer than the
+    // shift threshold are counted as shift ends instead.
+    struct IdleStats {
+        IdleStats(): gaps(0), shiftEnds(0), idleSeconds(0), deadheadMeters(0) {}
+        void merge(const IdleStats &s) {
+            gaps += s.gaps;
+            shiftEnds += s.shiftEnds;
+            idleSeconds += s.idleSeconds;
+            deadheadMeters += s.deadheadMeters;
+        }
+        uint64_t gaps;
+        uint64_t shiftEnds;
+        double   idleSeconds;
+        double   deadheadMeters;
+    };
+
+    // Walks every trip in file order. With a leaf directory each step is a
+    // single lookup; without one it steps over the tree node by node.
     struct Iterator {
         Iterator() {}
-        Iterator(const Trip*t, const KdNode *e): trip(t), end(e) {}
+        Iterator(const Trip*t, const KdNode *e, int s): trip(t), end(e), leaf(NULL), leafEnd(NULL), nodes(NULL), step(s) {}
+        Iterator(const uint64_t *l, const uint64_t *le, const KdNode *n, const KdNode *e):
+            end(e), leaf(l), leafEnd(le), nodes(n), step(0)
+        {
+            this->setLeaf();
+        }
 
         const Trip &  operator *() { return *this->trip; }
         const Trip *  operator->() { return this->trip; }
         bool          operator==(const Iterator &it) const { return this->trip==it.trip; }
         bool          operator!=(const Iterator &it) const { return this->trip!=it.trip; }
         Iterator      operator++(int) {
-            const KdNode *node = reinterpret_cast<const KdNode*>(this->trip+1);
+            if (this->leaf) {
+                this->leaf++;
+                this->setLeaf();
+                return *this;
+            }
+            // build_kdtrip gives every leaf numNodesPerTrip+1 nodes (step),
+            // so the next node starts step nodes after the leaf node
+            const KdNode *node = reinterpret_cast<const KdNode*>(reinterpret_cast<const char*>(this->trip)-sizeof(uint64_t))+this->step;
             while (node<this->end && node->child_node!=0) node++;
             if (node<this->end) {
                 this->trip = reinterpret_cast<const Trip*>(&(node->median_value));
@@ -180,69 +596,714 @@ public:
             return *this;
         }
     private:
+        void setLeaf() {
+            if (this->leaf<this->leafEnd)
+                this->trip = reinterpret_cast<const Trip*>(&(this->nodes[*this->leaf].median_value));
+            else
+                this->trip = reinterpret_cast<const Trip*>(this->end);
+        }
+
         const Trip *trip;
         const KdNode *end;
+        const uint64_t *leaf;
+        const uint64_t *leafEnd;
+        const KdNode *nodes;
+        int step;
     };
 
+    // Half-open range [first, last) of trip ordinals
+    typedef std::pair<uint64_t, uint64_t> OrdinalRange;
+
 public:
     KdTrip(const std::string & treeFileName)
     {
-        this->numNodesPerTrip = 1+((sizeof(KdTrip::Trip) + 8)/sizeof(KdNode));
-        this->fTree.open(treeFileName);
-        this->nodes = reinterpret_cast<const KdNode*>(fTree.data());
-        size_t nodeCount = this->fTree.size()/sizeof(KdNode);
-        this->endNode = this->nodes+nodeCount;
+        this->numNodesPerTrip = Tree::NodesPerRecord;
+        this->tree.open(treeFileName);
+        this->nodes = this->tree.begin();
+        this->endNode = this->tree.end();
+        this->timeIndex = NULL;
+        std::string timeIndexFileName = treeFileName + ".tidx";
+        if (access(timeIndexFileName.c_str(), R_OK)==0)
+            this->loadTimeIndex(timeIndexFileName);
+        this->leafDirectory = NULL;
+        this->leafNodes = NULL;
+        std::string leafFileName = treeFileName + ".leaves";
+        if (access(leafFileName.c_str(), R_OK)==0)
+            this->loadLeafDirectory(leafFileName);
+        this->odIndex = NULL;
+        std::string odFileName = treeFileName + ".od";
+        if (access(odFileName.c_str(), R_OK)==0)
+            this->loadOdIndex(odFileName);
+        this->chainTable = NULL;
+        std::string chainFileName = treeFileName + ".chain";
+        if (access(chainFileName.c_str(), R_OK)==0)
+            this->loadChainTable(chainFileName);
+        this->blockReader = boost::shared_ptr<AsyncBlockReader>(new AsyncBlockReader(treeFileName));
+        this->blockReader->setMapping(this->nodes, (this->endNode-this->nodes)*sizeof(KdNode));
+    }
+
+    bool hasLeafDirectory() const
+    {
+        return this->leafDirectory!=NULL;
+    }
+
+    // Only available with a leaf directory
+    uint64_t numTrips() const
+    {
+        return this->leafDirectory?this->leafDirectory->numTrips:0;
+    }
+
+    inline const Trip * tripAt(uint64_t ordinal) const
+    {
+        return this->tripAtNode(this->leafNodes[ordinal]);
+    }
+
+    // Ordinal of a trip of this tree, found by binary search on the leaf
+    // directory (whose offsets are increasing)
+    uint64_t tripOrdinal(const Trip *trip) const
+    {
+        uint64_t node = this->nodeIndex(trip);
+        return std::lower_bound(this->leafNodes, this->leafNodes+this->numTrips(), node)-this->leafNodes;
+    }
+
+    Iterator iteratorAt(uint64_t ordinal) const
+    {
+        return Iterator(this->leafNodes+std::min(ordinal, this->numTrips()), this->leafNodes+this->numTrips(),
+                        this->nodes, this->endNode);
+    }
+
+    // Splits a full scan into at most n ranges of (almost) equal size for
+    // parallel workers
+    std::vector<OrdinalRange> splitScan(size_t n) const
+    {
+        std::vector<OrdinalRange> ranges;
+        uint64_t total = this->numTrips();
+        n = std::max<size_t>(1, std::min<uint64_t>(n, total));
+        for (size_t i=0; i<n && total>0; i++)
+            ranges.push_back(OrdinalRange(total*i/n, total*(i+1)/n));
+        return ranges;
+    }
+
+    // True when trip points into this tree's mapping
+    bool contains(const Trip *trip) const
+    {
+        const char *p = reinterpret_cast<const char*>(trip);
+        return p>=reinterpret_cast<const char*>(this->nodes) && p<reinterpret_cast<const char*>(this->endNode);
+    }
+
+    // Start of the mapping contains() tests against, to order trees by
+    const void * mappedBegin() const
+    {
+        return this->nodes;
+    }
+
+    const void * mappedEnd() const
+    {
+        return this->endNode;
+    }
+
+    bool hasTimeIndex() const
+    {
+        return this->timeIndex!=NULL;
+    }
+
+    inline uint64_t nodeIndex(const Trip *trip) const
+    {
+        return (reinterpret_cast<const char*>(trip)-sizeof(uint64_t)-reinterpret_cast<const char*>(this->nodes))/sizeof(KdNode);
+    }
+
+    inline const Trip * tripAtNode(uint64_t index) const
+    {
+        return reinterpret_cast<const Trip*>(&(this->nodes[index].median_value));
     }
 
-    Iterator begin()
+    Iterator begin() const
     {
+        if (this->hasLeafDirectory())
+            return this->iteratorAt(0);
         const KdNode *node = this->nodes;
         while (node<this->endNode && node->child_node!=0) node++;
-        return Iterator(reinterpret_cast<const Trip*>(&(node->median_value)), this->endNode);
+        if (node>=this->endNode)
+            return this->end();
+        return Iterator(reinterpret_cast<const Trip*>(&(node->median_value)), this->endNode, this->numNodesPerTrip+1);
     }
 
-    Iterator end()
+    Iterator end() const
     {
-        return Iterator(reinterpret_cast<const Trip*>(this->endNode), this->endNode);
+        return Iterator(reinterpret_cast<const Trip*>(this->endNode), this->endNode, this->numNodesPerTrip+1);
     }
 
-    QueryResult execute(const Query &q) {
-        uint32_t range[7][2] = {
-            {q.minPickupTime, q.maxPickupTime},
-            {q.minDropoffTime, q.maxDropoffTime},
-            {float2uint(q.minPickupLong), float2uint(q.maxPickupLong)},
-            {float2uint(q.minPickupLat), float2uint(q.maxPickupLat)},
-            {float2uint(q.minDropoffLong), float2uint(q.maxDropoffLong)},
-            {float2uint(q.minDropoffLat), float2uint(q.maxDropoffLat)},
-            {q.minTaxiId, q.maxTaxiId}
-        };
+    QueryResult execute(const Query &q) const {
+        if (q.sampleStride>1)
+            return this->executeSample(q);
+        if (this->hasTimeIndex() && q.isTimeOnly())
+            return this->executeTimeRange(q);
+        QueryResult result;
+        if (this->executeOd(q, result))
+            return result;
+        return this->executeKdTree(q);
+    }
+
+    // Traverses the tree with the kernel specialized for the dimensions the
+    // query constrains, or with pruning on its time pattern or time ranges.
+    // A cancellable query is searched one subtree at a time so the flag
+    // can be checked in between.
+    QueryResult executeKdTree(const Query &q) const {
+        if (q.sampleStride>1)
+            return this->executeSample(q);
+        uint32_t range[7][2];
+        getRange(q, range);
         QueryResult result;
         result.trips = boost::shared_ptr<TripVector>(new TripVector());
-        searchKdTree(nodes, 0, range, 0, q, result);
+        if (!q.cancelFlag) {
+            this->searchSubtree(q, range, 0, 0, *result.trips);
+            return result;
+        }
+        std::vector<Tree::Subtree> subtrees;
+        this->tree.collectSubtrees(0, range, 0, 0, CancelSplitDepth, subtrees);
+        for (size_t i=0; i<subtrees.size() && !q.isCancelled(); i++)
+            this->searchSubtree(q, range, subtrees[i].root, subtrees[i].dim, *result.trips);
         // std::sort(result.trips->begin(), result.trips->end());
         return result;
     }
 
+    // Generic iterative traversal testing every dimension, kept as a
+    // baseline for benchQuery
+    QueryResult executeIterative(const Query &q) const {
+        uint32_t range[7][2];
+        getRange(q, range);
+        QueryResult result;
+        result.trips = boost::shared_ptr<TripVector>(new TripVector());
+        this->tree.search(0, range, 0, matcher(q), *result.trips);
+        return result;
+    }
+
+    // Original recursive traversal, kept as a baseline for benchQuery
+    QueryResult executeRecursive(const Query &q) const {
+        uint32_t range[7][2];
+        getRange(q, range);
+        QueryResult result;
+        result.trips = boost::shared_ptr<TripVector>(new TripVector());
+        searchKdTree(nodes, 0, range, 0, q, *result.trips);
+        return result;
+    }
+
+    // Splits the traversal at splitDepth into independent subtree tasks run
+    // on the pool. Each task fills its own buffer and the buffers are then
+    // copied into disjoint slices of the result, so no lock is taken on the
+    // output. Results come back in the same order as executeKdTree.
+    QueryResult executeParallel(const Query &q, int splitDepth=8, ThreadPool &pool=ThreadPool::shared()) const {
+        if (q.sampleStride>1)
+            return this->executeSample(q, pool);
+        if (this->hasTimeIndex() && q.isTimeOnly())
+            return this->executeTimeRange(q);
+        QueryResult odResult;
+        if (this->executeOd(q, odResult))
+            return odResult;
+        uint32_t range[7][2];
+        getRange(q, range);
+        std::vector<Tree::Subtree> subtrees;
+        this->tree.collectSubtrees(0, range, 0, 0, splitDepth, subtrees);
+        return this->searchSubtrees(q, range, subtrees, pool);
+    }
+
+    // Sample of the trips of q, about 1 in q.sampleStride: the subtrees of
+    // up to min(stride, 2^SampleSubtreeDepth) trips are sampled by position
+    // and only the kept ones are searched, in parallel as in
+    // executeParallel. The tree above them is still walked, which bounds
+    // the saving at about 2^SampleSubtreeDepth times. Indexes other than
+    // the tree are not used.
+    QueryResult executeSample(const Query &q, ThreadPool &pool=ThreadPool::shared()) const {
+        uint32_t range[7][2];
+        getRange(q, range);
+        int subtreeDepth = 0;
+        while (subtreeDepth<SampleSubtreeDepth && (1u<<(subtreeDepth+1))<=q.sampleStride)
+            subtreeDepth++;
+        std::vector<Tree::Subtree> subtrees;
+        this->tree.collectSample(0, range, 0, 0, std::max(this->tree.depth()-subtreeDepth, 0),
+                                 q.sampleStride, subtrees);
+        return this->searchSubtrees(q, range, subtrees, pool);
+    }
+
+    // Same trips as executeKdTree, in a different order, for a tree whose
+    // file is not in the page cache yet (a shard just mapped): the tree is
+    // traversed in batches and the blocks each batch needs next are read
+    // together with many reads in flight, rather than page faulted in one
+    // at a time.
+    QueryResult executeAsync(const Query &q) const {
+        if (q.sampleStride>1)
+            return this->executeSample(q);
+        if (this->hasTimeIndex() && q.isTimeOnly())
+            return this->executeTimeRange(q);
+        QueryResult result;
+        if (this->executeOd(q, result))
+            return result;
+        uint32_t range[7][2];
+        getRange(q, range);
+        result.trips = boost::shared_ptr<TripVector>(new TripVector());
+        BlockFetcher fetcher(*this->blockReader, q);
+        this->tree.searchBatched(0, range, 0, matcher(q), fetcher, *result.trips);
+        return result;
+    }
+
+    // Answers a time-only query from the time index with two binary
+    // searches and a scan of the contiguous range between them. With a time
+    // pattern or time ranges only the spans they cover are scanned.
+    QueryResult executeTimeRange(const Query &q) const {
+        QueryResult result;
+        result.trips = boost::shared_ptr<TripVector>(new TripVector());
+        std::vector<std::pair<uint32_t, uint32_t> > spans;
+        if (q.timePattern)
+            q.timePattern->spans(spans);
+        else if (q.timeRanges)
+            q.timeRanges->spans(spans);
+        else
+            spans.push_back(std::make_pair(q.minPickupTime, q.maxPickupTime));
+        for (size_t s=0; s<spans.size(); s++) {
+            uint32_t t0 = std::max(spans[s].first, q.minPickupTime);
+            uint32_t t1 = std::min(spans[s].second, q.maxPickupTime);
+            if (t0>t1)
+                continue;
+            uint64_t first = this->timeLowerBound(t0);
+            uint64_t last  = t1==UINT_MAX?this->timeIndex->numTrips:this->timeLowerBound(t1+1);
+            for (uint64_t i=first; i<last; i++) {
+                if ((i&0xFFFF)==0 && q.isCancelled())
+                    return result;
+                const Trip *candidate = this->tripAtNode(this->timeNodes[i]);
+                if (q.isMatched(candidate))
+                    result.trips->push_back(candidate);
+            }
+        }
+        return result;
+    }
+
+    // The k trips satisfying q whose pickup (or dropoff) location is closest
+    // to (lat, lon), closest first, from a best-first search of the tree
+    QueryResult nearest(const Query &q, float lat, float lon, bool dropoff, size_t k) const {
+        uint32_t range[7][2];
+        getRange(q, range);
+        std::vector<std::pair<double, const Trip*> > neighbors;
+        this->tree.nearest(range, k, matcher(q), NearestDistance(lat, lon, dropoff), neighbors);
+        QueryResult result;
+        result.trips = boost::shared_ptr<TripVector>(new TripVector(neighbors.size()));
+        for (size_t i=0; i<neighbors.size(); i++)
+            (*result.trips)[i] = neighbors[i].second;
+        return result;
+    }
+
+    // Squared ground distance in m^2 between (lat, lon) and the pickup (or
+    // dropoff) location of trip, on an equirectangular projection centered
+    // at lat; plenty accurate at city scale
+    static double squaredDistance(float lat, float lon, const Trip *trip, bool dropoff)
+    {
+        return NearestDistance(lat, lon, dropoff).toRecord(*trip);
+    }
+
+    // The chain table is only usable with the leaf directory it refers to
+    bool hasChainTable() const
+    {
+        return this->chainTable!=NULL && this->hasLeafDirectory() &&
+               this->chainTable->numTrips==this->numTrips();
+    }
+
+    inline const ChainEntry & chainAt(uint64_t ordinal) const
+    {
+        return this->chainEntries[ordinal];
+    }
+
+    // The same taxi's next trip, or NULL
+    const Trip * nextTrip(const Trip *trip) const
+    {
+        if (!this->hasChainTable())
+            return NULL;
+        uint64_t next = this->chainEntries[this->tripOrdinal(trip)].next;
+        return next==NoNextTrip?NULL:this->tripAt(next);
+    }
+
+    // Aggregates the idle gaps that start at the dropoffs of the trips of q
+    // by dropoff region and local hour of dropoff: stats[r*24+h] for
+    // region(lat, lon)==r, where region returns -1 for places to leave out.
+    // A gap of more than maxIdleSeconds is a shift end, not idle time.
+    // Returns false when there is no chain table.
+    template <typename Region>
+    bool idleTime(const Query &q, const Region &region, int numRegions, std::vector<IdleStats> &stats,
+                  uint32_t maxIdleSeconds=4*3600, ThreadPool &pool=ThreadPool::shared()) const
+    {
+        stats.assign(numRegions*24, IdleStats());
+        if (!this->hasChainTable())
+            return false;
+        QueryResult result = this->executeParallel(q, 8, pool);
+        const TripVector &trips = *result.trips;
+        size_t numChunks = std::min<size_t>(4*pool.size(), trips.size()/1024+1);
+        std::vector<std::vector<IdleStats> > partial(numChunks, std::vector<IdleStats>(numRegions*24));
+        pool.parallelFor(numChunks, [&](size_t c) {
+            LocalHours hours;
+            for (size_t i=trips.size()*c/numChunks; i<trips.size()*(c+1)/numChunks; i++) {
+                const ChainEntry &chain = this->chainEntries[this->tripOrdinal(trips[i])];
+                if (chain.next==NoNextTrip || chain.gapSeconds<0)
+                    continue;
+                int r = region(trips[i]->dropoff_lat, trips[i]->dropoff_long);
+                if (r<0 || r>=numRegions)
+                    continue;
+                IdleStats &s = partial[c][r*24+hours.hourOf(trips[i]->dropoff_time)];
+                if ((uint32_t)chain.gapSeconds>maxIdleSeconds) {
+                    s.shiftEnds++;
+                    continue;
+                }
+                s.gaps++;
+                s.idleSeconds += chain.gapSeconds;
+                s.deadheadMeters += chain.gapMeters;
+            }
+        });
+        for (size_t c=0; c<partial.size(); c++)
+            for (size_t i=0; i<stats.size(); i++)
+                stats[i].merge(partial[c][i]);
+        return true;
+    }
+
+    bool hasOdIndex() const
+    {
+        return this->odIndex!=NULL;
+    }
+
+    // Cell of the OD grid described by h containing (lat, lon)
+    static uint32_t odCell(const OdIndexHeader &h, float lat, float lon)
+    {
+        float r = (lat-h.minLat)/h.cellSize;
+        float c = (lon-h.minLong)/h.cellSize;
+        if (!(r>=0 && r<h.rows && c>=0 && c<h.cols))
+            return h.rows*h.cols;
+        return (uint32_t)r*h.cols+(uint32_t)c;
+    }
+
+    // Answers a query constraining both the pickup and the dropoff area
+    // from the OD index: the union of the (pickup cell, dropoff cell) lists
+    // overlapping the two boxes, each narrowed to the pickup time window by
+    // binary search, with the trips in boundary cells refined by the full
+    // predicate. Returns false (leaving result alone) when there is no OD
+    // index, the query does not constrain both areas, or the boxes cover
+    // more than maxPairs cell pairs, where a tree traversal is cheaper.
+    bool executeOd(const Query &q, QueryResult &result, size_t maxPairs=4096) const {
+        if (!this->hasOdIndex() || (q.activeMask() & 0x3C)!=0x3C)
+            return false;
+        std::vector<uint32_t> pickupCells, dropoffCells;
+        this->odCells(q.minPickupLat, q.maxPickupLat, q.minPickupLong, q.maxPickupLong, pickupCells);
+        this->odCells(q.minDropoffLat, q.maxDropoffLat, q.minDropoffLong, q.maxDropoffLong, dropoffCells);
+        if (pickupCells.size()*dropoffCells.size()>maxPairs)
+            return false;
+        result.trips = boost::shared_ptr<TripVector>(new TripVector());
+        const OdIndexHeader *h = this->odIndex;
+        uint64_t numKeys = (uint64_t)h->rows*h->cols+1;
+        const uint64_t *keysEnd = this->odPairKeys+h->numPairs;
+        for (size_t i=0; i<pickupCells.size() && !q.isCancelled(); i++) {
+            // All pairs of one pickup cell are contiguous
+            const uint64_t *first = std::lower_bound(this->odPairKeys, keysEnd, pickupCells[i]*numKeys);
+            const uint64_t *last  = std::lower_bound(first, keysEnd, (pickupCells[i]+1)*numKeys);
+            for (size_t j=0; j<dropoffCells.size() && first<last; j++) {
+                const uint64_t *pair = std::lower_bound(first, last, pickupCells[i]*numKeys+dropoffCells[j]);
+                if (pair==last || *pair!=pickupCells[i]*numKeys+dropoffCells[j])
+                    continue;
+                uint64_t p = pair-this->odPairKeys;
+                const uint32_t *times = this->odPickups;
+                uint64_t e   = std::lower_bound(times+this->odPairOffsets[p], times+this->odPairOffsets[p+1],
+                                                q.minPickupTime)-times;
+                uint64_t end = this->odPairOffsets[p+1];
+                for (; e<end && times[e]<=q.maxPickupTime; e++) {
+                    const Trip *candidate = this->tripAtNode(this->odNodes[e]);
+                    if (q.isMatched(candidate))
+                        result.trips->push_back(candidate);
+                }
+            }
+        }
+        return true;
+    }
+
     typedef Iterator iterator;
     typedef Iterator const_iterator;
 
 private:
-    boost::iostreams::mapped_file_source fTree;
+    Tree          tree;
     const KdNode* nodes;
     const KdNode *endNode;
+    boost::shared_ptr<AsyncBlockReader> blockReader;
     int     numNodesPerTrip;
 
-    inline bool inRange(uint32_t value, uint32_t range[2]) {
+    boost::iostreams::mapped_file_source fTimeIndex;
+    const TimeIndexHeader *timeIndex;
+    const uint64_t        *timeDirectory;
+    const uint64_t        *timeNodes;
+    const uint32_t        *timePickups;
+
+    void loadTimeIndex(const std::string &fileName)
+    {
+        this->fTimeIndex.open(fileName);
+        const TimeIndexHeader *header = reinterpret_cast<const TimeIndexHeader*>(this->fTimeIndex.data());
+        if (this->fTimeIndex.size()<sizeof(TimeIndexHeader) || memcmp(header->magic, "KDTI", 4)!=0 ||
+            this->fTimeIndex.size()!=sizeof(TimeIndexHeader)+sizeof(uint64_t)*(header->numBuckets+1)+
+                                     (sizeof(uint64_t)+sizeof(uint32_t))*header->numTrips) {
+            fprintf(stderr, "Ignoring invalid time index %s\n", fileName.c_str());
+            this->fTimeIndex.close();
+            return;
+        }
+        this->timeIndex     = header;
+        this->timeDirectory = reinterpret_cast<const uint64_t*>(header+1);
+        this->timeNodes     = this->timeDirectory + header->numBuckets+1;
+        this->timePickups   = reinterpret_cast<const uint32_t*>(this->timeNodes + header->numTrips);
+    }
+
+    boost::iostreams::mapped_file_source fLeafDirectory;
+    const LeafDirectoryHeader *leafDirectory;
+    const uint64_t            *leafNodes;
+
+    void loadLeafDirectory(const std::string &fileName)
+    {
+        this->fLeafDirectory.open(fileName);
+        const LeafDirectoryHeader *header = reinterpret_cast<const LeafDirectoryHeader*>(this->fLeafDirectory.data());
+        if (this->fLeafDirectory.size()<sizeof(LeafDirectoryHeader) || memcmp(header->magic, "KDLD", 4)!=0 ||
+            this->fLeafDirectory.size()!=sizeof(LeafDirectoryHeader)+sizeof(uint64_t)*header->numTrips) {
+            fprintf(stderr, "Ignoring invalid leaf directory %s\n", fileName.c_str());
+            this->fLeafDirectory.close();
+            return;
+        }
+        this->leafDirectory = header;
+        this->leafNodes = reinterpret_cast<const uint64_t*>(header+1);
+    }
+
+    boost::iostreams::mapped_file_source fOdIndex;
+    const OdIndexHeader *odIndex;
+    const uint64_t      *odPairKeys;
+    const uint64_t      *odPairOffsets;
+    const uint64_t      *odNodes;
+    const uint32_t      *odPickups;
+
+    void loadOdIndex(const std::string &fileName)
+    {
+        this->fOdIndex.open(fileName);
+        const OdIndexHeader *header = reinterpret_cast<const OdIndexHeader*>(this->fOdIndex.data());
+        if (this->fOdIndex.size()<sizeof(OdIndexHeader) || memcmp(header->magic, "KDOD", 4)!=0 ||
+            header->cellSize<=0 ||
+            this->fOdIndex.size()!=sizeof(OdIndexHeader)+sizeof(uint64_t)*(2*header->numPairs+1)+
+                                   (sizeof(uint64_t)+sizeof(uint32_t))*header->numTrips) {
+            fprintf(stderr, "Ignoring invalid OD index %s\n", fileName.c_str());
+            this->fOdIndex.close();
+            return;
+        }
+        this->odIndex       = header;
+        this->odPairKeys    = reinterpret_cast<const uint64_t*>(header+1);
+        this->odPairOffsets = this->odPairKeys + header->numPairs;
+        this->odNodes       = this->odPairOffsets + header->numPairs+1;
+        this->odPickups     = reinterpret_cast<const uint32_t*>(this->odNodes + header->numTrips);
+    }
+
+    boost::iostreams::mapped_file_source fChainTable;
+    const ChainHeader *chainTable;
+    const ChainEntry  *chainEntries;
+
+    void loadChainTable(const std::string &fileName)
+    {
+        this->fChainTable.open(fileName);
+        const ChainHeader *header = reinterpret_cast<const ChainHeader*>(this->fChainTable.data());
+        if (this->fChainTable.size()<sizeof(ChainHeader) || memcmp(header->magic, "KDCH", 4)!=0 ||
+            this->fChainTable.size()!=sizeof(ChainHeader)+sizeof(ChainEntry)*header->numTrips) {
+            fprintf(stderr, "Ignoring invalid chain table %s\n", fileName.c_str());
+            this->fChainTable.close();
+            return;
+        }
+        this->chainTable   = header;
+        this->chainEntries = reinterpret_cast<const ChainEntry*>(header+1);
+    }
+
+    // Local hour of day of a time, memoized per hour since localtime_r is
+    // slow and the trips of a result share few distinct hours
+    struct LocalHours {
+        int hourOf(uint32_t t) {
+            uint32_t key = t/3600;
+            boost::unordered_map<uint32_t, int>::iterator it = this->hours.find(key);
+            if (it!=this->hours.end())
+                return it->second;
+            time_t tt = t;
+            struct tm timeinfo;
+            localtime_r(&tt, &timeinfo);
+            this->hours[key] = timeinfo.tm_hour;
+            return timeinfo.tm_hour;
+        }
+        boost::unordered_map<uint32_t, int> hours;
+    };
+
+    // Grid cells overlapping the box, plus the outside cell when the box
+    // reaches beyond the grid
+    void odCells(float minLat, float maxLat, float minLong, float maxLong, std::vector<uint32_t> &cells) const
+    {
+        const OdIndexHeader *h = this->odIndex;
+        float r0 = (minLat-h->minLat)/h->cellSize, r1 = (maxLat-h->minLat)/h->cellSize;
+        float c0 = (minLong-h->minLong)/h->cellSize, c1 = (maxLong-h->minLong)/h->cellSize;
+        bool outside = !(r0>=0 && c0>=0 && r1<h->rows && c1<h->cols);
+        if (r1>=0 && c1>=0 && r0<h->rows && c0<h->cols) {
+            uint32_t rowBegin = r0>0?(uint32_t)r0:0, rowEnd = std::min<float>(r1, h->rows-1);
+            uint32_t colBegin = c0>0?(uint32_t)c0:0, colEnd = std::min<float>(c1, h->cols-1);
+            for (uint32_t r=rowBegin; r<=rowEnd; r++)
+                for (uint32_t c=colBegin; c<=colEnd; c++)
+                    cells.push_back(r*h->cols+c);
+        }
+        if (outside)
+            cells.push_back(h->rows*h->cols);
+    }
+
+    // Position of the first trip picked up at or after t
+    uint64_t timeLowerBound(uint32_t t) const
+    {
+        if (t<=this->timeIndex->baseTime)
+            return 0;
+        uint64_t bucket = (t-this->timeIndex->baseTime)/this->timeIndex->bucketSeconds;
+        if (bucket>=this->timeIndex->numBuckets)
+            return this->timeIndex->numTrips;
+        const uint32_t *begin = this->timePickups+this->timeDirectory[bucket];
+        const uint32_t *end   = this->timePickups+this->timeDirectory[bucket+1];
+        return std::lower_bound(begin, end, t)-this->timePickups;
+    }
+
+    // Leaf predicate handed to the tree traversal
+    struct Matcher {
+        const Query &query;
+        inline bool operator()(const Trip *trip) const { return query.isMatched(trip); }
+    };
+
+    static Matcher matcher(const Query &q) {
+        Matcher m = {q};
+        return m;
+    }
+
+    // Distance handed to Tree::nearest, in squared meters
+    struct NearestDistance {
+        NearestDistance(float lat, float lon, bool dropoff):
+            lat(lat), lon(lon), cosLat(cos(lat*M_PI/180)), latDim(dropoff?5:3), lonDim(dropoff?4:2) {}
+
+        inline double toPoint(double pointLat, double pointLon) const {
+            double dy = (pointLat-this->lat)*MetersPerDegree;
+            double dx = (pointLon-this->lon)*MetersPerDegree*this->cosLat;
+            return dx*dx+dy*dy;
+        }
+
+        inline double toRecord(const Trip &trip) const {
+            return this->latDim==5?this->toPoint(trip.dropoff_lat, trip.dropoff_long):
+                                   this->toPoint(trip.pickup_lat, trip.pickup_long);
+        }
+
+        // Distance to the closest point of the location box in bounds
+        inline double toBox(const uint32_t (*bounds)[2]) const {
+            double boxLat = std::min<double>(std::max<double>(this->lat, kdKeyToFloat(bounds[this->latDim][0])),
+                                             kdKeyToFloat(bounds[this->latDim][1]));
+            double boxLon = std::min<double>(std::max<double>(this->lon, kdKeyToFloat(bounds[this->lonDim][0])),
+                                             kdKeyToFloat(bounds[this->lonDim][1]));
+            return this->toPoint(boxLat, boxLon);
+        }
+
+        static constexpr double MetersPerDegree = 111195.0;
+        double lat, lon, cosLat;
+        int    latDim, lonDim;
+    };
+
+    // Turns the node spans of a traversal batch into file blocks and reads
+    // those not read before by the same query; stops the traversal once
+    // the query is cancelled
+    struct BlockFetcher {
+        BlockFetcher(AsyncBlockReader &reader, const Query &query): reader(reader), query(query) {}
+
+        bool operator()(const std::vector<std::pair<uint64_t, uint64_t> > &spans) {
+            if (this->query.isCancelled())
+                return false;
+            uint64_t blockSize = this->reader.getBlockSize();
+            this->blocks.clear();
+            for (size_t i=0; i<spans.size(); i++) {
+                uint64_t first = spans[i].first*sizeof(KdNode)/blockSize;
+                uint64_t last  = (spans[i].second*sizeof(KdNode)-1)/blockSize;
+                for (uint64_t b=first; b<=last; b++)
+                    if (this->fetched.insert(b).second)
+                        this->blocks.push_back(b);
+            }
+            this->reader.fetch(this->blocks);
+            return true;
+        }
+
+        AsyncBlockReader             &reader;
+        const Query                  &query;
+        boost::unordered_set<uint64_t> fetched;
+        std::vector<uint64_t>          blocks;
+    };
+
+    // Skips subtrees whose pickup or dropoff times miss the time pattern or
+    // every time range
+    struct TimePruner {
+        const HourMask   *mask;
+        const TimeRanges *ranges;
+        inline bool operator()(const uint32_t (*bounds)[2], int dim) const {
+            return dim>1 || ((!mask || mask->intersects(bounds[dim][0], bounds[dim][1])) &&
+                             (!ranges || ranges->intersects(bounds[dim][0], bounds[dim][1])));
+        }
+    };
+
+    // Searches subtrees on the pool, each into its own buffer, and copies
+    // the buffers into disjoint slices of the result in order, so no lock
+    // is taken on the output
+    QueryResult searchSubtrees(const Query &q, const uint32_t range[7][2], const std::vector<Tree::Subtree> &subtrees,
+                               ThreadPool &pool) const {
+        std::vector<TripVector> buffers(subtrees.size());
+        pool.parallelFor(subtrees.size(), [&](size_t i) {
+            if (!q.isCancelled())
+                this->searchSubtree(q, range, subtrees[i].root, subtrees[i].dim, buffers[i]);
+        });
+
+        std::vector<size_t> offsets(buffers.size()+1, 0);
+        for (size_t i=0; i<buffers.size(); i++)
+            offsets[i+1] = offsets[i]+buffers[i].size();
+        QueryResult result;
+        result.trips = boost::shared_ptr<TripVector>(new TripVector(offsets.back()));
+        TripVector &trips = *result.trips;
+        pool.parallelFor(buffers.size(), [&](size_t i) {
+            std::copy(buffers[i].begin(), buffers[i].end(), trips.begin()+offsets[i]);
+        });
+        return result;
+    }
+
+    // Searches the subtree at root (splitting on dim) for the trips of q
+    void searchSubtree(const Query &q, const uint32_t range[7][2], uint64_t root, int dim, TripVector &out) const {
+        if (!q.timePattern && !q.timeRanges) {
+            Tree::kernel(q.activeMask())(this->tree, root, range, dim, out);
+            return;
+        }
+        uint32_t bounds[7][2];
+        for (int d=0; d<7; d++) {
+            bounds[d][0] = 0;
+            bounds[d][1] = UINT_MAX;
+        }
+        TimePruner pruner = {q.timePattern.get(), q.timeRanges.get()};
+        this->tree.searchBounded(root, range, dim, bounds, matcher(q), pruner, out);
+    }
+
+    inline bool inRange(uint32_t value, uint32_t range[2]) const {
         return (range[0]<=value) && (value<=range[1]);
     }
 
-    void searchKdTree(const KdNode *nodes, uint32_t root, uint32_t range[7][2], int depth, const Query &query, QueryResult &result) {
+    void getRange(const Query &q, uint32_t range[7][2]) const {
+        uint32_t r[7][2] = {
+            {q.minPickupTime, q.maxPickupTime},
+            {q.minDropoffTime, q.maxDropoffTime},
+            {kdFloatToKey(q.minPickupLong), kdFloatToKey(q.maxPickupLong)},
+            {kdFloatToKey(q.minPickupLat), kdFloatToKey(q.maxPickupLat)},
+            {kdFloatToKey(q.minDropoffLong), kdFloatToKey(q.maxDropoffLong)},
+            {kdFloatToKey(q.minDropoffLat), kdFloatToKey(q.maxDropoffLat)},
+            {q.minTaxiId, q.maxTaxiId}
+        };
+        memcpy(range, r, sizeof(r));
+    }
+
+    void searchKdTree(const KdNode *nodes, uint64_t root, uint32_t range[7][2], int depth, const Query &query, TripVector &result) const {
         const KdNode *node = nodes + root;
-        if (node->child_node==-1) return;
+        if (node->child_node==(uint64_t)-1) return;
         if (node->child_node==0) {
             const Trip *candidate = reinterpret_cast<const Trip*>(&(node->median_value));
             if (query.isMatched(candidate))
-                result.trips->push_back(candidate);
+                result.push_back(candidate);
             return;
         }
         int rangeIndex = depth%7;
@@ -250,17 +1311,12 @@ private:
         if (range[rangeIndex][0]<=median)
             searchKdTree(nodes, node->child_node, range, depth+1, query, result);
         if (range[rangeIndex][1]>median) {
-            int nextNode = node->child_node+1;
+            uint64_t nextNode = node->child_node+1;
             if (nodes[node->child_node].child_node==0)
                 nextNode+=numNodesPerTrip;
             searchKdTree(nodes, nextNode, range, depth+1, query, result);
         }
     }
-
-    uint32_t float2uint(float f) {
-        register uint32_t t(*((uint32_t*)&f));
-        return t ^ ((-(t >> 31)) | 0x80000000);
-    }
 };
 
 inline u_int32_t getExtraFieldValue(const KdTrip::Trip* trip,int i){
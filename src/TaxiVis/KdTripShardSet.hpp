@@ -0,0 +1,319 @@
+#ifndef KD_TRIP_SHARD_SET_HPP
+#define KD_TRIP_SHARD_SET_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <float.h>
+#include <algorithm>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include "KdTrip.hpp"
+
+// A set of KdTrip indices, each covering a slice of time (typically one day
+// or one month), described by a text manifest with one line per shard:
+//
+//   # file numTrips minPickupTime maxPickupTime minDropoffTime maxDropoffTime
+//   #      minPickupLat maxPickupLat minPickupLong maxPickupLong
+//   #      minDropoffLat maxDropoffLat minDropoffLong maxDropoffLong
+//   trips_201201.kdtrip 13964872 1325394000 1328072399 ...
+//
+// File names are relative to the manifest. Queries only open and traverse
+// the shards whose bounds overlap the query. Shards are mapped lazily and
+// at most maxOpenShards are kept by the LRU; a shard evicted from the LRU
+// stays mapped for as long as someone holds a pin (a KdTripPtr) on it, and
+// is reused if it is requested again in the meantime, so trip pointers
+// handed out for a pinned shard remain valid and unique.
+class KdTripShardSet
+{
+public:
+    typedef boost::shared_ptr<KdTrip> KdTripPtr;
+    typedef std::vector<KdTripPtr>    PinList;
+
+    struct Shard {
+        Shard() {
+            numTrips = 0;
+            minPickupTime = minDropoffTime = UINT_MAX;
+            maxPickupTime = maxDropoffTime = 0;
+            minPickupLat = minPickupLong = minDropoffLat = minDropoffLong = FLT_MAX;
+            maxPickupLat = maxPickupLong = maxDropoffLat = maxDropoffLong = -FLT_MAX;
+        }
+
+        void add(const KdTrip::Trip &trip) {
+            numTrips++;
+            minPickupTime  = std::min(minPickupTime, trip.pickup_time);
+            maxPickupTime  = std::max(maxPickupTime, trip.pickup_time);
+            minDropoffTime = std::min(minDropoffTime, trip.dropoff_time);
+            maxDropoffTime = std::max(maxDropoffTime, trip.dropoff_time);
+            minPickupLat   = std::min(minPickupLat, trip.pickup_lat);
+            maxPickupLat   = std::max(maxPickupLat, trip.pickup_lat);
+            minPickupLong  = std::min(minPickupLong, trip.pickup_long);
+            maxPickupLong  = std::max(maxPickupLong, trip.pickup_long);
+            minDropoffLat  = std::min(minDropoffLat, trip.dropoff_lat);
+            maxDropoffLat  = std::max(maxDropoffLat, trip.dropoff_lat);
+            minDropoffLong = std::min(minDropoffLong, trip.dropoff_long);
+            maxDropoffLong = std::max(maxDropoffLong, trip.dropoff_long);
+        }
+
+        void merge(const Shard &s) {
+            numTrips += s.numTrips;
+            minPickupTime  = std::min(minPickupTime, s.minPickupTime);
+            maxPickupTime  = std::max(maxPickupTime, s.maxPickupTime);
+            minDropoffTime = std::min(minDropoffTime, s.minDropoffTime);
+            maxDropoffTime = std::max(maxDropoffTime, s.maxDropoffTime);
+            minPickupLat   = std::min(minPickupLat, s.minPickupLat);
+            maxPickupLat   = std::max(maxPickupLat, s.maxPickupLat);
+            minPickupLong  = std::min(minPickupLong, s.minPickupLong);
+            maxPickupLong  = std::max(maxPickupLong, s.maxPickupLong);
+            minDropoffLat  = std::min(minDropoffLat, s.minDropoffLat);
+            maxDropoffLat  = std::max(maxDropoffLat, s.maxDropoffLat);
+            minDropoffLong = std::min(minDropoffLong, s.minDropoffLong);
+            maxDropoffLong = std::max(maxDropoffLong, s.maxDropoffLong);
+        }
+
+        bool overlaps(const KdTrip::Query &q) const {
+            return (numTrips>0 &&
+                    q.minPickupTime<=maxPickupTime && minPickupTime<=q.maxPickupTime &&
+                    q.minDropoffTime<=maxDropoffTime && minDropoffTime<=q.maxDropoffTime &&
+                    q.minPickupLat<=maxPickupLat && minPickupLat<=q.maxPickupLat &&
+                    q.minPickupLong<=maxPickupLong && minPickupLong<=q.maxPickupLong &&
+                    q.minDropoffLat<=maxDropoffLat && minDropoffLat<=q.maxDropoffLat &&
+                    q.minDropoffLong<=maxDropoffLong && minDropoffLong<=q.maxDropoffLong &&
+                    (!q.timePattern || q.timePattern->intersects(minPickupTime, maxPickupTime)) &&
+                    (!q.timeRanges || q.timeRanges->intersects(minPickupTime, maxPickupTime)));
+        }
+
+        std::string fileName;
+        uint64_t    numTrips;
+        uint32_t    minPickupTime, maxPickupTime;
+        uint32_t    minDropoffTime, maxDropoffTime;
+        float       minPickupLat, maxPickupLat;
+        float       minPickupLong, maxPickupLong;
+        float       minDropoffLat, maxDropoffLat;
+        float       minDropoffLong, maxDropoffLong;
+    };
+
+public:
+    // Loads a shard manifest
+    explicit KdTripShardSet(const std::string &manifestFileName, size_t maxOpenShards=16):
+        maxOpenShards(std::max<size_t>(1, maxOpenShards))
+    {
+        std::string dir;
+        size_t slash = manifestFileName.find_last_of('/');
+        if (slash!=std::string::npos)
+            dir = manifestFileName.substr(0, slash+1);
+        std::ifstream fi(manifestFileName.c_str());
+        std::string line;
+        while (std::getline(fi, line)) {
+            if (line.empty() || line[0]=='#')
+                continue;
+            std::istringstream ss(line);
+            Shard s;
+            ss >> s.fileName >> s.numTrips
+               >> s.minPickupTime >> s.maxPickupTime >> s.minDropoffTime >> s.maxDropoffTime
+               >> s.minPickupLat >> s.maxPickupLat >> s.minPickupLong >> s.maxPickupLong
+               >> s.minDropoffLat >> s.maxDropoffLat >> s.minDropoffLong >> s.maxDropoffLong;
+            if (!ss) {
+                fprintf(stderr, "Ignoring invalid manifest line: %s\n", line.c_str());
+                continue;
+            }
+            if (s.fileName[0]!='/')
+                s.fileName = dir+s.fileName;
+            this->shards.push_back(s);
+        }
+        this->openShards.resize(this->shards.size());
+    }
+
+    // Wraps a single, unsharded index as a set with one shard
+    explicit KdTripShardSet(const KdTripPtr &kdtrip): maxOpenShards(1)
+    {
+        Shard s = KdTripShardSet::measure(*kdtrip);
+        this->shards.push_back(s);
+        this->openShards.push_back(kdtrip);
+        this->lru.push_back(0);
+        this->cache.push_back(kdtrip);
+    }
+
+    size_t numShards() const
+    {
+        return this->shards.size();
+    }
+
+    const Shard & shard(size_t i) const
+    {
+        return this->shards[i];
+    }
+
+    // Bounds of the whole set
+    Shard summary() const
+    {
+        Shard s;
+        for (size_t i=0; i<this->shards.size(); i++)
+            s.merge(this->shards[i]);
+        return s;
+    }
+
+    std::vector<size_t> overlappingShards(const KdTrip::Query &q) const
+    {
+        std::vector<size_t> result;
+        for (size_t i=0; i<this->shards.size(); i++)
+            if (this->shards[i].overlaps(q))
+                result.push_back(i);
+        return result;
+    }
+
+    // Maps shard i if needed and marks it as most recently used; mapped is
+    // set when the shard was not mapped before this call
+    KdTripPtr open(size_t i, bool *mapped=NULL)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        KdTripPtr kdtrip = this->openShards[i].lock();
+        if (mapped)
+            *mapped = !kdtrip;
+        if (!kdtrip)
+            kdtrip = KdTripPtr(new KdTrip(this->shards[i].fileName));
+        this->openShards[i] = kdtrip;
+        for (std::list<size_t>::iterator it=this->lru.begin(); it!=this->lru.end(); ++it) {
+            if (*it==i) {
+                this->lru.erase(it);
+                break;
+            }
+        }
+        this->lru.push_front(i);
+        if (this->cache.size()<this->openShards.size())
+            this->cache.resize(this->openShards.size());
+        this->cache[i] = kdtrip;
+        while (this->lru.size()>this->maxOpenShards) {
+            this->cache[this->lru.back()].reset();
+            this->lru.pop_back();
+        }
+        return kdtrip;
+    }
+
+    // Runs q on every overlapping shard, in parallel, and concatenates the
+    // results in manifest order. A shard mapped by this query is likely
+    // cold and is searched with batched asynchronous reads. The shards used
+    // are appended to pins when given; the caller must keep them for as
+    // long as it uses the trips.
+    KdTrip::QueryResult execute(const KdTrip::Query &q, PinList *pins=NULL, ThreadPool &pool=ThreadPool::shared())
+    {
+        std::vector<size_t> ids = this->overlappingShards(q);
+        PinList used(ids.size());
+        std::vector<char> mapped(ids.size());
+        for (size_t i=0; i<ids.size(); i++) {
+            bool m;
+            used[i] = this->open(ids[i], &m);
+            mapped[i] = m;
+        }
+
+        KdTrip::QueryResult result;
+        if (used.size()==1) {
+            result = mapped[0]?used[0]->executeAsync(q):used[0]->executeParallel(q, 8, pool);
+        }
+        else {
+            std::vector<KdTrip::QueryResult> partial(used.size());
+            pool.parallelFor(used.size(), [&](size_t i) {
+                partial[i] = mapped[i]?used[i]->executeAsync(q):used[i]->executeParallel(q, 8, pool);
+            });
+            result.trips = boost::shared_ptr<KdTrip::TripVector>(new KdTrip::TripVector());
+            size_t total = 0;
+            for (size_t i=0; i<partial.size(); i++)
+                total += partial[i].size();
+            result.trips->reserve(total);
+            for (size_t i=0; i<partial.size(); i++)
+                if (partial[i].trips)
+                    result.trips->insert(result.trips->end(), partial[i].trips->begin(), partial[i].trips->end());
+        }
+        if (pins)
+            pins->insert(pins->end(), used.begin(), used.end());
+        return result;
+    }
+
+    // The k trips of q closest to (lat, lon) over every overlapping shard,
+    // closest first: the k nearest of each shard, searched in parallel,
+    // merged by distance. Pins as in execute.
+    KdTrip::QueryResult nearest(const KdTrip::Query &q, float lat, float lon, bool dropoff, size_t k,
+                                PinList *pins=NULL, ThreadPool &pool=ThreadPool::shared())
+    {
+        std::vector<size_t> ids = this->overlappingShards(q);
+        PinList used(ids.size());
+        for (size_t i=0; i<ids.size(); i++)
+            used[i] = this->open(ids[i]);
+
+        std::vector<KdTrip::QueryResult> partial(used.size());
+        pool.parallelFor(used.size(), [&](size_t i) {
+            if (!q.isCancelled())
+                partial[i] = used[i]->nearest(q, lat, lon, dropoff, k);
+        });
+        std::vector<std::pair<double, const KdTrip::Trip*> > neighbors;
+        for (size_t i=0; i<partial.size(); i++)
+            for (KdTrip::QueryIterator it=partial[i].begin(); it!=partial[i].end(); ++it)
+                neighbors.push_back(std::make_pair(KdTrip::squaredDistance(lat, lon, it.trip(), dropoff), it.trip()));
+        std::sort(neighbors.begin(), neighbors.end());
+        neighbors.resize(std::min(neighbors.size(), k));
+        KdTrip::QueryResult result;
+        result.trips = boost::shared_ptr<KdTrip::TripVector>(new KdTrip::TripVector(neighbors.size()));
+        for (size_t i=0; i<neighbors.size(); i++)
+            (*result.trips)[i] = neighbors[i].second;
+        if (pins)
+            pins->insert(pins->end(), used.begin(), used.end());
+        return result;
+    }
+
+    // Bounds and trip count of a whole index, scanned in parallel ranges
+    // when it has a leaf directory
+    static Shard measure(const KdTrip &kdtrip, ThreadPool &pool=ThreadPool::shared())
+    {
+        Shard total;
+        if (kdtrip.hasLeafDirectory()) {
+            std::vector<KdTrip::OrdinalRange> ranges = kdtrip.splitScan(4*pool.size());
+            std::vector<Shard> partial(ranges.size());
+            pool.parallelFor(ranges.size(), [&](size_t i) {
+                for (uint64_t t=ranges[i].first; t<ranges[i].second; t++)
+                    partial[i].add(*kdtrip.tripAt(t));
+            });
+            for (size_t i=0; i<partial.size(); i++)
+                total.merge(partial[i]);
+        }
+        else {
+            KdTrip::Iterator it = kdtrip.begin();
+            KdTrip::Iterator endIt = kdtrip.end();
+            for (; it!=endIt; it++)
+                total.add(*it);
+        }
+        return total;
+    }
+
+    static void writeManifestHeader(FILE *fo)
+    {
+        fprintf(fo, "# file numTrips minPickupTime maxPickupTime minDropoffTime maxDropoffTime "
+                "minPickupLat maxPickupLat minPickupLong maxPickupLong "
+                "minDropoffLat maxDropoffLat minDropoffLong maxDropoffLong\n");
+    }
+
+    static void writeManifestLine(FILE *fo, const Shard &s)
+    {
+        fprintf(fo, "%s %llu %u %u %u %u %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n",
+                s.fileName.c_str(), (unsigned long long)s.numTrips,
+                s.minPickupTime, s.maxPickupTime, s.minDropoffTime, s.maxDropoffTime,
+                s.minPickupLat, s.maxPickupLat, s.minPickupLong, s.maxPickupLong,
+                s.minDropoffLat, s.maxDropoffLat, s.minDropoffLong, s.maxDropoffLong);
+    }
+
+private:
+    std::vector<Shard>                   shards;
+    std::vector<boost::weak_ptr<KdTrip> > openShards;
+    std::vector<KdTripPtr>               cache;
+    std::list<size_t>                    lru;
+    size_t                               maxOpenShards;
+    std::mutex                           mutex;
+};
+
+#endif
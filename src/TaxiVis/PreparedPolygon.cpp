@@ -0,0 +1,182 @@
+#include "PreparedPolygon.h"
+#include <cmath>
+
+using namespace std;
+
+//cells per edge of the outline, within these bounds
+static const int CellsPerEdge = 64;
+static const int MinCells     = 1 << 10;
+static const int MaxCells     = 1 << 16;
+static const int MaxCellsSide = 1024;
+
+PreparedPolygon::PreparedPolygon():
+    left(0), top(0), right(-1), bottom(-1),
+    rectangle(false), winding(false),
+    cols(0), rows(0), colScale(0), rowScale(0){
+}
+
+PreparedPolygon::PreparedPolygon(const QPainterPath &path):
+    left(0), top(0), right(-1), bottom(-1),
+    rectangle(false), winding(path.fillRule() == Qt::WindingFill),
+    cols(0), rows(0), colScale(0), rowScale(0){
+    //curves come flattened, and every subpath is implicitly closed
+    QList<QPolygonF> polygons = path.toSubpathPolygons();
+    vector<Edge> outline;
+    vector<QPointF> vertices;
+    for(int p = 0 ; p < polygons.size() ; ++p){
+        const QPolygonF &polygon = polygons[p];
+        for(int i = 0 ; i < polygon.size() ; ++i){
+            const QPointF &a = polygon[i];
+            const QPointF &b = polygon[(i+1) % polygon.size()];
+            if(a == b)
+                continue;
+            Edge edge = {a.x(), a.y(), b.x(), b.y()};
+            outline.push_back(edge);
+            vertices.push_back(a);
+        }
+    }
+    if(outline.empty())
+        return;
+
+    left = right = vertices[0].x();
+    top = bottom = vertices[0].y();
+    for(size_t i = 1 ; i < vertices.size() ; ++i){
+        left   = min(left, vertices[i].x());
+        right  = max(right, vertices[i].x());
+        top    = min(top, vertices[i].y());
+        bottom = max(bottom, vertices[i].y());
+    }
+
+    //an axis-aligned rectangle: one subpath turning through the corners of
+    //its box only, and enclosing all of it (not a bow tie)
+    if(polygons.size() == 1 && right > left && bottom > top){
+        bool onCorners = true;
+        double area = 0;
+        for(size_t i = 0 ; i < outline.size() ; ++i){
+            const Edge &e = outline[i];
+            onCorners = onCorners && (e.x0 == left || e.x0 == right) && (e.y0 == top || e.y0 == bottom);
+            area += e.x0*e.y1 - e.x1*e.y0;
+        }
+        double box = (right - left)*(bottom - top);
+        rectangle = onCorners && fabs(fabs(area)/2 - box) <= 1e-9*box;
+    }
+    if(!rectangle)
+        build(outline);
+}
+
+void PreparedPolygon::build(const vector<Edge> &outline){
+    //resolution grows with the edges, cells kept about square
+    int target = max(MinCells, min(MaxCells, CellsPerEdge*(int)min(outline.size(), (size_t)MaxCells)));
+    double width = right - left, height = bottom - top;
+    cols = rows = 1;
+    if(width > 0 && height > 0){
+        cols = max(1, min(MaxCellsSide, (int)(sqrt(target*width/height) + 0.5)));
+        rows = max(1, min(MaxCellsSide, target/cols));
+    }
+    colScale = width > 0 ? cols/width : 0;
+    rowScale = height > 0 ? rows/height : 0;
+
+    //each edge is listed in every row its y range overlaps: a ray from a
+    //point of the row crosses no other edge
+    vector<pair<int,int> > spans(outline.size());
+    rowStart.assign(rows+1, 0);
+    for(size_t i = 0 ; i < outline.size() ; ++i){
+        const Edge &e = outline[i];
+        spans[i] = make_pair(rowOf(min(e.y0, e.y1)), rowOf(max(e.y0, e.y1)));
+        for(int r = spans[i].first ; r <= spans[i].second ; ++r)
+            ++rowStart[r+1];
+    }
+    for(int r = 0 ; r < rows ; ++r)
+        rowStart[r+1] += rowStart[r];
+    edges.resize(rowStart[rows]);
+    vector<int> fill(rowStart.begin(), rowStart.end()-1);
+    for(size_t i = 0 ; i < outline.size() ; ++i)
+        for(int r = spans[i].first ; r <= spans[i].second ; ++r)
+            edges[fill[r]++] = outline[i];
+
+    //cells touched by an edge are boundary cells; the part of the edge in a
+    //row is widened a little so rounding in colOf/rowOf cannot miss one
+    cells.assign(rows*cols, OUTSIDE);
+    double epsX = colScale > 0 ? 1e-6/colScale : 0;
+    double epsY = rowScale > 0 ? 1e-6/rowScale : 0;
+    for(size_t i = 0 ; i < outline.size() ; ++i){
+        const Edge &e = outline[i];
+        double yMin = min(e.y0, e.y1), yMax = max(e.y0, e.y1);
+        for(int r = spans[i].first ; r <= spans[i].second ; ++r){
+            double xLow = min(e.x0, e.x1), xHigh = max(e.x0, e.x1);
+            if(e.y0 != e.y1 && rowScale > 0){
+                double yLow  = max(yMin, top + r/rowScale - epsY);
+                double yHigh = min(yMax, top + (r+1)/rowScale + epsY);
+                double slope = (e.x1 - e.x0)/(e.y1 - e.y0);
+                double xa = e.x0 + (yLow - e.y0)*slope;
+                double xb = e.x0 + (yHigh - e.y0)*slope;
+                xLow = min(xa, xb);
+                xHigh = max(xa, xb);
+            }
+            int c1 = colOf(xHigh + epsX);
+            for(int c = colOf(xLow - epsX) ; c <= c1 ; ++c)
+                cells[r*cols + c] = BOUNDARY;
+        }
+    }
+
+    //consecutive cells of a row between boundary cells share one side of
+    //the outline, so one exact test per run classifies them
+    for(int r = 0 ; r < rows ; ++r){
+        unsigned char runCell = BOUNDARY;
+        double y = top + (r + 0.5)/rowScale;
+        for(int c = 0 ; c < cols ; ++c){
+            unsigned char &cell = cells[r*cols + c];
+            if(cell == BOUNDARY){
+                runCell = BOUNDARY;
+                continue;
+            }
+            if(runCell == BOUNDARY)
+                runCell = exactContains(r, left + (c + 0.5)/colScale, y) ? INSIDE : OUTSIDE;
+            cell = runCell;
+        }
+    }
+}
+
+bool PreparedPolygon::exactContains(int row, double x, double y) const{
+    //signed crossings of the ray from (x,y) towards +x; each edge counts
+    //for the half-open range of y it spans, so shared vertices count once
+    int crossings = 0;
+    for(int i = rowStart[row] ; i < rowStart[row+1] ; ++i){
+        const Edge &e = edges[i];
+        if((e.y0 > y) != (e.y1 > y)){
+            double xCross = e.x0 + (y - e.y0)*(e.x1 - e.x0)/(e.y1 - e.y0);
+            if(xCross > x)
+                crossings += e.y1 > e.y0 ? 1 : -1;
+        }
+    }
+    return winding ? crossings != 0 : (crossings & 1) != 0;
+}
+
+void PreparedPolygon::contains(const float *x, const float *y, size_t count, size_t stride,
+                               unsigned char *inside) const{
+    const char *px = (const char*)x;
+    const char *py = (const char*)y;
+    if(rectangle){
+        for(size_t i = 0 ; i < count ; ++i, px += stride, py += stride){
+            double xi = *(const float*)px, yi = *(const float*)py;
+            inside[i] = xi >= left && xi <= right && yi >= top && yi <= bottom;
+        }
+        return;
+    }
+    for(size_t i = 0 ; i < count ; ++i, px += stride, py += stride)
+        inside[i] = contains(*(const float*)px, *(const float*)py);
+}
+
+QRectF PreparedPolygon::boundingRect() const{
+    if(isEmpty())
+        return QRectF();
+    return QRectF(left, top, right - left, bottom - top);
+}
+
+bool PreparedPolygon::isRectangle() const{
+    return rectangle;
+}
+
+bool PreparedPolygon::isEmpty() const{
+    return right < left;
+}
@@ -0,0 +1,78 @@
+#ifndef PREPAREDPOLYGON_H
+#define PREPAREDPOLYGON_H
+
+#include <QPainterPath>
+#include <QPointF>
+#include <QRectF>
+#include <algorithm>
+#include <vector>
+
+// A QPainterPath prepared for testing many points, built once per geometry.
+// An axis-aligned rectangle is answered by its bounding box alone. Any other
+// shape is rasterized over its bounding box into cells that are inside,
+// outside or on the boundary, at a resolution growing with the number of
+// edges; only points in boundary cells are tested exactly, by casting a ray
+// across the edges that cross their row of cells. The fill rule of the path
+// is honored. Points on the outline may be classified either way, as with
+// QPainterPath::contains.
+class PreparedPolygon
+{
+public:
+    PreparedPolygon();
+    explicit PreparedPolygon(const QPainterPath &path);
+
+    inline bool contains(const QPointF &p) const { return contains(p.x(), p.y()); }
+    inline bool contains(double x, double y) const;
+    // Tests count points whose coordinates are read from x and y, stride
+    // bytes apart (e.g. sizeof(KdTrip::Trip) over an array of trips), and
+    // sets inside[i] to 1 for those in the polygon, 0 otherwise
+    void contains(const float *x, const float *y, size_t count, size_t stride,
+                  unsigned char *inside) const;
+
+    QRectF boundingRect() const;
+    bool   isRectangle() const;
+    bool   isEmpty() const;
+
+private:
+    enum Cell {OUTSIDE=0, INSIDE, BOUNDARY};
+    struct Edge {
+        double x0, y0, x1, y1;
+    };
+
+    double                     left, top, right, bottom;
+    bool                       rectangle;
+    bool                       winding;    // Qt::WindingFill rather than odd-even
+    int                        cols, rows;
+    double                     colScale, rowScale;
+    std::vector<unsigned char> cells;      // rows*cols Cell values
+    std::vector<Edge>          edges;      // edges crossing each row, row after row
+    std::vector<int>           rowStart;   // row r owns edges [rowStart[r], rowStart[r+1])
+
+    void        build(const std::vector<Edge> &outline);
+    inline int  colOf(double x) const;
+    inline int  rowOf(double y) const;
+    bool        exactContains(int row, double x, double y) const;
+};
+
+inline int PreparedPolygon::colOf(double x) const{
+    return std::max(0, std::min(cols-1, (int)((x - left)*colScale)));
+}
+
+inline int PreparedPolygon::rowOf(double y) const{
+    return std::max(0, std::min(rows-1, (int)((y - top)*rowScale)));
+}
+
+inline bool PreparedPolygon::contains(double x, double y) const{
+    //written so that NaN coordinates fail the box test
+    if(!(x >= left && x <= right && y >= top && y <= bottom))
+        return false;
+    if(rectangle)
+        return true;
+    int row = rowOf(y);
+    unsigned char cell = cells[row*cols + colOf(x)];
+    if(cell != BOUNDARY)
+        return cell == INSIDE;
+    return exactContains(row, x, y);
+}
+
+#endif // PREPAREDPOLYGON_H
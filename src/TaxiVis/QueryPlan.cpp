@@ -0,0 +1,505 @@
+#include "QueryPlan.h"
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include <boost/functional/hash.hpp>
+
+using namespace std;
+
+static string selectionName(int selection){
+    if(selection < 0)
+        return "*";
+    ostringstream ss;
+    ss << "s" << selection;
+    return ss.str();
+}
+
+QueryPlan::QueryPlan(SelectionGraph *graph){
+    if(graph->isEmpty()){
+        Term all = {-1, -1, false, Group(), "all", -1};
+        terms.push_back(all);
+        addProbe(QRectF(), QRectF(), 0);
+        indexGroups();
+        optimize();
+        return;
+    }
+
+    //edges test the tail on the pickup and the head on the dropoff
+    set<int> nodesOnEdges;
+    SelectionGraph::EdgeIterator edgeIt, edgesBegin, edgesEnd;
+    graph->getEdgeIterator(edgesBegin, edgesEnd);
+    for(edgeIt = edgesBegin ; edgeIt != edgesEnd ; ++edgeIt){
+        SelectionGraphEdge *edge = edgeIt->second;
+        ostringstream source;
+        source << "edge " << edge->getID();
+        Term term = {selectionIndex(edge->getTail()->getSelection()),
+                     selectionIndex(edge->getHead()->getSelection()),
+                     false, edge->getGroup(), source.str(), -1};
+        terms.push_back(term);
+        addProbe(boxes[term.origin], boxes[term.destination], terms.size()-1);
+        nodesOnEdges.insert(edge->getTail()->getId());
+        nodesOnEdges.insert(edge->getHead()->getId());
+    }
+
+    //nodes without edges test their own side(s)
+    SelectionGraph::NodeIterator nodeIt, nodesBegin, nodesEnd;
+    graph->getNodeIterator(nodesBegin, nodesEnd);
+    for(nodeIt = nodesBegin ; nodeIt != nodesEnd ; ++nodeIt){
+        SelectionGraphNode *node = nodeIt->second;
+        if(nodesOnEdges.count(node->getId()) > 0)
+            continue;
+        Selection *selection = node->getSelection();
+        int index = selectionIndex(selection);
+        ostringstream source;
+        source << "node " << node->getId();
+        Term term = {-1, -1, false, node->getGroup(), source.str(), -1};
+        if(selection->getType() == Selection::START){
+            term.origin = index;
+            terms.push_back(term);
+            addProbe(boxes[index], QRectF(), terms.size()-1);
+        }
+        else if(selection->getType() == Selection::END){
+            term.destination = index;
+            terms.push_back(term);
+            addProbe(QRectF(), boxes[index], terms.size()-1);
+        }
+        else{
+            term.origin = term.destination = index;
+            term.either = true;
+            terms.push_back(term);
+            addProbe(boxes[index], QRectF(), terms.size()-1);
+            addProbe(QRectF(), boxes[index], terms.size()-1);
+        }
+    }
+    indexGroups();
+    optimize();
+}
+
+const vector<QueryPlan::Probe> &QueryPlan::getProbes() const{
+    return probes;
+}
+
+const vector<QueryPlan::Term> &QueryPlan::getTerms() const{
+    return terms;
+}
+
+int QueryPlan::numSelections() const{
+    return (int)selections.size();
+}
+
+const vector<Group> &QueryPlan::getGroups() const{
+    return groups;
+}
+
+int QueryPlan::groupBit(const Group &group) const{
+    for(size_t i = 0 ; i < groups.size() && i < (size_t)MaxGroups ; ++i)
+        if(groups[i] == group)
+            return (int)i;
+    return -1;
+}
+
+KdTrip::Query QueryPlan::probeQuery(int probe, const KdTrip::Query &timeQuery) const{
+    return probeQuery(probes[probe], timeQuery);
+}
+
+KdTrip::Query QueryPlan::probeQuery(const Probe &probe, const KdTrip::Query &timeQuery){
+    KdTrip::Query query = timeQuery;
+    const QRectF &origin = probe.pickupArea;
+    if(!origin.isNull())
+        query.setPickupArea(origin.x(), origin.y(), origin.x() + origin.width(), origin.y() + origin.height());
+    const QRectF &destination = probe.dropoffArea;
+    if(!destination.isNull())
+        query.setDropoffArea(destination.x(), destination.y(), destination.x() + destination.width(), destination.y() + destination.height());
+    return query;
+}
+
+bool QueryPlan::isCovered(int probe, const KdTrip::Trip *trip) const{
+    const vector<int> &coveredBy = probes[probe].coveredBy;
+    for(size_t i = 0 ; i < coveredBy.size() ; ++i){
+        const Probe &earlier = probes[coveredBy[i]];
+        if(inside(earlier.pickupArea, trip->pickup_lat, trip->pickup_long) &&
+           inside(earlier.dropoffArea, trip->dropoff_lat, trip->dropoff_long))
+            return true;
+    }
+    return false;
+}
+
+string QueryPlan::str() const{
+    ostringstream ss;
+    ss << probes.size() << " probes for " << terms.size() << " terms over " << selections.size() << " selections";
+    for(size_t p = 0 ; p < probes.size() ; ++p){
+        const Probe &probe = probes[p];
+        ss << "\n  probe " << p << ":";
+        const QRectF *areas[2] = {&probe.pickupArea, &probe.dropoffArea};
+        const char *names[2] = {" pickup ", " dropoff "};
+        for(int side = 0 ; side < 2 ; ++side){
+            ss << names[side];
+            if(areas[side]->isNull())
+                ss << "any";
+            else
+                ss << "[" << areas[side]->left() << "," << areas[side]->top() << " "
+                   << areas[side]->right() << "," << areas[side]->bottom() << "]";
+        }
+        ss << " ->";
+        for(size_t t = 0 ; t < probe.terms.size() ; ++t){
+            const Term &term = terms[probe.terms[t]];
+            ss << (t > 0 ? ", " : " ") << term.source;
+            if(term.origin >= 0 || term.destination >= 0){
+                ss << " (";
+                if(term.either)
+                    ss << selectionName(term.origin) << " either end";
+                else
+                    ss << selectionName(term.origin) << " -> " << selectionName(term.destination);
+                ss << ", " << term.group.getColor().name().toStdString() << ")";
+            }
+        }
+        if(!probe.coveredBy.empty()){
+            ss << "; skips trips of probe";
+            for(size_t i = 0 ; i < probe.coveredBy.size() ; ++i)
+                ss << " " << probe.coveredBy[i];
+        }
+    }
+    return ss.str();
+}
+
+bool QueryPlan::sameTerms(const QueryPlan &other) const{
+    if(selections.size() != other.selections.size() || terms.size() != other.terms.size())
+        return false;
+    for(size_t t = 0 ; t < terms.size() ; ++t){
+        const Term &a = terms[t];
+        const Term &b = other.terms[t];
+        if(a.origin != b.origin || a.destination != b.destination || a.either != b.either ||
+           !(a.group == b.group))
+            return false;
+    }
+    return true;
+}
+
+bool QueryPlan::sameQuery(const QueryPlan &other) const{
+    return sameTerms(other) && selections == other.selections;
+}
+
+size_t QueryPlan::hash() const{
+    size_t seed = 0;
+    for(size_t t = 0 ; t < terms.size() ; ++t){
+        const Term &term = terms[t];
+        boost::hash_combine(seed, term.origin);
+        boost::hash_combine(seed, term.destination);
+        boost::hash_combine(seed, term.either);
+        boost::hash_combine(seed, term.group.getColor().rgb());
+    }
+    //equal paths have equal boxes and element counts
+    for(size_t i = 0 ; i < selections.size() ; ++i){
+        boost::hash_combine(seed, selections[i].elementCount());
+        boost::hash_combine(seed, boxes[i].x());
+        boost::hash_combine(seed, boxes[i].y());
+        boost::hash_combine(seed, boxes[i].width());
+        boost::hash_combine(seed, boxes[i].height());
+    }
+    return seed;
+}
+
+int QueryPlan::reshapedSelection(const QueryPlan &previous) const{
+    if(!sameTerms(previous))
+        return -1;
+    int reshaped = -1;
+    for(size_t i = 0 ; i < selections.size() ; ++i){
+        if(selections[i] == previous.selections[i])
+            continue;
+        if(reshaped >= 0)
+            return -1;
+        reshaped = (int)i;
+    }
+    return reshaped;
+}
+
+vector<QueryPlan::Probe> QueryPlan::reshapeProbes(int selection, const QPainterPath &previousGeometry) const{
+    vector<QRectF> rects;
+    coverDifference(previousGeometry, selections[selection], rects);
+    QRectF bothBoxes = previousGeometry.boundingRect().united(boxes[selection]);
+
+    vector<Probe> result;
+    for(size_t t = 0 ; t < terms.size() ; ++t){
+        const Term &term = terms[t];
+        if(term.origin != selection && term.destination != selection)
+            continue;
+        //an either term needs one of its ends in the selection, whatever
+        //the other end does
+        QRectF dropoffBox, pickupBox;
+        if(!term.either){
+            if(term.destination >= 0)
+                dropoffBox = term.destination == selection ? bothBoxes : boxes[term.destination];
+            if(term.origin >= 0)
+                pickupBox = term.origin == selection ? bothBoxes : boxes[term.origin];
+        }
+        for(size_t r = 0 ; r < rects.size() ; ++r){
+            Probe probe;
+            probe.terms.push_back((int)t);
+            if(term.origin == selection){
+                probe.pickupArea = rects[r];
+                probe.dropoffArea = dropoffBox;
+                result.push_back(probe);
+            }
+            if(term.destination == selection){
+                probe.pickupArea = pickupBox;
+                probe.dropoffArea = rects[r];
+                result.push_back(probe);
+            }
+        }
+    }
+    return result;
+}
+
+void QueryPlan::coverDifference(const QPainterPath &a, const QPainterPath &b, vector<QRectF> &rects, int grid){
+    QRectF box = a.boundingRect().united(b.boundingRect());
+    if(box.isEmpty())
+        return;
+    double cellWidth = box.width()/grid;
+    double cellHeight = box.height()/grid;
+
+    //runs of the previous row still growing downwards, by [first, last) column
+    map<pair<int,int>, size_t> growing;
+    for(int row = 0 ; row < grid ; ++row){
+        map<pair<int,int>, size_t> next;
+        int first = -1;
+        for(int col = 0 ; col <= grid ; ++col){
+            bool marked = false;
+            if(col < grid){
+                QRectF cell(box.x() + col*cellWidth, box.y() + row*cellHeight, cellWidth, cellHeight);
+                bool inBoth = a.contains(cell) && b.contains(cell);
+                bool outOfBoth = !a.intersects(cell) && !b.intersects(cell);
+                marked = !inBoth && !outOfBoth;
+            }
+            if(marked && first < 0)
+                first = col;
+            if(marked || first < 0)
+                continue;
+            pair<int,int> run(first, col);
+            map<pair<int,int>, size_t>::iterator it = growing.find(run);
+            if(it != growing.end()){
+                rects[it->second].setHeight(rects[it->second].height() + cellHeight);
+                next[run] = it->second;
+            }
+            else{
+                next[run] = rects.size();
+                rects.push_back(QRectF(box.x() + first*cellWidth, box.y() + row*cellHeight,
+                                       (col - first)*cellWidth, cellHeight));
+            }
+            first = -1;
+        }
+        growing.swap(next);
+    }
+}
+
+const QPainterPath &QueryPlan::selectionGeometry(int selection) const{
+    return selections[selection];
+}
+
+int QueryPlan::selectionIndex(Selection *selection){
+    //nodes can share a selection object, or hold copies of the same geometry
+    QPainterPath geometry = selection->getGeometry();
+    for(size_t i = 0 ; i < selections.size() ; ++i)
+        if(selections[i] == geometry)
+            return (int)i;
+    selections.push_back(geometry);
+    prepared.push_back(selection->getPreparedGeometry());
+    boxes.push_back(geometry.boundingRect());
+    return (int)selections.size()-1;
+}
+
+void QueryPlan::indexGroups(){
+    //bits follow the order in which groups first appear in the terms
+    for(size_t t = 0 ; t < terms.size() ; ++t){
+        size_t g = find(groups.begin(), groups.end(), terms[t].group) - groups.begin();
+        if(g == groups.size())
+            groups.push_back(terms[t].group);
+        terms[t].groupBit = g < (size_t)MaxGroups ? (int)g : -1;
+    }
+}
+
+void QueryPlan::addProbe(const QRectF &pickupArea, const QRectF &dropoffArea, int term){
+    for(size_t i = 0 ; i < probes.size() ; ++i){
+        if(probes[i].pickupArea == pickupArea && probes[i].dropoffArea == dropoffArea){
+            if(find(probes[i].terms.begin(), probes[i].terms.end(), term) == probes[i].terms.end())
+                probes[i].terms.push_back(term);
+            return;
+        }
+    }
+    Probe probe;
+    probe.pickupArea = pickupArea;
+    probe.dropoffArea = dropoffArea;
+    probe.terms.push_back(term);
+    probes.push_back(probe);
+}
+
+void QueryPlan::optimize(){
+    //fold covered probes and merge overlapping ones until nothing changes
+    bool changed = true;
+    while(changed){
+        changed = false;
+        for(size_t i = 0 ; i < probes.size() && !changed ; ++i){
+            for(size_t j = 0 ; j < probes.size() && !changed ; ++j){
+                if(i == j)
+                    continue;
+                Probe &a = probes[i];
+                Probe &b = probes[j];
+                bool folded = covers(a, b);
+                if(!folded && !mergeable(a, b))
+                    continue;
+                if(!folded){
+                    if(!a.pickupArea.isNull())
+                        a.pickupArea = a.pickupArea.united(b.pickupArea);
+                    if(!a.dropoffArea.isNull())
+                        a.dropoffArea = a.dropoffArea.united(b.dropoffArea);
+                }
+                for(size_t t = 0 ; t < b.terms.size() ; ++t)
+                    if(find(a.terms.begin(), a.terms.end(), b.terms[t]) == a.terms.end())
+                        a.terms.push_back(b.terms[t]);
+                probes.erase(probes.begin()+j);
+                changed = true;
+            }
+        }
+    }
+
+    //a probe whose terms an earlier probe also tests can skip the trips
+    //that probe returned
+    for(size_t i = 0 ; i < probes.size() ; ++i){
+        sort(probes[i].terms.begin(), probes[i].terms.end());
+        probes[i].coveredBy.clear();
+    }
+    for(size_t i = 0 ; i < probes.size() ; ++i)
+        for(size_t j = 0 ; j < i ; ++j)
+            if(includes(probes[j].terms.begin(), probes[j].terms.end(),
+                        probes[i].terms.begin(), probes[i].terms.end()))
+                probes[i].coveredBy.push_back(j);
+}
+
+bool QueryPlan::covers(const Probe &a, const Probe &b){
+    //every trip b can return is also returned by a
+    return (a.pickupArea.isNull() || (!b.pickupArea.isNull() && a.pickupArea.contains(b.pickupArea))) &&
+           (a.dropoffArea.isNull() || (!b.dropoffArea.isNull() && a.dropoffArea.contains(b.dropoffArea)));
+}
+
+bool QueryPlan::mergeable(const Probe &a, const Probe &b){
+    //same constrained sides, overlapping on each, and the merged box is no
+    //larger than the two boxes together
+    if(a.pickupArea.isNull() != b.pickupArea.isNull() || a.dropoffArea.isNull() != b.dropoffArea.isNull())
+        return false;
+    double sizeA = 1, sizeB = 1, sizeUnion = 1;
+    const QRectF *areasA[2] = {&a.pickupArea, &a.dropoffArea};
+    const QRectF *areasB[2] = {&b.pickupArea, &b.dropoffArea};
+    for(int side = 0 ; side < 2 ; ++side){
+        if(areasA[side]->isNull())
+            continue;
+        if(!areasA[side]->intersects(*areasB[side]))
+            return false;
+        QRectF united = areasA[side]->united(*areasB[side]);
+        sizeA *= areasA[side]->width()*areasA[side]->height();
+        sizeB *= areasB[side]->width()*areasB[side]->height();
+        sizeUnion *= united.width()*united.height();
+    }
+    return sizeUnion <= sizeA + sizeB;
+}
+
+bool QueryPlan::inside(const QRectF &area, float lat, float lon){
+    //the same float comparisons as the KD query of the area
+    return area.isNull() ||
+           ((float)area.x() <= lat && lat <= (float)(area.x() + area.width()) &&
+            (float)area.y() <= lon && lon <= (float)(area.y() + area.height()));
+}
+
+QueryPlan::Evaluator::Evaluator(const QueryPlan &plan):
+    plan(plan),
+    pickupStamp(plan.selections.size(), 0), dropoffStamp(plan.selections.size(), 0),
+    pickupInside(plan.selections.size(), 0), dropoffInside(plan.selections.size(), 0),
+    stamp(0){
+}
+
+bool QueryPlan::Evaluator::accepts(int probe, const KdTrip::Trip *trip){
+    //a selection shared by several terms is tested once per trip
+    ++stamp;
+    const vector<int> &probeTerms = plan.probes[probe].terms;
+    for(size_t i = 0 ; i < probeTerms.size() ; ++i)
+        if(acceptedBy(probeTerms[i], trip))
+            return true;
+    return false;
+}
+
+bool QueryPlan::Evaluator::acceptsAny(const KdTrip::Trip *trip){
+    ++stamp;
+    for(size_t t = 0 ; t < plan.terms.size() ; ++t)
+        if(acceptedBy((int)t, trip))
+            return true;
+    return false;
+}
+
+bool QueryPlan::Evaluator::tag(int probe, const KdTrip::Trip *trip, uint64_t &groupMask){
+    ++stamp;
+    const vector<int> &probeTerms = plan.probes[probe].terms;
+    bool accepted = false;
+    for(size_t i = 0 ; i < probeTerms.size() ; ++i)
+        accepted = tagBy(probeTerms[i], trip, accepted, groupMask) || accepted;
+    return accepted;
+}
+
+bool QueryPlan::Evaluator::tagAny(const KdTrip::Trip *trip, uint64_t &groupMask){
+    ++stamp;
+    bool accepted = false;
+    for(size_t t = 0 ; t < plan.terms.size() ; ++t)
+        accepted = tagBy((int)t, trip, accepted, groupMask) || accepted;
+    return accepted;
+}
+
+bool QueryPlan::Evaluator::tagBy(int term, const KdTrip::Trip *trip, bool accepted, uint64_t &groupMask){
+    //once the trip is in, a term can only add its group's bit
+    int bit = plan.terms[term].groupBit;
+    if(accepted && (bit < 0 || ((groupMask >> bit) & 1)))
+        return false;
+    if(!acceptedBy(term, trip))
+        return false;
+    if(bit >= 0)
+        groupMask |= 1ull << bit;
+    return true;
+}
+
+bool QueryPlan::Evaluator::acceptedBy(int term, const KdTrip::Trip *trip){
+    const Term &t = plan.terms[term];
+    if(t.either)
+        return pickupIn(t.origin, trip) || dropoffIn(t.destination, trip);
+    return (t.origin < 0 || pickupIn(t.origin, trip)) &&
+           (t.destination < 0 || dropoffIn(t.destination, trip));
+}
+
+bool QueryPlan::Evaluator::pickupIn(int selection, const KdTrip::Trip *trip){
+    if(pickupStamp[selection] != stamp){
+        pickupStamp[selection] = stamp;
+        pickupInside[selection] = plan.prepared[selection].contains(trip->pickup_lat, trip->pickup_long);
+    }
+    return pickupInside[selection];
+}
+
+bool QueryPlan::Evaluator::dropoffIn(int selection, const KdTrip::Trip *trip){
+    if(dropoffStamp[selection] != stamp){
+        dropoffStamp[selection] = stamp;
+        dropoffInside[selection] = plan.prepared[selection].contains(trip->dropoff_lat, trip->dropoff_long);
+    }
+    return dropoffInside[selection];
+}
+
+bool TripGroups::maskOf(const KdTrip::Trip *trip, uint64_t &groupMask) const{
+    boost::unordered_map<const KdTrip::Trip*, uint64_t>::const_iterator it = masks.find(trip);
+    if(it == masks.end())
+        return false;
+    groupMask = it->second;
+    return true;
+}
+
+map<Group, int> TripGroups::bitsFor(const TripGroups *tripGroups, SelectionGraph *graph, const set<Group> &groups){
+    map<Group, int> bits;
+    bool tagged = tripGroups && tripGroups->plan && tripGroups->plan->sameQuery(QueryPlan(graph));
+    set<Group>::const_iterator it;
+    for(it = groups.begin() ; it != groups.end() ; ++it)
+        bits[*it] = tagged ? tripGroups->plan->groupBit(*it) : -1;
+    return bits;
+}
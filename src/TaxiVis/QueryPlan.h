@@ -0,0 +1,152 @@
+#ifndef QUERYPLAN_H
+#define QUERYPLAN_H
+
+#include "KdTrip.hpp"
+#include "PreparedPolygon.h"
+#include "SelectionGraph.h"
+#include <QPainterPath>
+#include <QRectF>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
+// A SelectionGraph compiled into the KD-tree probes that answer it. Every
+// edge, and every node without edges, becomes a term: an exact test of a
+// trip against the selections involved. Each term needs one probe (two for
+// a START_AND_END node, one per side) whose boxes cover the trips it can
+// accept. Nodes that share a selection (same object or same geometry) share
+// its tests, equal probes are fused, a probe covered by another is folded
+// into it, and overlapping probes are merged when their union is no larger
+// than the two boxes. A trip returned by a probe is kept when one of the
+// probe's terms accepts it; trips a previous probe already tested against
+// the same terms are skipped. The plan keeps its own copy of the selection
+// geometries, prepared for the exact tests, so it can be run on another
+// thread while the graph is edited. Filtering a trip can also tag it with
+// one bit per group of the terms accepting it, so the plots need not test
+// the trips of each group again (see TripGroups).
+class QueryPlan
+{
+public:
+    struct Term {
+        int         origin;       // selection tested on the pickup, or -1
+        int         destination;  // selection tested on the dropoff, or -1
+        bool        either;       // one of the two tests is enough
+        Group       group;
+        std::string source;       // "edge 3", "node 5" or "all"
+        int         groupBit;     // bit of group in the trip masks, -1 past MaxGroups
+    };
+
+    // An unconstrained side has a null rectangle
+    struct Probe {
+        QRectF           pickupArea;
+        QRectF           dropoffArea;
+        std::vector<int> terms;
+        std::vector<int> coveredBy;  // earlier probes testing all of these terms
+    };
+
+    // Per-trip cache of the selection tests, reused across trips
+    class Evaluator {
+    public:
+        explicit Evaluator(const QueryPlan &plan);
+        // True when a term of probe accepts trip
+        bool accepts(int probe, const KdTrip::Trip *trip);
+        // True when any term of the plan accepts trip
+        bool acceptsAny(const KdTrip::Trip *trip);
+        // Same as accepts and acceptsAny, also setting in groupMask the
+        // bits of the groups of every accepting term
+        bool tag(int probe, const KdTrip::Trip *trip, uint64_t &groupMask);
+        bool tagAny(const KdTrip::Trip *trip, uint64_t &groupMask);
+    private:
+        const QueryPlan      &plan;
+        std::vector<uint64_t> pickupStamp, dropoffStamp;
+        std::vector<char>     pickupInside, dropoffInside;
+        uint64_t              stamp;
+        bool acceptedBy(int term, const KdTrip::Trip *trip);
+        bool tagBy(int term, const KdTrip::Trip *trip, bool accepted, uint64_t &groupMask);
+        bool pickupIn(int selection, const KdTrip::Trip *trip);
+        bool dropoffIn(int selection, const KdTrip::Trip *trip);
+    };
+
+public:
+    // Groups past this many have no bit in the trip masks
+    static const int MaxGroups = 64;
+
+    explicit QueryPlan(SelectionGraph *graph);
+
+    const std::vector<Probe> &getProbes() const;
+    const std::vector<Term>  &getTerms() const;
+    int                       numSelections() const;
+    // The groups of the terms; the i-th one has bit i in the trip masks
+    const std::vector<Group> &getGroups() const;
+    // Bit of group in the trip masks, or -1
+    int                       groupBit(const Group &group) const;
+    // The KD query of probe within the time constraints of timeQuery
+    KdTrip::Query             probeQuery(int probe, const KdTrip::Query &timeQuery) const;
+    static KdTrip::Query      probeQuery(const Probe &probe, const KdTrip::Query &timeQuery);
+    // True when trip lies in the boxes of an earlier probe that tested it
+    // against every term of probe
+    bool                      isCovered(int probe, const KdTrip::Trip *trip) const;
+    // One line per probe with its boxes and terms
+    std::string               str() const;
+
+    // True when other has the same terms over the same selections (same
+    // groups too), so it selects and tags the same trips; the nodes and
+    // edges the terms come from may differ (a copy of the graph)
+    bool                      sameQuery(const QueryPlan &other) const;
+    // Equal for plans with the same query
+    size_t                    hash() const;
+    // Index of the one selection whose geometry differs from previous when
+    // this plan is previous with that selection moved or reshaped, and -1
+    // otherwise (other changes, or none)
+    int                       reshapedSelection(const QueryPlan &previous) const;
+    // Probes returning every trip whose result can change when selection
+    // takes its geometry in this plan instead of previousGeometry: for each
+    // term testing it, one probe per rectangle covering the difference on
+    // each side it is tested, the other side within its selection's box
+    // (both boxes when that is the reshaped selection too)
+    std::vector<Probe>        reshapeProbes(int selection, const QPainterPath &previousGeometry) const;
+    // Rectangles covering the points inside exactly one of a and b: the
+    // cells of a grid over both that are neither inside both nor outside
+    // both, merged into runs along rows and then across equal runs of
+    // consecutive rows
+    static void               coverDifference(const QPainterPath &a, const QPainterPath &b,
+                                              std::vector<QRectF> &rects, int grid = 64);
+    const QPainterPath       &selectionGeometry(int selection) const;
+
+private:
+    std::vector<QPainterPath> selections;
+    std::vector<PreparedPolygon> prepared;
+    std::vector<QRectF>       boxes;
+    std::vector<Term>         terms;
+    std::vector<Probe>        probes;
+    std::vector<Group>        groups;
+
+    int  selectionIndex(Selection *selection);
+    void indexGroups();
+    bool sameTerms(const QueryPlan &other) const;
+    void addProbe(const QRectF &pickupArea, const QRectF &dropoffArea, int term);
+    void optimize();
+    static bool covers(const Probe &a, const Probe &b);
+    static bool mergeable(const Probe &a, const Probe &b);
+    static bool inside(const QRectF &area, float lat, float lon);
+};
+
+// Group membership of the trips of a result set, tagged while the plan
+// that selected them filtered them: bit i of the mask of a trip is set when
+// a term of the i-th group of the plan accepts it
+struct TripGroups {
+    boost::shared_ptr<const QueryPlan>                  plan;   // NULL when untagged
+    boost::unordered_map<const KdTrip::Trip*, uint64_t> masks;
+
+    // False for a trip without a mask (added to the set some other way)
+    bool maskOf(const KdTrip::Trip *trip, uint64_t &groupMask) const;
+    // The bit standing for each of groups when tripGroups holds the masks
+    // of the query of graph, and -1 where the trips must be tested instead
+    static std::map<Group, int> bitsFor(const TripGroups *tripGroups, SelectionGraph *graph,
+                                        const std::set<Group> &groups);
+};
+
+#endif // QUERYPLAN_H
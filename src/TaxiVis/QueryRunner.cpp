@@ -0,0 +1,284 @@
+#include "QueryRunner.h"
+#include "global.h"
+#include <chrono>
+#include <functional>
+
+//previews are thinned to take about this long, so that they keep up with
+//the mouse at ~30 Hz, as far as sampling the traversal allows
+static const std::chrono::milliseconds PreviewBudget(33);
+static const unsigned MinPreviewStride = 2;
+static const unsigned MaxPreviewStride = 4096;
+
+QueryRunner::Job::Job(const RequestPtr &request):
+    request(request),
+    cancelled(new std::atomic<bool>(false)),
+    reshaped(-1),
+    stepped(false),
+    sampleStride(0),
+    nearestCount(0),
+    dropoff(false){
+}
+
+QueryRunner::QueryRunner(QObject *parent) :
+    QObject(parent),
+    worker(new ThreadPool(1)),
+    previewStride(16){
+    connect(this, SIGNAL(queryDone()), this, SLOT(deliver()), Qt::QueuedConnection);
+}
+
+QueryRunner::~QueryRunner(){
+    //queued jobs are all cancelled by now and return right away
+    cancel();
+    worker.reset();
+}
+
+void QueryRunner::start(SelectionGraph *graph, const DateTimeList &times, const KdTrip::TimePattern *pattern){
+    submit(graph, times, pattern, false);
+}
+
+void QueryRunner::preview(SelectionGraph *graph, const DateTimeList &times, const KdTrip::TimePattern *pattern){
+    submit(graph, times, pattern, true);
+}
+
+void QueryRunner::submit(SelectionGraph *graph, const DateTimeList &times, const KdTrip::TimePattern *pattern,
+                         bool preview){
+    boost::shared_ptr<ResultStore::Key> request(new ResultStore::Key(graph));
+    request->times = times;
+    if (pattern) {
+        request->hasPattern = true;
+        request->pattern = *pattern;
+    }
+    JobPtr job(new Job(request));
+    job->timeQuery = timeQuery(times, pattern);
+    job->timeQuery.setCancelFlag(job->cancelled);
+    if (!preview)
+        job->graph = ResultHistory::copyGraph(graph);
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (current)
+            current->cancelled->store(true);
+        //a preview is sampled; otherwise the result set still holds the
+        //last result taken, whatever was started since
+        if (preview)
+            job->sampleStride = previewStride;
+        else if (delivered && request->sameTimes(*delivered)) {
+            job->reshaped = request->plan.reshapedSelection(delivered->plan);
+            if (job->reshaped >= 0) {
+                job->previousGeometry = delivered->plan.selectionGeometry(job->reshaped);
+                job->previous = deliveredSnapshot;
+            }
+        }
+        else if (delivered && !pattern && !delivered->hasPattern && overlaps(times, delivered->times) &&
+                 request->plan.sameQuery(delivered->plan)) {
+            job->stepped = true;
+            job->previousTimeQuery = QueryManager::timeQuery(delivered->times);
+            job->previous = deliveredSnapshot;
+        }
+        current = job;
+        ready.reset();
+    }
+    worker->submit(std::bind(&QueryRunner::run, this, job));
+}
+
+void QueryRunner::nearest(QPointF location, bool dropoff, int k, const DateTimeList &times,
+                          const KdTrip::TimePattern *pattern){
+    JobPtr job(new Job(RequestPtr()));
+    job->nearestCount = k;
+    job->location = location;
+    job->dropoff = dropoff;
+    job->timeQuery = timeQuery(times, pattern);
+    job->timeQuery.setCancelFlag(job->cancelled);
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (current)
+            current->cancelled->store(true);
+        current = job;
+        ready.reset();
+        //the selection query after this one has nothing to update
+        delivered.reset();
+        deliveredSnapshot.reset();
+    }
+    worker->submit(std::bind(&QueryRunner::run, this, job));
+}
+
+KdTrip::Query QueryRunner::timeQuery(const DateTimeList &times, const KdTrip::TimePattern *pattern){
+    //every interval (or the pattern) is searched in the same traversal
+    if (!pattern)
+        return QueryManager::timeQuery(times);
+    KdTrip::Query query;
+    query.setTimePattern(*pattern);
+    return query;
+}
+
+void QueryRunner::cancel(){
+    std::unique_lock<std::mutex> lock(mutex);
+    if (current)
+        current->cancelled->store(true);
+    current.reset();
+    ready.reset();
+    delivered.reset();
+    deliveredSnapshot.reset();
+}
+
+bool QueryRunner::isBusy(){
+    std::unique_lock<std::mutex> lock(mutex);
+    return current && !current->sampleStride;
+}
+
+ResultStore::SnapshotPtr QueryRunner::takeResult(){
+    std::unique_lock<std::mutex> lock(mutex);
+    JobPtr job = ready;
+    if (!job)
+        return ResultStore::SnapshotPtr();
+    ready.reset();
+    current.reset();
+    if (!job->sampleStride && !job->nearestCount) {
+        delivered = job->request;
+        deliveredSnapshot = job->result;
+        ResultHistory::State state;
+        state.graph = job->graph;
+        state.times = job->request->times;
+        state.hasPattern = job->request->hasPattern;
+        state.pattern = job->request->pattern;
+        state.request = job->request;
+        state.snapshot = job->result;
+        history.add(state);
+    }
+    return job->result;
+}
+
+bool QueryRunner::back(ResultHistory::State &state){
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!history.back(state))
+        return false;
+    restore(state);
+    return true;
+}
+
+bool QueryRunner::forward(ResultHistory::State &state){
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!history.forward(state))
+        return false;
+    restore(state);
+    return true;
+}
+
+void QueryRunner::restore(const ResultHistory::State &state){
+    if (current)
+        current->cancelled->store(true);
+    current.reset();
+    ready.reset();
+    delivered = state.request;
+    deliveredSnapshot = state.snapshot;
+}
+
+void QueryRunner::run(JobPtr job){
+    if (job->sampleStride) {
+        runPreview(job);
+        return;
+    }
+    if (job->nearestCount) {
+        runNearest(job);
+        return;
+    }
+    //worker thread; the store runs fill unless another view has the result
+    ResultStore::SnapshotPtr result =
+            ResultStore::shared().acquire(job->request, std::bind(&QueryRunner::fill, job, std::placeholders::_1),
+                                          *job->cancelled);
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!result || job->cancelled->load() || current != job)
+            return;
+        job->result = result;
+        ready = job;
+    }
+    emit queryDone();
+}
+
+void QueryRunner::runPreview(const JobPtr &job){
+    //worker thread
+    ResultStore::SnapshotPtr result(new ResultStore::Snapshot);
+    result->preview = true;
+    result->sampleStride = job->sampleStride;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    Global::getInstance()->querySample(job->request->plan, job->timeQuery, job->sampleStride, *result);
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now()-begin;
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (job->cancelled->load() || current != job)
+            return;
+        //twice the sampling when over budget, half when well within it
+        if (elapsed > PreviewBudget)
+            previewStride = std::min(2*job->sampleStride, MaxPreviewStride);
+        else if (3*elapsed < PreviewBudget)
+            previewStride = std::max(job->sampleStride/2, MinPreviewStride);
+        job->result = result;
+        ready = job;
+    }
+    emit queryDone();
+}
+
+void QueryRunner::runNearest(const JobPtr &job){
+    //worker thread
+    ResultStore::SnapshotPtr result(new ResultStore::Snapshot);
+    Global::getInstance()->queryNearest(job->location, job->dropoff, job->nearestCount, job->timeQuery, *result);
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (job->cancelled->load() || current != job)
+            return;
+        job->result = result;
+        ready = job;
+    }
+    emit queryDone();
+}
+
+bool QueryRunner::overlaps(const DateTimeList &times, const DateTimeList &previous){
+    return times.count()==1 && previous.count()==1 &&
+           times.at(0).first<=previous.at(0).second && previous.at(0).first<=times.at(0).second;
+}
+
+bool QueryRunner::fill(const JobPtr &job, ResultStore::Snapshot &snapshot){
+    //worker thread
+    const QueryPlan &plan = job->request->plan;
+    TripResult &result = snapshot;
+    if (job->stepped) {
+        TripResult added, removed;
+        Global::getInstance()->queryTimeChanges(plan, job->previousTimeQuery, *job->previous,
+                                                job->timeQuery, added, removed);
+        if (!job->cancelled->load()) {
+            result = *job->previous;
+            Global::getInstance()->applyChanges(added, removed, result);
+            //the changes stay with the snapshot, pins and masks included
+            snapshot.added.swap(added);
+            snapshot.removed.swap(removed);
+            snapshot.base = job->previous;
+        }
+    }
+    else if (job->reshaped >= 0) {
+        //the previous snapshot may be shown by other views: the changes go
+        //to a copy of it
+        TripResult added, removed;
+        std::vector<QueryPlan::Probe> probes = plan.reshapeProbes(job->reshaped, job->previousGeometry);
+        Global::getInstance()->queryChanges(plan, probes, job->timeQuery, added, removed);
+        if (!job->cancelled->load()) {
+            result = *job->previous;
+            Global::getInstance()->applyChanges(added, removed, result);
+        }
+    }
+    else
+        Global::getInstance()->queryData(plan, job->timeQuery, result);
+    return !job->cancelled->load();
+}
+
+void QueryRunner::deliver(){
+    //runner's thread; a result cancelled since queryDone was posted is gone
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!ready)
+            return;
+    }
+    emit finished();
+}
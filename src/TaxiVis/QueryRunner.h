@@ -0,0 +1,140 @@
+#ifndef QUERYRUNNER_H
+#define QUERYRUNNER_H
+
+#include "KdTrip.hpp"
+#include "QueryPlan.h"
+#include "ResultStore.h"
+#include "SelectionGraph.h"
+#include "ThreadPool.hpp"
+#include "timewidget.h"
+#include <QObject>
+#include <QPointF>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+// Runs the selection queries of a map view on a worker thread, so that the
+// GUI thread never waits on the KD-tree. A query works on a QueryPlan of
+// the graph taken when it starts, so the graph can be edited meanwhile.
+// Starting a query cancels the one in flight: its traversal stops at the
+// next check of the cancel flag and its trips are dropped. When the latest
+// query is done, finished() is delivered queued on the runner's thread and
+// takeResult() hands the trips over.
+//
+// Results are snapshots of the shared ResultStore: a query another view
+// already answered, or is answering, is not run again.
+//
+// While a selection is drawn or dragged, previews query a sample of the
+// trips, thinned so that each one takes about PreviewBudget; they do not
+// take part in the incremental updates.
+//
+// The k nearest trips to a point are searched on the worker as well; their
+// snapshot is the view's own, not shared through the store.
+//
+// The selections, times and results taken are kept in a ResultHistory:
+// back() and forward() move through it and hand a state over to be shown
+// as it was, without a query, and a query asking for one of those results
+// again finds it in the store.
+//
+// When a query differs from the one whose result was last taken only in
+// the geometry of one selection (it was moved or resized) and has the same
+// times, only the trips with an end in the region between the old and the
+// new geometry are queried and re-tested, and the new snapshot is the
+// previous one with those trips added and removed. Likewise when only its
+// time interval moved, overlapping the previous one (the time window
+// stepped): only the slices of time it entered are queried, and the trips
+// of those it left are dropped; the snapshot then records the changes, for
+// the views to update their aggregates with.
+class QueryRunner : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QueryRunner(QObject *parent = 0);
+    ~QueryRunner();
+
+    // Queries graph over every interval of times, or over pattern when given
+    void start(SelectionGraph *graph, const DateTimeList &times, const KdTrip::TimePattern *pattern = NULL);
+    // Same for a preview of the result, on a sample of the trips
+    void preview(SelectionGraph *graph, const DateTimeList &times, const KdTrip::TimePattern *pattern = NULL);
+    // The k trips picked up (dropped off) closest to location within the
+    // same times; the next selection query runs in full
+    void nearest(QPointF location, bool dropoff, int k, const DateTimeList &times,
+                 const KdTrip::TimePattern *pattern = NULL);
+    // Drops the query in flight and any result not taken yet, and forgets
+    // the last result taken: the caller is about to fill the result set
+    // some other way, so the next query runs in full
+    void cancel();
+    // True from start() until the result is taken or the query cancelled;
+    // previews do not count
+    bool isBusy();
+    // The snapshot of the finished query (or preview), or NULL when there
+    // is none
+    ResultStore::SnapshotPtr takeResult();
+    // Drop any query in flight and move to the state before (after) the
+    // one shown, copied to state; the next query updates from it. False
+    // when there is none
+    bool back(ResultHistory::State &state);
+    bool forward(ResultHistory::State &state);
+
+signals:
+    void finished();
+    // emitted from the worker thread, connected queued to deliver()
+    void queryDone();
+
+private slots:
+    void deliver();
+
+private:
+    typedef ResultStore::KeyPtr RequestPtr;
+
+    struct Job {
+        explicit Job(const RequestPtr &request);
+        RequestPtr                            request;
+        // the selections asked for, for the history; not kept for previews
+        boost::shared_ptr<SelectionGraph>     graph;
+        KdTrip::Query                         timeQuery;
+        boost::shared_ptr<std::atomic<bool> > cancelled;
+        // selection reshaped since the last result taken, its geometry and
+        // the snapshot there, for an incremental update; -1 for a full query
+        int                                   reshaped;
+        QPainterPath                          previousGeometry;
+        // or else, when only the time interval moved, the previous one
+        bool                                  stepped;
+        KdTrip::Query                         previousTimeQuery;
+        ResultStore::SnapshotPtr              previous;
+        ResultStore::SnapshotPtr              result;
+        unsigned                              sampleStride;  // 0 unless a preview
+        // k of a nearest search, 0 for a selection query
+        int                                   nearestCount;
+        QPointF                               location;
+        bool                                  dropoff;
+    };
+    typedef boost::shared_ptr<Job> JobPtr;
+
+    void submit(SelectionGraph *graph, const DateTimeList &times, const KdTrip::TimePattern *pattern,
+                bool preview);
+    void run(JobPtr job);
+    void runPreview(const JobPtr &job);
+    void runNearest(const JobPtr &job);
+    static KdTrip::Query timeQuery(const DateTimeList &times, const KdTrip::TimePattern *pattern);
+    static bool fill(const JobPtr &job, ResultStore::Snapshot &snapshot);
+    // Makes state the one shown, with the runner's lock held
+    void restore(const ResultHistory::State &state);
+    // True when times is a single interval overlapping the single one of
+    // previous
+    static bool overlaps(const DateTimeList &times, const DateTimeList &previous);
+
+    std::mutex                     mutex;
+    JobPtr                         current;    // latest query started
+    JobPtr                         ready;      // current, once finished
+    RequestPtr                     delivered;  // what the last result taken answers
+    ResultStore::SnapshotPtr       deliveredSnapshot;
+    ResultHistory                  history;
+    // sampling of the next preview, adjusted to the time of the last one
+    unsigned                       previewStride;
+    // a single thread: the engine fans each query out on the shared pool
+    boost::shared_ptr<ThreadPool>  worker;
+};
+
+#endif // QUERYRUNNER_H
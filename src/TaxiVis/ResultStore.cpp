@@ -0,0 +1,220 @@
+#include "ResultStore.h"
+#include <algorithm>
+#include <chrono>
+#include <boost/functional/hash.hpp>
+
+//how often a query waiting on another one checks its cancel flag
+static const std::chrono::milliseconds WaitStep(20);
+
+ResultStore::Key::Key(SelectionGraph *graph):
+    plan(graph),
+    hasPattern(false){
+}
+
+bool ResultStore::Key::sameTimes(const Key &key) const{
+    if (hasPattern != key.hasPattern)
+        return false;
+    if (hasPattern)
+        return pattern.years == key.pattern.years && pattern.months == key.pattern.months &&
+               pattern.weekdays == key.pattern.weekdays && pattern.hours == key.pattern.hours;
+    return times == key.times;
+}
+
+bool ResultStore::Key::sameResult(const Key &key) const{
+    return sameTimes(key) && plan.sameQuery(key.plan);
+}
+
+size_t ResultStore::Key::hash() const{
+    size_t seed = plan.hash();
+    boost::hash_combine(seed, hasPattern);
+    if (hasPattern) {
+        boost::hash_combine(seed, pattern.years);
+        boost::hash_combine(seed, pattern.months);
+        boost::hash_combine(seed, pattern.weekdays);
+        boost::hash_combine(seed, pattern.hours);
+        return seed;
+    }
+    for (int i=0; i<times.count(); i++) {
+        boost::hash_combine(seed, times.at(i).first.toMSecsSinceEpoch());
+        boost::hash_combine(seed, times.at(i).second.toMSecsSinceEpoch());
+    }
+    return seed;
+}
+
+bool ResultStore::Snapshot::derivesFrom(const boost::weak_ptr<Snapshot> &other) const{
+    //compared by owner: other may be gone, and its address reused
+    boost::weak_ptr<Snapshot> none;
+    if (!base.owner_before(none) && !none.owner_before(base))
+        return false;
+    return !base.owner_before(other) && !other.owner_before(base);
+}
+
+bool ResultStore::Snapshot::changesFrom(const boost::weak_ptr<Snapshot> &other, const TripResult *&added,
+                                        const TripResult *&removed) const{
+    if (derivesFrom(other)) {
+        added = &this->added;
+        removed = &this->removed;
+        return true;
+    }
+    SnapshotPtr later = other.lock();
+    if (!later || later->base.lock().get()!=this)
+        return false;
+    added = &later->removed;
+    removed = &later->added;
+    return true;
+}
+
+ResultStore &ResultStore::shared(){
+    static ResultStore store;
+    return store;
+}
+
+ResultStore::SnapshotPtr ResultStore::acquire(const KeyPtr &key, const FillFunction &fill,
+                                              const std::atomic<bool> &cancelled){
+    size_t hash = key->hash();
+    SnapshotPtr snapshot;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            if (cancelled.load())
+                return SnapshotPtr();
+            EntryMap::iterator entry = lookup(*key, hash);
+            if (entry==entries.end())
+                break;
+            if (entry->second.ready) {
+                //the last view holding it may let go of it meanwhile
+                SnapshotPtr published = entry->second.snapshot.lock();
+                if (published)
+                    return published;
+                continue;
+            }
+            //another view is running this query; if it is cancelled its
+            //entry goes away and this one runs it instead
+            filled.wait_for(lock, WaitStep);
+        }
+        prune();
+        snapshot.reset(new Snapshot);
+        Entry entry = {key, snapshot, false};
+        entries.insert(std::make_pair(hash, entry));
+    }
+
+    bool complete = fill(*snapshot) && !cancelled.load();
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        std::pair<EntryMap::iterator, EntryMap::iterator> range = entries.equal_range(hash);
+        for (EntryMap::iterator it=range.first; it!=range.second; ++it)
+            if (it->second.key==key) {
+                if (complete)
+                    it->second.ready = true;
+                else
+                    entries.erase(it);
+                break;
+            }
+    }
+    filled.notify_all();
+    return complete ? snapshot : SnapshotPtr();
+}
+
+ResultStore::SnapshotPtr ResultStore::find(const Key &key){
+    std::unique_lock<std::mutex> lock(mutex);
+    EntryMap::iterator entry = lookup(key, key.hash());
+    if (entry==entries.end() || !entry->second.ready)
+        return SnapshotPtr();
+    //NULL too when it expired since the lookup
+    return entry->second.snapshot.lock();
+}
+
+ResultStore::EntryMap::iterator ResultStore::lookup(const Key &key, size_t hash){
+    //an entry being filled is alive: its query holds the snapshot
+    std::pair<EntryMap::iterator, EntryMap::iterator> range = entries.equal_range(hash);
+    for (EntryMap::iterator it=range.first; it!=range.second; ++it)
+        if (!it->second.snapshot.expired() && it->second.key->sameResult(key))
+            return it;
+    return entries.end();
+}
+
+void ResultStore::prune(){
+    EntryMap::iterator it = entries.begin();
+    while (it!=entries.end()) {
+        if (it->second.snapshot.expired())
+            it = entries.erase(it);
+        else
+            ++it;
+    }
+}
+
+ResultHistory::ResultHistory(size_t maxStates, size_t maxBytes):
+    current(0),
+    maxStates(maxStates),
+    maxBytes(maxBytes),
+    totalBytes(0){
+}
+
+void ResultHistory::add(const State &state){
+    if (!state.snapshot)
+        return;
+    while (!states.empty() && states.size()>current+1) {
+        totalBytes -= footprint(*states.back().snapshot);
+        states.pop_back();
+    }
+    states.push_back(state);
+    totalBytes += footprint(*state.snapshot);
+    //the current one stays whatever its size: the view shows it
+    while (states.size()>1 && (states.size()>maxStates || totalBytes>maxBytes)) {
+        totalBytes -= footprint(*states.front().snapshot);
+        states.pop_front();
+    }
+    current = states.size()-1;
+}
+
+bool ResultHistory::back(State &state){
+    if (states.empty() || current==0)
+        return false;
+    state = states[--current];
+    return true;
+}
+
+bool ResultHistory::forward(State &state){
+    if (current+1>=states.size())
+        return false;
+    state = states[++current];
+    return true;
+}
+
+void ResultHistory::clear(){
+    states.clear();
+    current = 0;
+    totalBytes = 0;
+}
+
+size_t ResultHistory::size() const{
+    return states.size();
+}
+
+size_t ResultHistory::bytes() const{
+    return totalBytes;
+}
+
+static void deleteGraph(SelectionGraph *graph){
+    SelectionGraph::NodeIterator begin, end;
+    while (graph->numberOfNodes()>0) {
+        graph->getNodeIterator(begin, end);
+        Selection *selection = begin->second->getSelection();
+        graph->removeNode(begin->second->getId());
+        delete selection;
+    }
+    delete graph;
+}
+
+boost::shared_ptr<SelectionGraph> ResultHistory::copyGraph(SelectionGraph *graph){
+    boost::shared_ptr<SelectionGraph> copy(new SelectionGraph, deleteGraph);
+    copy->assign(graph);
+    return copy;
+}
+
+size_t ResultHistory::footprint(const ResultStore::Snapshot &snapshot){
+    //a set node and a bucket per trip, and about as much for its mask
+    size_t trips = snapshot.trips.size()+snapshot.added.trips.size()+snapshot.removed.trips.size();
+    return trips*2*(3*sizeof(void*)+sizeof(uint64_t));
+}
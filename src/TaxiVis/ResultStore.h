@@ -0,0 +1,151 @@
+#ifndef RESULTSTORE_H
+#define RESULTSTORE_H
+
+#include "KdTrip.hpp"
+#include "QueryPlan.h"
+#include "querymanager.h"
+#include "SelectionGraph.h"
+#include "timewidget.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/weak_ptr.hpp>
+
+// Results of the selection queries, shared by every view asking the same
+// query. A result is a snapshot: the trips (with their pins and group
+// masks) of one plan over one set of times, never modified once published,
+// and freed with its last owner. Views linked through the Coordinator show
+// the same selection over the same times, so they hold one snapshot
+// instead of one copy of the trips each, and only the first of them runs
+// the query: the others find it in the store, or wait for the query in
+// flight. The store only keeps weak references; a snapshot no view holds
+// is gone.
+class ResultStore
+{
+public:
+    // What a selection query asks for: a plan and its times
+    struct Key {
+        explicit Key(SelectionGraph *graph);
+        // Same times, or same recurring pattern
+        bool   sameTimes(const Key &key) const;
+        // Same times, and plans selecting and tagging the same trips
+        bool   sameResult(const Key &key) const;
+        size_t hash() const;
+
+        QueryPlan           plan;
+        DateTimeList        times;
+        bool                hasPattern;
+        KdTrip::TimePattern pattern;
+    };
+    typedef boost::shared_ptr<const Key> KeyPtr;
+
+    // The trips, with their pins and group masks, of a query
+    struct Snapshot : public TripResult {
+        Snapshot(): preview(false), sampleStride(1) {}
+        // True when the snapshot was made from other by adding and removing
+        // trips, so that what was computed from other can be updated with
+        // added and removed instead of computed again
+        bool derivesFrom(const boost::weak_ptr<Snapshot> &other) const;
+        // The trips that came in (added) and left (removed) going from
+        // other to this snapshot, when one of the two was made from the
+        // other: this one's changes, or those of other reversed when going
+        // back to the snapshot it was made from. False otherwise, or when
+        // other is gone
+        bool changesFrom(const boost::weak_ptr<Snapshot> &other, const TripResult *&added,
+                         const TripResult *&removed) const;
+
+        // a preview holds a sample of about one in sampleStride of the trips
+        // of its query, and is never published
+        bool            preview;
+        unsigned        sampleStride;
+        // the snapshot this one was made from when the time window stepped,
+        // and the trips that came in and left; added and removed keep their
+        // shards pinned and their group masks, as base may be gone
+        boost::weak_ptr<Snapshot> base;
+        TripResult                added;
+        TripResult                removed;
+    };
+    typedef boost::shared_ptr<Snapshot> SnapshotPtr;
+
+    // Fills a snapshot, returning false when it was cancelled part way
+    typedef std::function<bool (Snapshot &)> FillFunction;
+
+    static ResultStore &shared();
+
+    // The snapshot of key: the published one when there is one, after the
+    // query filling it when it is in flight, or else a new one filled with
+    // fill and published. Returns NULL when cancelled is set first, or fill
+    // is cancelled; the partial snapshot is not published
+    SnapshotPtr acquire(const KeyPtr &key, const FillFunction &fill, const std::atomic<bool> &cancelled);
+    // The published snapshot of key, or NULL
+    SnapshotPtr find(const Key &key);
+
+private:
+    struct Entry {
+        KeyPtr                    key;
+        boost::weak_ptr<Snapshot> snapshot;
+        bool                      ready;     // false while filled
+    };
+    typedef boost::unordered_multimap<size_t, Entry> EntryMap;
+
+    EntryMap                entries;
+    std::mutex              mutex;
+    std::condition_variable filled;
+
+    EntryMap::iterator lookup(const Key &key, size_t hash);
+    void               prune();
+};
+
+// The states a view showed, in order, within a number of states and an
+// estimate of the memory of their results, oldest dropped first. A state
+// is a copy of the selections, the times and the result over them, so
+// moving back and forth through the history restores it without a query.
+// Adding a state after moving back drops those that were ahead, as in a
+// browser. While a state is kept its snapshot also stays in the
+// ResultStore, so a query asking for it again, e.g. stepping the time
+// window back, is answered from memory.
+class ResultHistory
+{
+public:
+    struct State {
+        State(): hasPattern(false) {}
+        boost::shared_ptr<SelectionGraph> graph;   // owns its selections
+        DateTimeList                      times;
+        bool                              hasPattern;
+        KdTrip::TimePattern               pattern;
+        ResultStore::KeyPtr               request;
+        ResultStore::SnapshotPtr          snapshot;
+    };
+
+    explicit ResultHistory(size_t maxStates = 16, size_t maxBytes = 256u<<20);
+
+    // Makes state the current one, after those up to the current one
+    void   add(const State &state);
+    // Moves to the state before (after) the current one and copies it to
+    // state; false, leaving it alone, when there is none
+    bool   back(State &state);
+    bool   forward(State &state);
+    void   clear();
+    size_t size() const;
+    size_t bytes() const;
+
+    // A copy of graph owning its nodes and selections, which SelectionGraph
+    // itself does not free
+    static boost::shared_ptr<SelectionGraph> copyGraph(SelectionGraph *graph);
+
+private:
+    std::deque<State> states;    // oldest first
+    size_t            current;   // index of the state shown
+    size_t            maxStates;
+    size_t            maxBytes;
+    size_t            totalBytes;
+
+    // trips and group masks of snapshot, as hash nodes
+    static size_t footprint(const ResultStore::Snapshot &snapshot);
+};
+
+#endif // RESULTSTORE_H
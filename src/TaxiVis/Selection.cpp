@@ -22,12 +22,14 @@ Selection::Selection(const QPainterPath& path):
     active(true),
     selectionType(Selection::START){
     selectionGeometry = QPainterPath(path);
+    preparedGeometry = PreparedPolygon(selectionGeometry);
 }
 
 Selection::Selection(const QPainterPath &path, Selection::TYPE selectionType):
     active(true),
     selectionType(selectionType){
     selectionGeometry = QPainterPath(path);
+    preparedGeometry = PreparedPolygon(selectionGeometry);
 }
 
 Selection::~Selection(){
@@ -47,19 +49,24 @@ void Selection::toogleSetActive(){
 }
 
 bool Selection::contains(QPointF p){
-    return selectionGeometry.contains(p);
+    return preparedGeometry.contains(p);
 }
 
 QPainterPath Selection::getGeometry(){
     return selectionGeometry;
 }
 
+const PreparedPolygon &Selection::getPreparedGeometry(){
+    return preparedGeometry;
+}
+
 void Selection::getCenter(QPointF& /*p*/){
     selectionGeometry.boundingRect().center();
 }
 
 void Selection::translate(const QPointF& v){
     selectionGeometry.translate(v);
+    preparedGeometry = PreparedPolygon(selectionGeometry);
 }
 
 QRectF Selection::boundingBox(){
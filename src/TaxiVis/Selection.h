@@ -6,6 +6,7 @@
 #include <map>
 #include <QPointF>
 #include <QPainterPath>
+#include "PreparedPolygon.h"
 
 class Selection
 {
@@ -20,6 +21,8 @@ public:
 
 private:
     QPainterPath selectionGeometry;
+    // the geometry prepared for contains(), rebuilt whenever it changes
+    PreparedPolygon preparedGeometry;
 protected:
     bool active;
     bool selected;
@@ -31,6 +34,7 @@ public:
     ~Selection();
     bool contains(QPointF p);
     QPainterPath getGeometry();
+    const PreparedPolygon &getPreparedGeometry();
     void getCenter(QPointF&);
     void translate(const QPointF& v);
     QRectF boundingBox();
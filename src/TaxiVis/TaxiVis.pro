@@ -7,6 +7,7 @@
 QT       += core gui opengl webkit
 
 #CONFIG += Debug
+CONFIG += c++11 thread
 
 TARGET = TaxiVis
 TEMPLATE = app
@@ -62,7 +63,11 @@ SOURCES += main.cpp\
     scatterplotwidget.cpp \
     util/sequentialred.cpp \
     extendedhistogram.cpp \
-    querymanager.cpp
+    querymanager.cpp \
+    QueryPlan.cpp \
+    QueryRunner.cpp \
+    PreparedPolygon.cpp \
+    ResultStore.cpp
 
 HEADERS  += mainwindow.h \
     HistogramDialog.hpp \
@@ -77,6 +82,11 @@ HEADERS  += mainwindow.h \
     layers/TripLocationLOD.hpp \
     geographicalviewwidget.h \
     KdTrip.hpp \
+    KdTree.hpp \
+    KdFixedTrip.hpp \
+    KdTripShardSet.hpp \
+    ThreadPool.hpp \
+    AsyncBlockReader.hpp \
     global.h \
     qcustomplot.h \
     SelectionGraph.h \
@@ -111,7 +121,11 @@ HEADERS  += mainwindow.h \
     scatterplotwidget.h \
     util/sequentialred.h \
     extendedhistogram.h \
-    querymanager.h
+    querymanager.h \
+    QueryPlan.h \
+    QueryRunner.h \
+    PreparedPolygon.h \
+    ResultStore.h
 
 FORMS    += mainwindow.ui \
     timeselectionwidget.ui \
@@ -11,7 +11,7 @@ TemporalSeriesDialog::TemporalSeriesDialog(GeographicalViewWidget *geo, int numB
     this->ui->setupUi(this);
 
 
-    KdTrip::TripSet *trips = this->geoWidget->getSelectedTrips();
+    const KdTrip::TripSet *trips = this->geoWidget->getSelectedTrips();
     QDateTime startTime = this->geoWidget->getSelectedStartTime();
     QDateTime endTime = this->geoWidget->getSelectedEndTime();
     SelectionGraph *selectionGraph = this->geoWidget->getSelectionGraph();
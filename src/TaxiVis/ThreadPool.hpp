@@ -0,0 +1,135 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <stddef.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+// Fixed-size pool of worker threads shared by the query engine. Work is
+// submitted either as fire-and-forget jobs or through parallelFor, which
+// blocks until every index has been processed. The calling thread takes
+// part in parallelFor, so it is safe to call it from inside a job.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned numThreads=0)
+    {
+        if (numThreads==0)
+            numThreads = std::max(1u, std::thread::hardware_concurrency());
+        this->stopping = false;
+        for (unsigned i=0; i<numThreads; i++)
+            this->workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->wakeup.notify_all();
+        for (size_t i=0; i<this->workers.size(); i++)
+            this->workers[i].join();
+    }
+
+    static ThreadPool & shared()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    size_t size() const
+    {
+        return this->workers.size();
+    }
+
+    void submit(const std::function<void()> &job)
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->jobs.push_back(job);
+        }
+        this->wakeup.notify_one();
+    }
+
+    // Calls fn(i) for every i in [0, n) using the workers and the caller
+    void parallelFor(size_t n, const std::function<void(size_t)> &fn)
+    {
+        if (n==0)
+            return;
+        if (n==1 || this->workers.empty()) {
+            for (size_t i=0; i<n; i++)
+                fn(i);
+            return;
+        }
+        // Helpers may start after the loop is over, so the counters they
+        // touch are owned by the helpers as well as by this call
+        boost::shared_ptr<ForState> state(new ForState(n, &fn));
+        size_t helpers = std::min(n-1, this->workers.size());
+        for (size_t i=0; i<helpers; i++)
+            this->submit(std::bind(&ThreadPool::runFor, state));
+        runFor(state);
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (state->completed<state->count)
+            state->done.wait(lock);
+    }
+
+private:
+    struct ForState {
+        ForState(size_t n, const std::function<void(size_t)> *f): count(n), next(0), completed(0), fn(f) {}
+        size_t                             count;
+        size_t                             next;
+        size_t                             completed;
+        const std::function<void(size_t)> *fn;
+        std::mutex                         mutex;
+        std::condition_variable            done;
+    };
+
+    static void runFor(boost::shared_ptr<ForState> state)
+    {
+        while (true) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(state->mutex);
+                if (state->next>=state->count)
+                    return;
+                index = state->next++;
+            }
+            (*state->fn)(index);
+            std::unique_lock<std::mutex> lock(state->mutex);
+            if (++state->completed==state->count)
+                state->done.notify_all();
+        }
+    }
+
+    void workerLoop()
+    {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                while (!this->stopping && this->jobs.empty())
+                    this->wakeup.wait(lock);
+                if (this->jobs.empty())
+                    return;
+                job = this->jobs.front();
+                this->jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::vector<std::thread>          workers;
+    std::deque<std::function<void()> > jobs;
+    std::mutex                        mutex;
+    std::condition_variable           wakeup;
+    bool                              stopping;
+};
+
+#endif
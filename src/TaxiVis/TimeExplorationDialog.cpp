@@ -17,7 +17,7 @@ TimeExplorationDialog::TimeExplorationDialog(QWidget *parent)
 TimeExplorationDialog::~TimeExplorationDialog()
 {
   for (int i=0; i<this->geoWidgets.count(); i++) {
-    delete this->geoWidgets.at(i)->getSelectedTrips();
+    delete this->tripSets.at(i);
     delete this->geoWidgets.at(i)->getSelectionGraph();
   }
   delete this->ui;
@@ -27,6 +27,7 @@ TimeExplorationDialog::~TimeExplorationDialog()
 void TimeExplorationDialog::addGeoWidget(QDateTime startTime, QDateTime endTime, SelectionGraph *graph, const KdTrip::TripSet &inTrips)
 {
   KdTrip::TripSet *trips = new KdTrip::TripSet(inTrips);
+  this->tripSets.append(trips);
   SelectionGraph *selectionGraph = new SelectionGraph();
   selectionGraph->assign(graph);
   
@@ -22,6 +22,8 @@ private:
   Ui::TimeExplorationDialog *ui;
   
   QList<GeographicalViewWidget*> geoWidgets;
+  // the trips each map was opened with
+  QList<KdTrip::TripSet*>        tripSets;
         
   Coordinator *coordinator;
   int valuesUpdated;
@@ -4,6 +4,7 @@
 #include "global.h"
 #include "GroupRepository.h"
 #include "coordinator.h"
+#include "QueryRunner.h"
 #include "layers/GridMap.hpp"
 #include "layers/HeatMap.hpp"
 #include "layers/TripAnimation.hpp"
@@ -20,22 +21,36 @@
 #include <QEventLoop>
 #include <QGraphicsSceneMouseEvent>
 #include <QProgressDialog>
+#include <QTimer>
 
 #include "CityMap.hpp"
 
 using namespace std;
 
+// previews of a selection being drawn or dragged refresh at about 30 Hz
+static const int PreviewInterval = 33;
+
+static bool isPreviewed(GeographicalViewWidget::State state)
+{
+  return state==GeographicalViewWidget::RECT_SELECTION || state==GeographicalViewWidget::FREE_SELECTION ||
+         state==GeographicalViewWidget::MOVE_SELECTION;
+}
+
 GeographicalViewWidget::GeographicalViewWidget(QWidget *parent) :
     QMapWidget(parent),
     currentState(GeographicalViewWidget::IDLE),
     basePosition(-1,-1),
-    selectedTrips(NULL),
+    snapshot(new ResultStore::Snapshot),
+    selectedTrips(&snapshot->trips),
     renderTrips(true),
+    hasSelectionPattern(false),
     selectionType(Selection::START),
     selectionMode(SINGLE),
     selectionTimeVisible(false),
     selectionTimeColor(Qt::blue),
-    queryDescriptionVisible(false)
+    queryDescriptionVisible(false),
+    nearestMode(false),
+    nearestCount(1000)
 {
     this->setCoordinator(Coordinator::instance());
   
@@ -45,21 +60,25 @@ GeographicalViewWidget::GeographicalViewWidget(QWidget *parent) :
     this->layerHeatMap = new HeatMap(this);
     this->mapView()->addRenderingLayer(this->layerHeatMap);
     this->connect(this, SIGNAL(datasetUpdated()), this->layerHeatMap, SLOT(updateData()));
+    this->connect(this, SIGNAL(previewUpdated()), this->layerHeatMap, SLOT(updateData()));
     
     this->layerLocation = new TripLocationLOD(this);
     this->mapView()->addRenderingLayer(this->layerLocation);
     this->connect(this, SIGNAL(datasetUpdated()), this->layerLocation, SLOT(updateData()));
+    this->connect(this, SIGNAL(previewUpdated()), this->layerLocation, SLOT(updateData()));
 
     this->layerNeighborhood = new NumTripsGridMap(this);
     this->mapView()->addRenderingLayer(this->layerNeighborhood);
     this->layerNeighborhood->loadGrid(QString(DATA_DIR)+"neighborhoods.txt");
     this->connect(this, SIGNAL(datasetUpdated()), this->layerNeighborhood, SLOT(updateData()));
+    this->connect(this, SIGNAL(previewUpdated()), this->layerNeighborhood, SLOT(updateData()));
 
     this->layerZipCode = new PickupDropoffGridMap(this);//FarePerMileGridMap(this);
     this->layerZipCode->setColorScale(ColorScaleFactory::getInstance(SEQUENTIAL_SINGLE_HUE_RED));
     this->mapView()->addRenderingLayer(this->layerZipCode);
     this->layerZipCode->loadGrid(QString(DATA_DIR)+"neighborhoods.txt"); //"zipcodes.txt"
     this->connect(this, SIGNAL(datasetUpdated()), this->layerZipCode, SLOT(updateData()));
+    this->connect(this, SIGNAL(previewUpdated()), this->layerZipCode, SLOT(updateData()));
 
     this->layerAnimation = new TripAnimation(this);
     this->mapView()->addRenderingLayer(this->layerAnimation);
@@ -67,6 +86,14 @@ GeographicalViewWidget::GeographicalViewWidget(QWidget *parent) :
     
     //
     this->colorbar = new ColorBar;
+
+    //
+    this->queryRunner = new QueryRunner(this);
+    this->connect(this->queryRunner, SIGNAL(finished()), this, SLOT(queryFinished()));
+    this->previewTimer = new QTimer(this);
+    this->previewTimer->setSingleShot(true);
+    this->previewTimer->setInterval(PreviewInterval);
+    this->connect(this->previewTimer, SIGNAL(timeout()), this, SLOT(previewSelectedData()));
 }
 
 GeographicalViewWidget::~GeographicalViewWidget()
@@ -78,10 +105,16 @@ GeographicalViewWidget::~GeographicalViewWidget()
     delete this->colorbar;
 }
 
-void GeographicalViewWidget::setSelectedTripsRepository(KdTrip::TripSet *v){
+void GeographicalViewWidget::setSelectedTripsRepository(const KdTrip::TripSet *v){
     selectedTrips = v;
 }
 
+void GeographicalViewWidget::showSnapshot(const ResultStore::SnapshotPtr &s){
+    previewSnapshot.reset();
+    snapshot = s;
+    selectedTrips = &snapshot->trips;
+}
+
 void GeographicalViewWidget::setSelectionGraph(SelectionGraph *g){
     selectionGraph = g;
 }
@@ -94,6 +127,7 @@ void GeographicalViewWidget::setSelectionTime(QDateTime startT, QDateTime endT)
 
 void GeographicalViewWidget::setSelectionTimes(const DateTimeList &list) {
   this->selectionTimes  = list;
+  this->hasSelectionPattern = false;
 
   QString title = QString("%1 to %2")
     .arg(this->getSelectedStartTime().toString("ddd MM/dd/yy hh:mm AP"))
@@ -110,6 +144,12 @@ void GeographicalViewWidget::setSelectionTimes(const DateTimeList &list) {
     viewWidget->setWindowTitle(title);
 }
 
+void GeographicalViewWidget::setSelectionPattern(const KdTrip::TimePattern &pattern, const DateTimeList &list) {
+  this->setSelectionTimes(list);
+  this->selectionPattern = pattern;
+  this->hasSelectionPattern = true;
+}
+
 DateTimeList GeographicalViewWidget::getSelectionTimes()
 {
   return this->selectionTimes;
@@ -159,11 +199,27 @@ void GeographicalViewWidget::updateData(){
     //qDebug() << "After repaint contents";
 }
 
-KdTrip::TripSet * GeographicalViewWidget::getSelectedTrips()
+const KdTrip::TripSet * GeographicalViewWidget::getSelectedTrips()
 {
+    if (this->previewSnapshot)
+        return &this->previewSnapshot->trips;
     return this->selectedTrips;
 }
 
+unsigned GeographicalViewWidget::getSampleStride()
+{
+    return this->previewSnapshot ? this->previewSnapshot->sampleStride : 1;
+}
+
+ResultStore::SnapshotPtr GeographicalViewWidget::getSnapshot()
+{
+    if (this->previewSnapshot)
+        return this->previewSnapshot;
+    if (this->selectedTrips==&this->snapshot->trips)
+        return this->snapshot;
+    return ResultStore::SnapshotPtr();
+}
+
 QDateTime GeographicalViewWidget::getSelectedStartTime()
 {
     if(this->selectionTimes.size() == 0)
@@ -226,6 +282,22 @@ void GeographicalViewWidget::setSelectionTimeColor(QColor color)
   this->selectionTimeColor = color;
 }
 
+bool GeographicalViewWidget::isNearestMode()
+{
+  return this->nearestMode;
+}
+
+void GeographicalViewWidget::setNearestMode(bool enabled)
+{
+  this->nearestMode = enabled;
+  this->setCursor(enabled ? Qt::CrossCursor : Qt::ArrowCursor);
+}
+
+void GeographicalViewWidget::setNearestCount(int k)
+{
+  this->nearestCount = k;
+}
+
 bool GeographicalViewWidget::isQueryDescriptionVisible()
 {
   return this->queryDescriptionVisible;
@@ -278,6 +350,8 @@ void GeographicalViewWidget::paintOverlay(QPainter *painter){
       this->renderSelectionTime(painter);
     if (this->queryDescriptionVisible)
       this->renderQueryDescription(painter);
+    if (this->previewSnapshot || this->queryRunner->isBusy())
+      this->renderQueryingState(painter);
 }
 
 void GeographicalViewWidget::renderSelectionTime(QPainter *painter)
@@ -343,6 +417,23 @@ void GeographicalViewWidget::renderQueryDescription(QPainter *painter)
   }
 }
 
+void GeographicalViewWidget::renderQueryingState(QPainter *painter)
+{
+  // a preview shows the number of trips it estimates, until the exact
+  // query runs
+  QString text = QString::fromUtf8("Querying\u2026");
+  if (this->previewSnapshot && !this->queryRunner->isBusy())
+    text = QString::fromUtf8("Preview: \u2248%1 trips")
+           .arg(this->previewSnapshot->trips.size()*this->previewSnapshot->sampleStride);
+  QFont font("Arial", 18);
+  QFontMetrics metrics(font);
+  painter->setFont(font);
+  painter->setPen(Qt::white);
+  painter->drawText(QRectF(11, 11, metrics.width(text)+1, metrics.height()), Qt::AlignLeft, text);
+  painter->setPen(Qt::black);
+  painter->drawText(QRectF(10, 10, metrics.width(text)+1, metrics.height()), Qt::AlignLeft, text);
+}
+
 void GeographicalViewWidget::drawArrow(QPainter *painter, QLineF line)
 {
     qreal arrowSize = 10;
@@ -599,6 +690,7 @@ void GeographicalViewWidget::mousePressEvent(QMouseEvent *event){
         if (sel==NULL) {
             QMapWidget::mousePressEvent(event);
             currentState = GeographicalViewWidget::PANNING;
+            clickPosition = event->pos();
         }
         else {
             this->tailNode = sel;
@@ -703,6 +795,10 @@ void GeographicalViewWidget::mouseMoveEvent(QMouseEvent *event){
     } else if(selectionMode==LINK && basePosition==QPoint(-1, -1))
         QMapWidget::mouseMoveEvent(event);
 
+    // the selection being drawn or dragged is previewed on a sample
+    if (isPreviewed(this->currentState) && !this->previewTimer->isActive())
+        this->previewTimer->start();
+
     //
     this->notifyCoordinatorViewChanged();
 
@@ -717,6 +813,7 @@ void GeographicalViewWidget::mouseMoveEvent(QMouseEvent *event){
 }
 
 void GeographicalViewWidget::mouseReleaseEvent(QMouseEvent *event){
+    this->previewTimer->stop();
     if (this->currentState == GeographicalViewWidget::POLYGON_SELECTION ) {
         return;
     }
@@ -729,8 +826,11 @@ void GeographicalViewWidget::mouseReleaseEvent(QMouseEvent *event){
         this->repaintContents();
         return;
     }
-    else if(currentState == PANNING)
+    else if(currentState == PANNING) {
         QMapWidget::mouseReleaseEvent(event);
+        if (nearestMode && (event->pos()-clickPosition).manhattanLength()<4)
+            queryNearestTrips(mapView()->mapToGeoLocation(event->localPos()));
+    }
     else if(currentState == RECT_SELECTION || currentState == FREE_SELECTION){
 
         QRectF bb = selectionPath.boundingRect();
@@ -776,6 +876,10 @@ void GeographicalViewWidget::mouseReleaseEvent(QMouseEvent *event){
     currentState = GeographicalViewWidget::IDLE;
     tailNode = NULL;
 
+    // a preview stays up until the exact result replaces it, if any
+    if (this->previewSnapshot && !this->queryRunner->isBusy())
+        this->dropPreview();
+
     this->repaintContents();
 }
 
@@ -862,16 +966,105 @@ void GeographicalViewWidget::pickSelection(SelectionGraphNode *& sel, QPointF p)
 
 void GeographicalViewWidget::querySelectedData()
 {
-  this->selectedTrips->clear();
-  KdTrip::TripSet result;
-  for (int i=0; i<this->selectionTimes.count(); i++) {
-    QDateTime start = this->selectionTimes.at(i).first;
-    QDateTime end = this->selectionTimes.at(i).second;
-    Global::getInstance()->queryData(this->selectionGraph, start, end, result);
-    this->selectedTrips->insert(result.begin(), result.end());
+  // The query runs off the GUI thread and replaces the one in flight; a
+  // recurring selection is one query instead of one per period
+  this->nearestDescription.clear();
+  this->queryRunner->start(this->selectionGraph, this->selectionTimes,
+                           this->hasSelectionPattern ? &this->selectionPattern : NULL);
+  this->repaintContents();
+}
+
+void GeographicalViewWidget::queryFinished()
+{
+  // The trips of the previous snapshot, and the shards they come from,
+  // are released when no other view shows them
+  ResultStore::SnapshotPtr result = this->queryRunner->takeResult();
+  if (!result)
+    return;
+  if (result->preview) {
+    // only the map layers show samples; one finished after the mouse was
+    // released is stale
+    if (isPreviewed(this->currentState)) {
+      this->previewSnapshot = result;
+      emit previewUpdated();
+      this->repaintContents();
+    }
+    return;
+  }
+  this->previewSnapshot.reset();
+  this->snapshot = result;
+  this->selectedTrips = &this->snapshot->trips;
+  if (this->nearestDescription.isEmpty())
+    this->setQueryDescription(QStringList());
+  else
+    this->setQueryDescription(QStringList() << this->nearestDescription.arg(this->selectedTrips->size()));
+  this->emitDatasetUpdated();
+  this->repaintContents();
+}
+
+void GeographicalViewWidget::previewSelectedData()
+{
+  if (this->currentState==GeographicalViewWidget::MOVE_SELECTION) {
+    this->queryRunner->preview(this->selectionGraph, this->selectionTimes,
+                               this->hasSelectionPattern ? &this->selectionPattern : NULL);
+    return;
   }
+  if (!isPreviewed(this->currentState))
+    return;
+  // the selection being drawn joins the graph just long enough to be planned
+  QRectF bb = this->selectionPath.boundingRect();
+  if (bb.width() * bb.height() <= 10)
+    return;
+  Selection selection(this->projectedSelectionPath);
+  selection.setType(this->selectionType);
+  SelectionGraphNode *node = this->selectionGraph->addNode(&selection);
+  node->setGroup(getAvailableGroup());
+  this->queryRunner->preview(this->selectionGraph, this->selectionTimes,
+                             this->hasSelectionPattern ? &this->selectionPattern : NULL);
+  this->selectionGraph->removeNode(node->getId());
+}
+
+void GeographicalViewWidget::dropPreview()
+{
+  // back to the trips of the last result
+  this->previewSnapshot.reset();
+  emit previewUpdated();
+}
+
+void GeographicalViewWidget::queryNearestTrips(QPointF location)
+{
+  // Replaces any selection query in flight, on the worker like them, and
+  // within the same times: every interval, or the recurring pattern
+  this->previewSnapshot.reset();
+  bool dropoff = this->selectionType==Selection::END;
+  this->nearestDescription = QString("%1 nearest ")
+                             + QString("%1 to (%2, %3)")
+                               .arg(dropoff ? "dropoffs" : "pickups")
+                               .arg(location.x(), 0, 'f', 5)
+                               .arg(location.y(), 0, 'f', 5);
+  this->queryRunner->nearest(location, dropoff, this->nearestCount, this->selectionTimes,
+                             this->hasSelectionPattern ? &this->selectionPattern : NULL);
+  this->repaintContents();
+}
+
+void GeographicalViewWidget::restoreState(const ResultHistory::State &state)
+{
+  // No query: the layers and plots update what they computed from the
+  // snapshot shown by the step between the two, when there is one
+  this->previewSnapshot.reset();
+  this->nearestDescription.clear();
+  if (state.graph)
+    this->selectionGraph->assign(state.graph.get());
+  if (state.hasPattern)
+    this->setSelectionPattern(state.pattern, state.times);
+  else
+    this->setSelectionTimes(state.times);
+  this->snapshot = state.snapshot;
+  this->selectedTrips = &this->snapshot->trips;
   this->setQueryDescription(QStringList());
+  emit selectionTimesRestored();
   this->emitDatasetUpdated();
+  this->repaintContents();
 }
 
 void GeographicalViewWidget::emitDatasetUpdated()
@@ -977,12 +1170,28 @@ void GeographicalViewWidget::keyPressEvent(QKeyEvent *event)
             this->doneEditingSelection();
         break;
     case Qt::Key_Left:
+        // with Alt, back through the history of this view (linked views
+        // get the key as well)
+        if (event->modifiers() & Qt::AltModifier) {
+            ResultHistory::State state;
+            if (this->queryRunner->back(state))
+                this->restoreState(state);
+            redirect = false;
+            break;
+        }
         //cout << "Step Back" << endl;
         emit stepBack();
         notifyCoordinatorStepBack();
         redirect = false;
         break;
     case Qt::Key_Right:
+        if (event->modifiers() & Qt::AltModifier) {
+            ResultHistory::State state;
+            if (this->queryRunner->forward(state))
+                this->restoreState(state);
+            redirect = false;
+            break;
+        }
         //cout << "Step Forward" << endl;
         emit stepForward();
         notifyCoordinatorStepForward();
@@ -992,6 +1201,9 @@ void GeographicalViewWidget::keyPressEvent(QKeyEvent *event)
         //cout << "Export Selection" << endl;
         notifyCoordinatorExportSelection();
         break;
+    case Qt::Key_K:
+        this->setNearestMode(!this->nearestMode);
+        break;
     case Qt::Key_Slash:
         this->showQueryDescription(!this->queryDescriptionVisible);
         break;
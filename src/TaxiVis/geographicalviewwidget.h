@@ -4,6 +4,7 @@
 #include "QMapWidget.hpp"
 #include "KdTrip.hpp"
 #include "RenderingLayer.hpp"
+#include "ResultStore.h"
 #include "SelectionGraph.h"
 #include "timewidget.h"
 #include <set>
@@ -19,6 +20,8 @@ class TripAnimation;
 class TripLocation;
 class ColorBar;
 class Coordinator;
+class QueryRunner;
+class QTimer;
 
 class GeographicalViewWidget : public QMapWidget
 {
@@ -40,11 +43,21 @@ private:
     QPolygonF                  basePolygon;
     QPointF                    projectedBasePosition;
     QVector<QGraphicsItem*>    editingAnchors;
-    KdTrip::TripSet           *selectedTrips;
+    // the trips shown: those of the snapshot of the last result, shared
+    // with the views showing the same query
+    ResultStore::SnapshotPtr   snapshot;
+    const KdTrip::TripSet     *selectedTrips;
+    // sample shown by the map layers while a selection is drawn or dragged,
+    // refreshed at most every PreviewInterval; the plots keep the result
+    ResultStore::SnapshotPtr   previewSnapshot;
+    QTimer                    *previewTimer;
     SelectionGraph*            selectionGraph;
     bool                       renderTrips;
 
     DateTimeList               selectionTimes;
+    // recurring selection the times came from, queried in one pass
+    KdTrip::TimePattern        selectionPattern;
+    bool                       hasSelectionPattern;
 
     Selection::TYPE            selectionType; // START, END or START_END
     SelectionMode              selectionMode;
@@ -61,12 +74,31 @@ private:
 
     bool                       queryDescriptionVisible;
     QStringList                queryDescription;
+
+    // nearest-trip mode: a click (without dragging) on the map selects the
+    // nearestCount trips picked up (dropped off for END selections) closest
+    // to it, within the selected times (or pattern)
+    bool                       nearestMode;
+    int                        nearestCount;
+    // description of the nearest search in flight, "%1" standing for the
+    // trips found; empty while a selection query is
+    QString                    nearestDescription;
+    QPoint                     clickPosition;
+
+    // selection queries run on a worker thread; selectedTrips keeps the
+    // previous result until the new one is delivered, and then points at
+    // its snapshot
+    QueryRunner               *queryRunner;
   
     //
     ColorBar                  *colorbar;
 
     //
     void         querySelectedData();
+    void         dropPreview();
+    void         queryNearestTrips(QPointF location);
+    // Shows the selections, times and result of a state of the history
+    void         restoreState(const ResultHistory::State &state);
     void         renderSelections(QPainter *painter);
     Group        getAvailableGroup();
     QPainterPath convertToScreen(QPainterPath& path);
@@ -85,15 +117,22 @@ private:
     void         updateEditingSelection();
     void         renderSelectionTime(QPainter *painter);
     void         renderQueryDescription(QPainter *painter);
+    void         renderQueryingState(QPainter *painter);
 
 private slots:
     void         updateEditingAnchors();
+    void         queryFinished();
+    void         previewSelectedData();
 
 public:
     explicit GeographicalViewWidget(QWidget *parent = 0);
     ~GeographicalViewWidget();
 
-    void setSelectedTripsRepository(KdTrip::TripSet *);
+    // Shows trips filled elsewhere, until the next query result
+    void setSelectedTripsRepository(const KdTrip::TripSet *);
+    // Shows a snapshot made outside of the queries (a filtered copy of the
+    // result, say), until the next query result
+    void showSnapshot(const ResultStore::SnapshotPtr &snapshot);
     void setSelectionGraph(SelectionGraph*);
     void setSelectionTime(QDateTime startT, QDateTime endT);
     void setSelectionType(Selection::TYPE type);
@@ -102,7 +141,12 @@ public:
     bool mergeSelections();
     bool unmergeSelections();
 
-    KdTrip::TripSet * getSelectedTrips();
+    // The trips shown on the map: a preview sample while one is up
+    const KdTrip::TripSet * getSelectedTrips();
+    // Trips each of those stands for: more than 1 for a preview sample
+    unsigned  getSampleStride();
+    // The snapshot they belong to, or NULL when they were filled elsewhere
+    ResultStore::SnapshotPtr getSnapshot();
     QDateTime getSelectedStartTime();
     QDateTime getSelectedEndTime();
     void      setAnimationEnabled(bool b);
@@ -114,6 +158,7 @@ public:
     void updateSelectionGraph(SelectionGraph*);
 
     void setSelectionTimes(const DateTimeList &list);
+    void setSelectionPattern(const KdTrip::TimePattern &pattern, const DateTimeList &list);
     DateTimeList getSelectionTimes();
     uint getSelectionDuration();
     void emitDatasetUpdated();
@@ -122,6 +167,10 @@ public:
     void showSelectionTime(bool show);
     void setSelectionTimeColor(QColor color);
 
+    bool isNearestMode();
+    void setNearestMode(bool enabled);
+    void setNearestCount(int k);
+
     bool isQueryDescriptionVisible();
     void showQueryDescription(bool show);
     void setQueryDescriptionColor(QColor color);
@@ -132,8 +181,12 @@ public:
 signals:
     void mapSelectionChanged();
     void datasetUpdated();
+    // a preview sample replaced the trips shown on the map
+    void previewUpdated();
     void stepBack();
     void stepForward();
+    // the times were set back to those of a state of the history
+    void selectionTimesRestored();
 protected:
     void loadFinished();
     void initGL();
@@ -79,8 +79,47 @@ Global *Global::getInstance(){
     return instance;
 }
 
-void Global::queryData(SelectionGraph* queryGraph, QDateTime startTime, QDateTime endTime, KdTrip::TripSet &resultSet){
-    queryManger.queryData(queryGraph,startTime,endTime,resultSet);
+void Global::queryData(SelectionGraph* queryGraph, QDateTime startTime, QDateTime endTime, TripResult &result, bool append){
+    queryManger.queryData(queryGraph,startTime,endTime,result,append);
+}
+
+void Global::queryData(SelectionGraph* queryGraph, const KdTrip::TimePattern &pattern, TripResult &result, bool append){
+    queryManger.queryData(queryGraph,pattern,result,append);
+}
+
+void Global::queryNearest(QPointF location, bool dropoff, int k, const KdTrip::Query &timeQuery, TripResult &result){
+    queryManger.queryNearest(location,dropoff,k,timeQuery,result);
+}
+
+void Global::queryData(const QueryPlan &plan, const KdTrip::Query &timeQuery, TripResult &result, bool append){
+    queryManger.queryData(plan,timeQuery,result,append);
+}
+
+void Global::querySample(const QueryPlan &plan, const KdTrip::Query &timeQuery, unsigned sampleStride,
+                         TripResult &result){
+    queryManger.querySample(plan,timeQuery,sampleStride,result);
+}
+
+void Global::queryChanges(const QueryPlan &plan, const std::vector<QueryPlan::Probe> &probes, const KdTrip::Query &timeQuery,
+                          TripResult &added, TripResult &removed){
+    queryManger.queryChanges(plan,probes,timeQuery,added,removed);
+}
+
+void Global::queryTimeChanges(const QueryPlan &plan, const KdTrip::Query &previous, const TripResult &previousSet,
+                              const KdTrip::Query &timeQuery, TripResult &added, TripResult &removed){
+    queryManger.queryTimeChanges(plan,previous,previousSet,timeQuery,added,removed);
+}
+
+void Global::applyChanges(const TripResult &added, const TripResult &removed, TripResult &result){
+    queryManger.applyChanges(added,removed,result);
+}
+
+int Global::numDatasets(){
+    return queryManger.numDatasets();
+}
+
+QString Global::datasetTag(int index){
+    return queryManger.datasetTag(index);
 }
 
 CityMap * Global::getMap() {
@@ -39,7 +39,18 @@ public:
     ColorScale*      getColorScale();
     NeighborhoodSet* getNeighSet();
 
-    void queryData(SelectionGraph* queryGraph, QDateTime startTime, QDateTime endTime, KdTrip::TripSet &);
+    void queryData(SelectionGraph* queryGraph, QDateTime startTime, QDateTime endTime, TripResult &, bool append=false);
+    void queryData(SelectionGraph* queryGraph, const KdTrip::TimePattern &pattern, TripResult &, bool append=false);
+    void queryNearest(QPointF location, bool dropoff, int k, const KdTrip::Query &timeQuery, TripResult &);
+    void queryData(const QueryPlan &plan, const KdTrip::Query &timeQuery, TripResult &, bool append=false);
+    void querySample(const QueryPlan &plan, const KdTrip::Query &timeQuery, unsigned sampleStride, TripResult &);
+    void queryChanges(const QueryPlan &plan, const std::vector<QueryPlan::Probe> &probes, const KdTrip::Query &timeQuery,
+                      TripResult &added, TripResult &removed);
+    void queryTimeChanges(const QueryPlan &plan, const KdTrip::Query &previous, const TripResult &previousSet,
+                          const KdTrip::Query &timeQuery, TripResult &added, TripResult &removed);
+    void applyChanges(const TripResult &added, const TripResult &removed, TripResult &);
+    int     numDatasets();
+    QString datasetTag(int);
 
     //
     int        numExtraFields();
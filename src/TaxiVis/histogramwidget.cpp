@@ -12,7 +12,9 @@ using namespace std;
 HistogramWidget::HistogramWidget(QWidget *parent) :
     QWidget(parent),
     ui(new Ui::HistogramWidget),
-    _plotAttribute(HistogramWidget::FARE_AMOUNT)
+    _plotAttribute(HistogramWidget::FARE_AMOUNT),
+    binnedBins(0),
+    binnedGlobal(false)
 {
     coordinator = Coordinator::instance();
     ui->setupUi(this);
@@ -49,8 +51,13 @@ HistogramWidget::~HistogramWidget()
     delete ui;
 }
 
-void HistogramWidget::setSelectedTripsRepository(KdTrip::TripSet *v){
+void HistogramWidget::setSelectedTripsRepository(const KdTrip::TripSet *v){
     selectedTrips = v;
+    snapshot.reset();
+}
+
+void HistogramWidget::setSnapshot(const ResultStore::SnapshotPtr &s){
+    snapshot = s;
 }
 
 void HistogramWidget::setSelectionGraph(SelectionGraph *v){
@@ -64,7 +71,7 @@ void HistogramWidget::computeDataBounds(){
         histogramDataBounds[HistogramWidget::PlotAttribute(i)] = make_pair(numeric_limits<float>::max(),numeric_limits<float>::min());
 
     //
-    KdTrip::TripSet::iterator it;
+    KdTrip::TripSet::const_iterator it;
     for(it = selectedTrips->begin() ; it != selectedTrips->end() ; ++it){
         const KdTrip::Trip *trip = *it;
 
@@ -79,6 +86,9 @@ void HistogramWidget::computeDataBounds(){
         }
     }
 
+    //the bounds of the data, before widening those of a single value
+    dataBounds = histogramDataBounds;
+
     //
     map<PlotAttribute, std::pair<float,float> >::iterator bit = histogramDataBounds.begin();
     for(; bit != histogramDataBounds.end() ; ++bit){
@@ -227,36 +237,6 @@ void HistogramWidget::computeHistograms() {
     if(selectionGraph == NULL)
         return;
 
-    //
-    groupHistograms.clear();
-    histogramDataBounds.clear();
-
-    //compute bounds
-    computeDataBounds();
-
-    // compute bins
-    std::map<PlotAttribute, std::vector<HistBin> > templateHistograms;
-    map<PlotAttribute, std::pair<float,float> >::iterator boundsIterator;
-    for(boundsIterator = histogramDataBounds.begin();boundsIterator != histogramDataBounds.end() ; ++boundsIterator){
-        PlotAttribute attribute = boundsIterator->first;
-        pair<float,float> bounds = boundsIterator->second;
-        float binSize = (bounds.second - bounds.first)/numberOfBins;
-
-        vector<HistBin>plot;
-
-        for(int i = 0 ; i < numberOfBins ; ++i){
-            float minBin = bounds.first + i*binSize;
-            float maxBin = minBin + binSize;
-            HistBin bin;
-            bin.minBin = minBin;
-            bin.maxBin = maxBin;
-            bin.maxBin = 0.0f;
-
-            plot.push_back(bin);
-        }
-
-        templateHistograms[attribute] = plot;
-    }
     //initialize histograms
     bool buildGlobalPlot = (selectionGraph->isEmpty());
     set<Group> groups;
@@ -270,7 +250,8 @@ void HistogramWidget::computeHistograms() {
     map<Group,vector<SelectionGraphNode*> > tempMapGroupToNodes;
 
     if(buildGlobalPlot){
-        groupHistograms[Group(Qt::black)] = templateHistograms;
+        groups.clear();
+        groups.insert(Group(Qt::black));
     }
     else{
         //
@@ -297,6 +278,55 @@ void HistogramWidget::computeHistograms() {
         groups = notEmptyGroups;
         mapGroupToNodes.clear();
         mapGroupToNodes = tempMapGroupToNodes;
+    }
+
+    //a time window stepped from the snapshot binned last keeps the bins
+    //when the trips that came in are within the bounds of the data, and
+    //none of those that left was at one of them: the bounds stay the same.
+    //Going back in the history to the snapshot it was stepped from undoes
+    //the step the same way
+    ResultStore::SnapshotPtr current = snapshot.lock();
+    const TripResult *added = NULL, *removed = NULL;
+    bool stepped = current && &current->trips==selectedTrips && current->changesFrom(binned, added, removed) &&
+                   numberOfBins==binnedBins && binnedGlobal==buildGlobalPlot &&
+                   groupHistograms.size()==groups.size() &&
+                   keepsDataBounds(added->trips, false) && keepsDataBounds(removed->trips, true);
+    for(groupIterator = groups.begin() ; stepped && groupIterator != groups.end() ; ++groupIterator)
+        stepped = groupHistograms.count(*groupIterator) > 0;
+    binned = current;
+    binnedBins = numberOfBins;
+    binnedGlobal = buildGlobalPlot;
+
+    if(!stepped){
+        groupHistograms.clear();
+        histogramDataBounds.clear();
+
+        //compute bounds
+        computeDataBounds();
+
+        // compute bins
+        std::map<PlotAttribute, std::vector<HistBin> > templateHistograms;
+        map<PlotAttribute, std::pair<float,float> >::iterator boundsIterator;
+        for(boundsIterator = histogramDataBounds.begin();boundsIterator != histogramDataBounds.end() ; ++boundsIterator){
+            PlotAttribute attribute = boundsIterator->first;
+            pair<float,float> bounds = boundsIterator->second;
+            float binSize = (bounds.second - bounds.first)/numberOfBins;
+
+            vector<HistBin>plot;
+
+            for(int i = 0 ; i < numberOfBins ; ++i){
+                float minBin = bounds.first + i*binSize;
+                float maxBin = minBin + binSize;
+                HistBin bin;
+                bin.minBin = minBin;
+                bin.maxBin = maxBin;
+                bin.maxBin = 0.0f;
+
+                plot.push_back(bin);
+            }
+
+            templateHistograms[attribute] = plot;
+        }
 
         //
         for(groupIterator = groups.begin() ; groupIterator != groups.end() ; ++groupIterator){
@@ -304,82 +334,91 @@ void HistogramWidget::computeHistograms() {
         }
     }
 
-    //
-    KdTrip::TripSet::iterator it;
+    //the groups the query tagged the trips with are read from their masks,
+    //the others tested against the selections
+    const TripGroups *selectedGroups = current && &current->trips==selectedTrips ? current->tripGroups() : NULL;
+    map<Group,int> groupBits;
+    if(!buildGlobalPlot)
+        groupBits = TripGroups::bitsFor(selectedGroups, selectionGraph, groups);
+
+    //adds count to the bins of every trip of trips
+    auto binTrips = [&](const KdTrip::TripSet &trips, const TripGroups *tripGroups, float count) {
+        KdTrip::TripSet::const_iterator it;
+        for(it = trips.begin() ; it != trips.end() ; ++it){
+            const KdTrip::Trip *trip = *it;
+
+            // only use valid trips
+            if(trip->dropoff_time < trip->pickup_time)
+                continue;
+
+            uint64_t groupMask = 0;
+            bool tagged = !buildGlobalPlot && tripGroups && tripGroups->maskOf(trip, groupMask);
+            for(groupIterator = groups.begin() ; groupIterator != groups.end() ; ++groupIterator){
+                Group currentGroup = *groupIterator;
 
-    for(it = selectedTrips->begin() ; it != selectedTrips->end() ; ++it){
-        const KdTrip::Trip *trip = *it;
+                if(!buildGlobalPlot){
+                    assert(mapGroupToNodes.count(currentGroup) > 0 && mapGroupToEdges.count(currentGroup) > 0);
 
-        // only use valid trips
-        if(trip->dropoff_time < trip->pickup_time)
-            continue;
-
-        if(buildGlobalPlot){
-            map<PlotAttribute, vector<HistBin> > &groupHists  = groupHistograms[Group(Qt::black)];
-            map<PlotAttribute, vector<HistBin> >::iterator attIterator;
-            for(attIterator = groupHists.begin() ; attIterator != groupHists.end() ; ++attIterator){
-                PlotAttribute    currentAttb = attIterator->first;
-                vector<HistBin> &currentHist = attIterator->second;
-
-                pair<float,float> attribBounds = histogramDataBounds[currentAttb];
-                float binSize = (attribBounds.second - attribBounds.first)/numberOfBins;
-                if (binSize<1e-6) continue;
-
-                float tripAttribValue = getTripValue(trip,currentAttb);
-
-                int binIndex = (tripAttribValue - attribBounds.first)/binSize;
-                if(binIndex == numberOfBins)
-                    --binIndex;
-
-                if(currentHist.size() <= binIndex){
-                    cout << "Trip.fareamount " << trip->fare_amount << endl;
-                    cout << "Trip Attrib Value " << tripAttribValue << " attribBounds.first " << attribBounds.first << endl;
-                    cout << "attribBounds.first " << attribBounds.first << " attribBounds.second " << attribBounds.second << endl;
-                    cout << "Current Hist Size " << currentHist.size() << " binIndex " << binIndex << endl;
-                    exit(1);
+                    int bit = groupBits[currentGroup];
+                    bool inGroup = (tagged && bit >= 0) ? ((groupMask >> bit) & 1) != 0 :
+                                   tripSatisfiesConstraints(trip, mapGroupToNodes[currentGroup],mapGroupToEdges[currentGroup]);
+                    if(!inGroup)
+                        continue;
                 }
-                HistBin& bin = currentHist[binIndex];
-                bin.freq += 1;
-            }
-        }
-        else{
-            for(groupIterator = groups.begin() ; groupIterator != groups.end() ; ++groupIterator){
-                Group currentGroup = *groupIterator;
 
-                assert(mapGroupToNodes.count(currentGroup) > 0 && mapGroupToEdges.count(currentGroup) > 0);
-
-                if(tripSatisfiesConstraints(trip, mapGroupToNodes[currentGroup],mapGroupToEdges[currentGroup])){
-                    //update group hist
-                    map<PlotAttribute, vector<HistBin> > &groupHists  = groupHistograms[currentGroup];
-                    map<PlotAttribute, vector<HistBin> >::iterator attIterator;
-                    for(attIterator = groupHists.begin() ; attIterator != groupHists.end() ; ++attIterator){
-                        PlotAttribute    currentAttb = attIterator->first;
-                        vector<HistBin> &currentHist = attIterator->second;
-
-                        pair<float,float> attribBounds = histogramDataBounds[currentAttb];
-                        float binSize = (attribBounds.second - attribBounds.first)/numberOfBins;
-                        if (binSize<1e-6) continue;
-                        float tripAttribValue = getTripValue(trip,currentAttb);
-
-                        int binIndex = (tripAttribValue - attribBounds.first)/binSize;
-                        if(binIndex == numberOfBins)
-                            --binIndex;
-
-                        if(!(0 <= binIndex && binIndex < currentHist.size())){
-                            cout << "Bin index " << binIndex << " histSize " << currentHist.size() << " numberOfBins " << numberOfBins << " tripValue " << tripAttribValue << " attribBounds.first " << attribBounds.first << endl;
-                            cout << "    intended bin " << (tripAttribValue - attribBounds.first)/binSize << endl;
-                            assert(0 <= binIndex && binIndex < currentHist.size());
-                        }
-
-                        HistBin& bin = currentHist[binIndex];
-                        bin.freq += 1;
+                //update group hist
+                map<PlotAttribute, vector<HistBin> > &groupHists  = groupHistograms[currentGroup];
+                map<PlotAttribute, vector<HistBin> >::iterator attIterator;
+                for(attIterator = groupHists.begin() ; attIterator != groupHists.end() ; ++attIterator){
+                    PlotAttribute    currentAttb = attIterator->first;
+                    vector<HistBin> &currentHist = attIterator->second;
+
+                    pair<float,float> attribBounds = histogramDataBounds[currentAttb];
+                    float binSize = (attribBounds.second - attribBounds.first)/numberOfBins;
+                    if (binSize<1e-6) continue;
+                    float tripAttribValue = getTripValue(trip,currentAttb);
+
+                    int binIndex = (tripAttribValue - attribBounds.first)/binSize;
+                    if(binIndex == numberOfBins)
+                        --binIndex;
+
+                    if(!(0 <= binIndex && binIndex < currentHist.size())){
+                        cout << "Bin index " << binIndex << " histSize " << currentHist.size() << " numberOfBins " << numberOfBins << " tripValue " << tripAttribValue << " attribBounds.first " << attribBounds.first << endl;
+                        cout << "    intended bin " << (tripAttribValue - attribBounds.first)/binSize << endl;
+                        assert(0 <= binIndex && binIndex < currentHist.size());
                     }
 
-
+                    HistBin& bin = currentHist[binIndex];
+                    bin.freq += count;
                 }
             }
         }
+    };
+
+    if(stepped){
+        binTrips(removed->trips, removed->tripGroups(), -1);
+        binTrips(added->trips, added->tripGroups(), 1);
+    }
+    else
+        binTrips(*selectedTrips, selectedGroups, 1);
+}
+
+bool HistogramWidget::keepsDataBounds(const KdTrip::TripSet &trips, bool inside){
+    KdTrip::TripSet::const_iterator it;
+    for(it = trips.begin() ; it != trips.end() ; ++it){
+        const KdTrip::Trip *trip = *it;
+        if(trip->dropoff_time < trip->pickup_time)
+            continue;
+        for(int i = int(HistogramWidget::FARE_AMOUNT) ; i != int(HistogramWidget::FIELD4) ; i++){
+            pair<float,float> &bounds = dataBounds[(HistogramWidget::PlotAttribute)i];
+            float tripAttValue = getTripValue(trip,(HistogramWidget::PlotAttribute)i);
+            bool within = inside ? (bounds.first < tripAttValue && tripAttValue < bounds.second) :
+                                   (bounds.first <= tripAttValue && tripAttValue <= bounds.second);
+            if(!within)
+                return false;
+        }
     }
+    return true;
 }
 
 void HistogramWidget::updatePlots(){
@@ -6,6 +6,7 @@
 //
 #include "qcustomplot.h"
 #include "KdTrip.hpp"
+#include "ResultStore.h"
 #include "SelectionGraph.h"
 
 namespace Ui {
@@ -35,7 +36,11 @@ public:
     explicit HistogramWidget(QWidget *parent = 0);
     ~HistogramWidget();
 
-    void setSelectedTripsRepository(KdTrip::TripSet *);
+    void setSelectedTripsRepository(const KdTrip::TripSet *);
+    // The snapshot the trips are those of, if any: its group masks spare
+    // testing the trips against the selections, and one the time window
+    // stepped to from the one binned last only bins the trips that changed
+    void setSnapshot(const ResultStore::SnapshotPtr &);
     void setSelectionGraph(SelectionGraph*);
     void setPlotAttribute(HistogramWidget::PlotAttribute pAttrib);
     void setNumberOfBinsOfUi(int numBins);
@@ -52,7 +57,7 @@ private:
     Ui::HistogramWidget *ui;
 
     //
-    KdTrip::TripSet *selectedTrips;
+    const KdTrip::TripSet *selectedTrips;
     SelectionGraph  *selectionGraph;
 
     //
@@ -61,17 +66,27 @@ private:
     //
     std::map<Group, std::map<PlotAttribute, std::vector<HistBin> > > groupHistograms;
     std::map<PlotAttribute, std::pair<float,float> >       histogramDataBounds;
+    std::map<PlotAttribute, std::pair<float,float> >       dataBounds;
     PlotAttribute                                          _plotAttribute;
     int                                                    numberOfBins;
     float                                                  _yMin;
     float                                                  _yMax;
 
+    //
+    boost::weak_ptr<ResultStore::Snapshot>                 snapshot;
+    boost::weak_ptr<ResultStore::Snapshot>                 binned;
+    int                                                    binnedBins;
+    bool                                                   binnedGlobal;
+
     //
     std::map<Group,QCPBars*> groupPlots;
 
     //
     void computeDataBounds();
     void computeHistograms();
+    // True when none of trips is out of (or, inside, at) the bounds of the
+    // data
+    bool keepsDataBounds(const KdTrip::TripSet &trips, bool inside);
     bool tripSatisfiesEdge(const KdTrip::Trip *trip, SelectionGraphEdge* edge);
     bool tripSatisfiesConstraints(const KdTrip::Trip *trip,
                                   std::vector<SelectionGraphNode*> groupNodeConstraints,
@@ -71,6 +71,7 @@ struct Grid {
 
 GridMap::GridMap(GeographicalViewWidget *gw) :
     RenderingLayer(false),
+    binnedType(Selection::START),
     dataReady(false),
     bufferDirty(false),
     visualDirty(false),
@@ -96,6 +97,7 @@ GridMap::~GridMap()
 void GridMap::loadGrid(QString gridFile)
 {
   this->grid->loadFromFile(gridFile);
+  this->binned.reset();
   this->buildCells();
   if (this->visualDirty)
     this->computeVisualData();
@@ -164,60 +166,63 @@ void GridMap::updateData()
     this->computeVisualData();
 }
 
+int GridMap::cellOf(const KdTrip::Trip *trip, bool usePickup, bool useDropoff)
+{
+  for (int i=0; i<this->grid->size(); i++) {
+    bool ok = true;
+    if (usePickup)
+      ok = ok && this->grid->cells[i].contains(QPointF(trip->pickup_lat, trip->pickup_long));
+    if (useDropoff)
+      ok = ok && this->grid->cells[i].contains(QPointF(trip->dropoff_lat, trip->dropoff_long));
+    if (ok)
+      return i;
+  }
+  return -1;
+}
+
 void GridMap::computeVisualData()
 {
   this->cellValueRange = QVector2D();
-  this->aggregateBegin();
-  for (int i=0; i<this->grid->size(); i++)
-    this->grid->cells[i].trips.clear();
-  KdTrip::TripSet::iterator it;
-  KdTrip::TripSet *selectedTrips = this->geoWidget->getSelectedTrips();
+  KdTrip::TripSet::const_iterator it;
   Selection::TYPE stype = this->geoWidget->getSelectionType();
   bool usePickup = stype==Selection::START || stype==Selection::START_AND_END;
   bool useDropoff = stype==Selection::END || stype==Selection::START_AND_END;
-  for (it=selectedTrips->begin(); it!=selectedTrips->end(); it++) {
-    const KdTrip::Trip *trip = *it;
-    for (int i=0; i<this->grid->size(); i++) {
-      bool ok = true;
-      if (usePickup)
-        ok = ok && this->grid->cells[i].contains(QPointF(trip->pickup_lat, trip->pickup_long));
-      if (useDropoff)
-        ok = ok && this->grid->cells[i].contains(QPointF(trip->dropoff_lat, trip->dropoff_long));
-      if (ok) {
-        this->aggregateUpdate(this->grid->cells[i].id, trip);
+  // a time window stepped from the snapshot the cells were filled from (or
+  // back to it, through the history) only looks up the cells of the trips
+  // that came and went
+  ResultStore::SnapshotPtr snapshot = this->geoWidget->getSnapshot();
+  const TripResult *added, *removed;
+  if (snapshot && snapshot->changesFrom(this->binned, added, removed) && stype==this->binnedType) {
+    for (it=removed->trips.begin(); it!=removed->trips.end(); it++) {
+      int i = this->cellOf(*it, usePickup, useDropoff);
+      if (i>=0)
+        this->grid->cells[i].trips.erase(*it);
+    }
+    for (it=added->trips.begin(); it!=added->trips.end(); it++) {
+      int i = this->cellOf(*it, usePickup, useDropoff);
+      if (i>=0)
+        this->grid->cells[i].trips.insert(*it);
+    }
+  }
+  else {
+    for (int i=0; i<this->grid->size(); i++)
+      this->grid->cells[i].trips.clear();
+    const KdTrip::TripSet *selectedTrips = this->geoWidget->getSelectedTrips();
+    for (it=selectedTrips->begin(); it!=selectedTrips->end(); it++) {
+      const KdTrip::Trip *trip = *it;
+      int i = this->cellOf(trip, usePickup, useDropoff);
+      if (i>=0)
         this->grid->cells[i].trips.insert(trip);
-        break;
-      }
     }
+  }
+  this->binned = snapshot;
+  this->binnedType = stype;
 
-    // int srcId = -1, dstId = -1;
-    // for (int i=0; srcId==-1 && i<this->grid->size(); i++)
-    //   if (this->grid->cells[i].contains(QPointF(trip->pickup_lat, trip->pickup_long)))
-    //     srcId = i;
-    // for (int i=0; dstId==-1 && i<this->grid->size(); i++)
-    //   if (this->grid->cells[i].contains(QPointF(trip->dropoff_lat, trip->dropoff_long)))
-    //     dstId = i;
-    // if (srcId!=-1 && dstId!=-1) {
-    //   fprintf(stdout, "%u,%u,%g,%g,%g,%g,%u,%u,%u,%u,%u,%u,%u,%u,%u,%d,%d\n",
-    //           trip->pickup_time,
-    //           trip->dropoff_time,
-    //           trip->pickup_long,
-    //           trip->pickup_lat,
-    //           trip->dropoff_long,
-    //           trip->dropoff_lat,
-    //           trip->id_taxi,
-    //           trip->distance,     // in 0.01 miles unit
-    //           trip->fare_amount,  // in cents
-    //           trip->surcharge,    // in cents
-    //           trip->mta_tax,      // in cents
-    //           trip->tip_amount,   // in cents
-    //           trip->tolls_amount, // in cents
-    //           trip->payment_type,
-    //           trip->passengers,
-    //           srcId,
-    //           dstId
-    //           );
-    // }
+  this->aggregateBegin();
+  for (int i=0; i<this->grid->size(); i++) {
+    GridCell &cell = this->grid->cells[i];
+    for (it=cell.trips.begin(); it!=cell.trips.end(); it++)
+      this->aggregateUpdate(cell.id, *it);
   }
   this->aggregateEnd();
   for (int i=0; i<this->grid->size(); i++)
@@ -484,7 +489,7 @@ void GridMap::doneUpdating()
 }
 
 NumTripsGridMap::NumTripsGridMap(GeographicalViewWidget *gw)
-    : GridMap(gw)
+    : GridMap(gw), weight(1)
 {
 }
 
@@ -492,11 +497,13 @@ void NumTripsGridMap::aggregateBegin()
 {
   this->counts.clear();
   this->counts.resize(this->grid->size(), 0);
+  // a preview sample is scaled up to estimate the counts
+  this->weight = this->geoWidget->getSampleStride();
 }
 
 void NumTripsGridMap::aggregateUpdate(int id, const KdTrip::Trip *)
 {
-  this->counts[id]++;
+  this->counts[id] += this->weight;
 }
 
 void NumTripsGridMap::aggregateEnd()
@@ -513,7 +520,10 @@ void NumTripsGridMap::aggregateEnd()
 void NumTripsGridMap::aggregateOutput(GridCell &cell)
 {
   cell.value = (float)this->counts[cell.id];
-  cell.label = QString("%1 (%2)").arg(cell.name).arg(this->counts[cell.id]);
+  if (this->weight>1)
+    cell.label = QString::fromUtf8("%1 (\u2248%2)").arg(cell.name).arg(this->counts[cell.id]);
+  else
+    cell.label = QString("%1 (%2)").arg(cell.name).arg(this->counts[cell.id]);
 }
 
 FarePerMileGridMap::FarePerMileGridMap(GeographicalViewWidget *gw)
@@ -2,6 +2,7 @@
 #define GRID_MAP_HPP
 #include "RenderingLayer.hpp"
 #include "KdTrip.hpp"
+#include "ResultStore.h"
 #include <set>
 #include <vector>
 #include <QList>
@@ -51,6 +52,7 @@ protected:
   void renderGL();
   void renderLabel(QPainter *painter);
   void computeVisualData();
+  int  cellOf(const KdTrip::Trip *trip, bool usePickup, bool useDropoff);
   void updateCellVisualGeometry(GridCell *cell);
 
   virtual void renderPicking();
@@ -63,6 +65,10 @@ protected:
 
   Grid                   *grid;
   QVector2D               cellValueRange;
+  // the snapshot the cells were filled from, and how: one the time window
+  // stepped to from it only moves the trips that came and went
+  boost::weak_ptr<ResultStore::Snapshot> binned;
+  Selection::TYPE         binnedType;
 
   bool                    dataReady;
   bool                    bufferDirty;
@@ -126,6 +132,7 @@ public:
 
 protected:
   std::vector<int> counts;
+  unsigned         weight;  // trips each selected trip stands for
 
   void aggregateBegin();
   void aggregateUpdate(int, const KdTrip::Trip *);
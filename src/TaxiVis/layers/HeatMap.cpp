@@ -6,6 +6,7 @@
 #include "util/colorbar.h"
 #include "util/heatedobjectscale.h"
 #include <QVector2D>
+#include <algorithm>
 
 // Qt's OpenGL headers undef GLEW macros, so we need to redefine them
 #ifndef glBindBuffer
@@ -15,6 +16,7 @@
 HeatMap::HeatMap(GeographicalViewWidget *gw) :
     RenderingLayer(false),
     resolution(2048, 2048),
+    binnedType(Selection::START),
     initialized(false),
     normalized(false),
     dataReady(false),
@@ -182,22 +184,12 @@ inline int coordIndex(float lat, float lon, int width, int height, const QRectF
   return lonBin*width + latBin;
 }
 
-void HeatMap::computeVisualData()
+void HeatMap::countTrips(const KdTrip::TripSet &trips, int count, bool usePickup, bool useDropoff)
 {
-  if (!this->initialized)
-    return;
   int width = this->fbo->size().width();
   int height = this->fbo->size().height();
-  this->binCounts.clear();
-  this->binCounts.resize(width*height, 0);
-  this->maxBinCount = 0;
-  
-  KdTrip::TripSet::iterator it;
-  KdTrip::TripSet *selectedTrips = this->geoWidget->getSelectedTrips();
-  Selection::TYPE stype = this->geoWidget->getSelectionType();
-  bool usePickup = stype==Selection::START || stype==Selection::START_AND_END;
-  bool useDropoff = stype==Selection::END || stype==Selection::START_AND_END;
-  for (it=selectedTrips->begin(); it!=selectedTrips->end(); it++) {
+  KdTrip::TripSet::const_iterator it;
+  for (it=trips.begin(); it!=trips.end(); it++) {
     const KdTrip::Trip *trip = *it;
     int index[2] = {-1, -1};
     if (usePickup)
@@ -206,11 +198,40 @@ void HeatMap::computeVisualData()
       index[1] = coordIndex(trip->dropoff_lat, trip->dropoff_long, width, height, this->region);
     for (int k=0; k<2; k++)
       if (index[k]>=0) {
-        this->binCounts[index[k]]++;
+        this->binCounts[index[k]] += count;
         if (this->binCounts[index[k]]>this->maxBinCount)
           this->maxBinCount = this->binCounts[index[k]];
       }
   }
+}
+
+void HeatMap::computeVisualData()
+{
+  if (!this->initialized)
+    return;
+  int width = this->fbo->size().width();
+  int height = this->fbo->size().height();
+  Selection::TYPE stype = this->geoWidget->getSelectionType();
+  bool usePickup = stype==Selection::START || stype==Selection::START_AND_END;
+  bool useDropoff = stype==Selection::END || stype==Selection::START_AND_END;
+
+  ResultStore::SnapshotPtr snapshot = this->geoWidget->getSnapshot();
+  const TripResult *added, *removed;
+  if (snapshot && snapshot->changesFrom(this->binned, added, removed) && stype==this->binnedType &&
+      this->region==this->binnedRegion && (int)this->binCounts.size()==width*height) {
+    this->countTrips(removed->trips, -1, usePickup, useDropoff);
+    this->countTrips(added->trips, 1, usePickup, useDropoff);
+    this->maxBinCount = *std::max_element(this->binCounts.begin(), this->binCounts.end());
+  }
+  else {
+    this->binCounts.clear();
+    this->binCounts.resize(width*height, 0);
+    this->maxBinCount = 0;
+    this->countTrips(*this->geoWidget->getSelectedTrips(), 1, usePickup, useDropoff);
+  }
+  this->binned = snapshot;
+  this->binnedType = stype;
+  this->binnedRegion = this->region;
 
   this->maxValue = this->maxBinCount;
   this->updateColorBar();
@@ -2,6 +2,7 @@
 #define HEAT_MAP_HPP
 #include "RenderingLayer.hpp"
 #include "KdTrip.hpp"
+#include "ResultStore.h"
 #include <set>
 #include <vector>
 #include <QList>
@@ -51,6 +52,7 @@ protected:
   void updateGrid();
   void renderGL();
   void computeVisualData();
+  void countTrips(const KdTrip::TripSet &trips, int count, bool usePickup, bool useDropoff);
   void buildHeatMapTexture();
   void updateColorBar();
 
@@ -65,6 +67,11 @@ protected:
 
   std::vector<int>        binCounts;
   int                     maxBinCount;
+  // the snapshot the bins were counted on, and how: one the time window
+  // stepped to from it only changes the bins of the trips that came and went
+  boost::weak_ptr<ResultStore::Snapshot> binned;
+  Selection::TYPE         binnedType;
+  QRectF                  binnedRegion;
   float                   maxValue;
 
   bool                    initialized;
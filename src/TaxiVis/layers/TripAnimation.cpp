@@ -321,8 +321,8 @@ void TripAnimation::buildAnimPath()
   CityMap::Path path;
   CityMap::IntMap nodeId;
   CityMap *city = Global::getInstance()->getMap();
-  KdTrip::TripSet::iterator it;
-  KdTrip::TripSet *selectedTrips = this->geoWidget->getSelectedTrips();
+  KdTrip::TripSet::const_iterator it;
+  const KdTrip::TripSet *selectedTrips = this->geoWidget->getSelectedTrips();
   uint64_t minPickupTime = (uint64_t)-1;
   uint64_t maxDropoffTime = 0;
   this->maxTrafficTime = 0;
@@ -82,8 +82,8 @@ void TripLocation::initGL()
 
 void TripLocation::buildLocations()
 {
-  KdTrip::TripSet::iterator it;
-  KdTrip::TripSet *selectedTrips = this->geoWidget->getSelectedTrips();
+  KdTrip::TripSet::const_iterator it;
+  const KdTrip::TripSet *selectedTrips = this->geoWidget->getSelectedTrips();
   this->vertices.clear();
   this->vertices.resize(2*2*selectedTrips->size());
   float *pickup = &this->vertices[0];
@@ -28,15 +28,15 @@ struct Location {
   }
 };
 
-void progressiveLayout(Location *locations, int left, int right, float *pickup, float *dropoff)
+void progressiveLayout(Location *locations, int64_t left, int64_t right, float *pickup, float *dropoff)
 {
-  std::queue< std::pair<int,int> > q;
+  std::queue< std::pair<int64_t,int64_t> > q;
   q.push(std::make_pair(left,right));
   while (!q.empty()) {
-    std::pair<int,int> bounds = q.front();
+    std::pair<int64_t,int64_t> bounds = q.front();
     q.pop();
     if (bounds.first<=bounds.second) {
-      int mid = (bounds.first+bounds.second)/2;
+      int64_t mid = (bounds.first+bounds.second)/2;
       pickup[0] = locations[mid].pos[0];
       pickup[1] = locations[mid].pos[1];
       dropoff[0] = locations[mid].pos[2];
@@ -53,8 +53,8 @@ void progressiveLayout(Location *locations, int left, int right, float *pickup,
 
 void TripLocationLOD::buildLocations()
 {
-  KdTrip::TripSet::iterator it;
-  KdTrip::TripSet *selectedTrips = this->geoWidget->getSelectedTrips();
+  KdTrip::TripSet::const_iterator it;
+  const KdTrip::TripSet *selectedTrips = this->geoWidget->getSelectedTrips();
   std::vector<Location> locations;
   locations.reserve(selectedTrips->size());
   for (it=selectedTrips->begin(); it!=selectedTrips->end(); it++) {
@@ -71,7 +71,7 @@ void TripLocationLOD::buildLocations()
   this->vertices.resize(4*locations.size());
   float *pickup = &this->vertices[0];
   float *dropoff = pickup + 2*locations.size();
-  progressiveLayout(&locations[0], 0, locations.size()-1, pickup, dropoff);
+  progressiveLayout(&locations[0], 0, (int64_t)locations.size()-1, pickup, dropoff);
   this->bufferDirty = true;
   this->dataReady = true;
 }
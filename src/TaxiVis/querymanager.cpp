@@ -1,226 +1,438 @@
 #include "querymanager.h"
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <algorithm>
+#include <unistd.h>
 #include <QDebug>
+#include <QFile>
+#include <QStringList>
+#include <QTextStream>
 
 using namespace std;
 
 QueryManager::QueryManager(){
-    //create KDTrip
-    std::string fname = string(DATA_DIR)+"2012_merged.kdtrip";
-    qDebug() << "Loading taxi trip data from:" << QString::fromStdString(fname);
-    kdtrip = new KdTrip(fname);
-
-    // Count trips by iterating
-    int tripCount = 0;
-    uint32_t minTime = UINT32_MAX, maxTime = 0;
-    KdTrip::Iterator it = kdtrip->begin();
-    KdTrip::Iterator endIt = kdtrip->end();
-    while (it != endIt) {
-        tripCount++;
-        if (it->pickup_time < minTime) minTime = it->pickup_time;
-        if (it->dropoff_time > maxTime) maxTime = it->dropoff_time;
-        it++;
+    //mount every dataset of the catalog, or the default one without a catalog
+    QString catalog = QString(DATA_DIR)+"datasets.txt";
+    QFile file(catalog);
+    if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qDebug() << "Loading dataset catalog from:" << catalog;
+        QTextStream stream(&file);
+        while (!stream.atEnd()) {
+            QString line = stream.readLine().trimmed();
+            if (line.isEmpty() || line.startsWith("#"))
+                continue;
+            QStringList tokens = line.split(",");
+            if (tokens.size() != 2) {
+                qDebug() << "  Ignoring invalid catalog line:" << line;
+                continue;
+            }
+            std::string path = tokens[1].trimmed().toStdString();
+            if (path[0] != '/')
+                path = string(DATA_DIR)+path;
+            mountDataset(tokens[0].trimmed(), path);
+        }
+    }
+    else {
+        std::string manifest = string(DATA_DIR)+"2012_merged.manifest";
+        if (access(manifest.c_str(), R_OK)==0)
+            mountDataset("2012_merged", manifest);
+        else
+            mountDataset("2012_merged", string(DATA_DIR)+"2012_merged.kdtrip");
     }
-
     qDebug() << "Taxi trip data loaded successfully";
-    qDebug() << "  Number of trips:" << tripCount;
+}
+
+QueryManager::~QueryManager(){
+    for (size_t i=0; i<datasets.size(); i++)
+        delete datasets[i].shards;
+}
+
+// Adds the trips of a fixed-point index to the bounds of a shard
+struct FixedMeasure {
+    KdTripShardSet::Shard &shard;
+    void push_back(const KdFixedTrip::Trip *trip) { shard.add(KdFixedTrip::toTrip(*trip)); }
+};
 
-    if (tripCount > 0) {
-        QDateTime minDate = QDateTime::fromTime_t(minTime);
-        QDateTime maxDate = QDateTime::fromTime_t(maxTime);
+static bool endsWith(const std::string &path, const char *suffix){
+    size_t n = strlen(suffix);
+    return path.size()>n && path.compare(path.size()-n, n, suffix)==0;
+}
+
+void QueryManager::mountDataset(QString tag, const std::string &path){
+    Dataset dataset;
+    dataset.tag = tag;
+    dataset.shards = NULL;
+    //a manifest of time shards, a fixed-point kdfixed, or a single kdtrip
+    if (endsWith(path, ".manifest")) {
+        qDebug() << "Loading taxi trip shards" << tag << "from:" << QString::fromStdString(path);
+        dataset.shards = new KdTripShardSet(path);
+    }
+    else if (endsWith(path, ".kdfixed")) {
+        qDebug() << "Loading fixed-point taxi trip data" << tag << "from:" << QString::fromStdString(path);
+        dataset.fixed = boost::shared_ptr<KdFixedTrip>(new KdFixedTrip(path));
+    }
+    else {
+        qDebug() << "Loading taxi trip data" << tag << "from:" << QString::fromStdString(path);
+        KdTripShardSet::KdTripPtr kdtrip(new KdTrip(path));
+        qDebug() << "  Pickup-time index:" << (kdtrip->hasTimeIndex() ? "yes" : "no (run build_time_index)");
+        qDebug() << "  Leaf directory:" << (kdtrip->hasLeafDirectory() ? "yes" : "no (run build_leaf_directory)");
+        dataset.shards = new KdTripShardSet(kdtrip);
+    }
+    datasets.push_back(dataset);
+
+    KdTripShardSet::Shard summary;
+    if (dataset.fixed) {
+        FixedMeasure measure = {summary};
+        dataset.fixed->scan(measure);
+    }
+    else
+        summary = dataset.shards->summary();
+    qDebug() << "  Number of shards:" << (qulonglong)(dataset.shards ? dataset.shards->numShards() : 1);
+    qDebug() << "  Number of trips:" << (qulonglong)summary.numTrips;
+    if (summary.numTrips > 0) {
+        QDateTime minDate = QDateTime::fromTime_t(summary.minPickupTime);
+        QDateTime maxDate = QDateTime::fromTime_t(summary.maxDropoffTime);
         qDebug() << "  Time range:" << minDate.toString("yyyy-MM-dd HH:mm")
                  << "to" << maxDate.toString("yyyy-MM-dd HH:mm");
     }
 }
 
-QueryManager::~QueryManager(){
-    if(kdtrip != NULL)
-        delete kdtrip;
+int QueryManager::numDatasets() const{
+    return (int)datasets.size();
 }
 
-void QueryManager::queryData(SelectionGraph *queryGraph, QDateTime startDateTime,
-                            QDateTime endDateTime, KdTrip::TripSet &resultSet) {
-    //initial setup
-    assert(queryGraph != NULL);
-    resultSet.clear();
-
-    //
-    QDate startDate = startDateTime.date();
-    QTime startTime = startDateTime.time();
-    QDate endDate   = endDateTime.date();
-    QTime endTime   = endDateTime.time();
-
-    {//if graph is empry
-        if(queryGraph->isEmpty()){
-            //
-            KdTrip::Query query;
-
-            //
-            query.setPickupTimeInterval(query.createTime(startDate.year(),startDate.month(),startDate.day(),startTime.hour(),startTime.minute(),startTime.second()),
-                                        query.createTime(endDate.year(),endDate.month(),endDate.day(),endTime.hour(),endTime.minute(),endTime.second()));
-            query.setDropoffTimeInterval(query.createTime(startDate.year(),startDate.month(),startDate.day(),startTime.hour(),startTime.minute(),startTime.second()),
-                                         query.createTime(endDate.year(),endDate.month(),endDate.day(),endTime.hour(),endTime.minute(),endTime.second()));
-
-            KdTrip::QueryResult result = kdtrip->execute(query);
-            KdTrip::QueryResult::iterator it;
-            for (it=result.begin(); it<result.end(); ++it) {
-                resultSet.insert(it.trip());
-//                qDebug() << "Trip: ";
-//                qDebug() << "    fare: " << it.trip()->fare_amount;
-//                qDebug() << "    distance: " << it.trip()->distance;
-//                qDebug() << "    field1: " << it.trip()->field1;
-//                qDebug() << "    id: " << it.trip()->id_taxi;
-//                qDebug() << "    tip: " << it.trip()->tip_amount;
-//                qDebug() << "    payment type: " << it.trip()->payment_type;
-//                qDebug() << "    passengers: " << (uint)(it.trip()->passengers);
-            }
+QString QueryManager::datasetTag(int index) const{
+    return index<0 ? QString() : datasets[index].tag;
+}
 
-            return;
-        }
+KdTrip::QueryResult QueryManager::execute(const KdTrip::Query &query, TripResult &target){
+    //fan the query out to every mounted dataset and concatenate the results
+    //in catalog order
+    std::vector<KdTrip::QueryResult> partial(datasets.size());
+    std::vector<KdTripShardSet::PinList> used(datasets.size());
+    ThreadPool::shared().parallelFor(datasets.size(), [&](size_t i) {
+        if (datasets[i].fixed)
+            partial[i] = datasets[i].fixed->execute(query);
+        else
+            partial[i] = datasets[i].shards->execute(query, &used[i]);
+    });
+
+    KdTrip::QueryResult result;
+    if (partial.size()==1) {
+        result = partial[0];
+    }
+    else {
+        result.trips = boost::shared_ptr<KdTrip::TripVector>(new KdTrip::TripVector());
+        for (size_t i=0; i<partial.size(); i++)
+            if (partial[i].trips)
+                result.trips->insert(result.trips->end(), partial[i].trips->begin(), partial[i].trips->end());
+    }
+    //each shard pinned with its dataset, which tells where its trips come from
+    for (size_t i=0; i<used.size(); i++) {
+        if (datasets[i].fixed)
+            target.pin(datasets[i].fixed, (int)i);
+        for (size_t j=0; j<used[i].size(); j++)
+            target.pin(used[i][j], (int)i);
+    }
+    return result;
+}
 
+void TripResult::clear(){
+    trips.clear();
+    pins.clear();
+    groups = TripGroups();
+}
 
-    }
+void TripResult::swap(TripResult &other){
+    trips.swap(other.trips);
+    pins.swap(other.pins);
+    std::swap(groups, other.groups);
+}
+
+static bool mappedBefore(const TripResult::Pin &pin, const void *address){
+    return std::less<const void*>()(pin.begin, address);
+}
 
+static bool mappedAfter(const void *address, const TripResult::Pin &pin){
+    return std::less<const void*>()(address, pin.begin);
+}
 
-    //
-    set<Group> groups;
-    map<Group, vector<SelectionGraphNode*> > mapGroupToNodes;
-    map<Group, vector<SelectionGraphEdge*> > mapGroupToEdges;
-    queryGraph->groupNodesAndEdgeByColor(groups,mapGroupToNodes, mapGroupToEdges);
+void TripResult::pin(const KdTripShardSet::KdTripPtr &shard, int source){
+    Pin pin = {shard, static_cast<const char*>(shard->mappedBegin()), static_cast<const char*>(shard->mappedEnd()), source};
+    this->pin(pin);
+}
 
-    //edge queries
-    SelectionGraph::EdgeIterator it;
-    SelectionGraph::EdgeIterator edgesBegin;
-    SelectionGraph::EdgeIterator edgesEnd;
-    queryGraph->getEdgeIterator(edgesBegin,edgesEnd);
-    set<int> alreadyProcessedNodes;
-    //int countEdgeQuery = 1;
-    for(it = edgesBegin ; it != edgesEnd ; ++it){
-        //cout << "Executing edge query " << countEdgeQuery++ << endl;
-        SelectionGraphEdge* edge = it->second;
-        SelectionGraphNode* tail = edge->getTail();
-        SelectionGraphNode* head = edge->getHead();
+void TripResult::pin(const boost::shared_ptr<KdFixedTrip> &index, int source){
+    Pin pin = {index, index->mappedBegin(), index->mappedEnd(), source};
+    this->pin(pin);
+}
 
-        //
-        KdTrip::Query query;
-        QRectF originRect = tail->getSelection()->boundingBox();
-        query.setPickupArea(originRect.x(),originRect.y(),originRect.x() + originRect.width(),originRect.y() + originRect.height());
-        QRectF destinationRect = head->getSelection()->boundingBox();
-        query.setDropoffArea(destinationRect.x(),destinationRect.y(),destinationRect.x() + destinationRect.width(),destinationRect.y() + destinationRect.height());
+void TripResult::pin(const Pin &pin){
+    std::vector<Pin>::iterator it = std::lower_bound(pins.begin(), pins.end(), (const void*)pin.begin, mappedBefore);
+    if (it!=pins.end() && it->index==pin.index)
+        return;
+    pins.insert(it, pin);
+}
 
-//        qDebug() << "   Origin Rect " << originRect;
-//        qDebug() << "   Destination Rect " << destinationRect;
+int TripResult::pinOf(const KdTrip::Trip *trip) const{
+    //the last shard mapped before the trip is the only one that can hold it
+    std::vector<Pin>::const_iterator it = std::upper_bound(pins.begin(), pins.end(), (const void*)trip, mappedAfter);
+    if (it==pins.begin())
+        return -1;
+    --it;
+    const char *address = reinterpret_cast<const char*>(trip);
+    return std::less<const char*>()(address, it->end) ? (int)(it-pins.begin()) : -1;
+}
 
-        //
-        query.setPickupTimeInterval(query.createTime(startDate.year(),startDate.month(),startDate.day(),startTime.hour(),startTime.minute(),startTime.second()),
-                                    query.createTime(endDate.year(),endDate.month(),endDate.day(),endTime.hour(),endTime.minute(),endTime.second()));
-        query.setDropoffTimeInterval(query.createTime(startDate.year(),startDate.month(),startDate.day(),startTime.hour(),startTime.minute(),startTime.second()),
-                                     query.createTime(endDate.year(),endDate.month(),endDate.day(),endTime.hour(),endTime.minute(),endTime.second()));
+int TripResult::sourceOf(const KdTrip::Trip *trip) const{
+    int pin = pinOf(trip);
+    return pin<0 ? -1 : pins[pin].source;
+}
 
-        KdTrip::QueryResult result = kdtrip->execute(query);
-        //cout << "   Query Result " << result.size() << endl;
-        //resultSet.insert(result.begin(),result.end());
-        KdTrip::QueryResult::iterator it;
-        for (it=result.begin(); it<result.end(); ++it) {
-            //
-            if(tail->getSelection()->contains(QPointF(it->pickup_lat,it->pickup_long)) &&
-                    head->getSelection()->contains(QPointF(it->dropoff_lat,it->dropoff_long)))
-                resultSet.insert(it.trip());
+void TripResult::prunePins(const KdTrip::TripSet *removed){
+    //the candidates are the pins that may have lost their last trip; the
+    //scan stops once each of them is known to hold one
+    std::vector<char> used(pins.size(), removed ? 1 : 0);
+    size_t candidates = removed ? 0 : pins.size();
+    KdTrip::TripSet::const_iterator it;
+    if (removed) {
+        for (it=removed->begin(); it!=removed->end() && candidates<pins.size(); ++it) {
+            int pin = pinOf(*it);
+            if (pin>=0 && used[pin]) {
+                used[pin] = 0;
+                candidates++;
+            }
+        }
+    }
+    for (it=trips.begin(); it!=trips.end() && candidates>0; ++it) {
+        int pin = pinOf(*it);
+        if (pin>=0 && !used[pin]) {
+            used[pin] = 1;
+            candidates--;
         }
-
-        //
-        alreadyProcessedNodes.insert(tail->getId());
-        alreadyProcessedNodes.insert(head->getId());
     }
+    if (candidates==0)
+        return;
+    size_t kept = 0;
+    for (size_t i=0; i<pins.size(); i++)
+        if (used[i])
+            pins[kept++] = pins[i];
+    pins.resize(kept);
+}
 
-    //cout << "   After edge queries " << resultSet.size() << endl;
+const TripGroups *TripResult::tripGroups() const{
+    return groups.plan ? &groups : NULL;
+}
 
-    // node queries
-    SelectionGraph::NodeIterator nodesit;
-    SelectionGraph::NodeIterator nodesBegin;
-    SelectionGraph::NodeIterator nodesEnd;
-    queryGraph->getNodeIterator(nodesBegin,nodesEnd);
-    //int countNodeQuery = 1;
-    for(nodesit = nodesBegin ; nodesit != nodesEnd ; ++nodesit){
-        //cout << "Executing Node Query " << countNodeQuery++ << endl;
-        SelectionGraphNode* node = nodesit->second;
-        if(alreadyProcessedNodes.count(node->getId()) > 0)
-            continue;
+void QueryManager::queryNearest(QPointF location, bool dropoff, int k, const KdTrip::Query &query,
+                                TripResult &result){
+    result.clear();
+
+    //the k nearest of every dataset, then the k nearest among those
+    std::vector<KdTrip::QueryResult> partial(datasets.size());
+    std::vector<KdTripShardSet::PinList> used(datasets.size());
+    ThreadPool::shared().parallelFor(datasets.size(), [&](size_t i) {
+        if (datasets[i].fixed)
+            partial[i] = datasets[i].fixed->nearest(query, location.x(), location.y(), dropoff, k);
+        else
+            partial[i] = datasets[i].shards->nearest(query, location.x(), location.y(), dropoff, k, &used[i]);
+    });
+    std::vector<std::pair<double, const KdTrip::Trip*> > neighbors;
+    for (size_t i=0; i<partial.size(); i++)
+        for (KdTrip::QueryResult::iterator it=partial[i].begin(); it!=partial[i].end(); ++it)
+            neighbors.push_back(std::make_pair(KdTrip::squaredDistance(location.x(), location.y(), it.trip(), dropoff), it.trip()));
+    if (query.isCancelled())
+        return;
+    std::sort(neighbors.begin(), neighbors.end());
+    for (size_t i=0; i<neighbors.size() && (int)i<k; i++)
+        result.trips.insert(neighbors[i].second);
+    for (size_t i=0; i<used.size(); i++) {
+        if (datasets[i].fixed)
+            result.pin(datasets[i].fixed, (int)i);
+        for (size_t j=0; j<used[i].size(); j++)
+            result.pin(used[i][j], (int)i);
+    }
+    result.prunePins();
+}
 
-        //
-        KdTrip::Query query;
-        KdTrip::Query extraQuery;
-
-        //time constraints
-        query.setPickupTimeInterval(query.createTime(startDate.year(),startDate.month(),startDate.day(),startTime.hour(),startTime.minute(),startTime.second()),
-                                    query.createTime(endDate.year(),endDate.month(),endDate.day(),endTime.hour(),endTime.minute(),endTime.second()));
-        query.setDropoffTimeInterval(query.createTime(startDate.year(),startDate.month(),startDate.day(),startTime.hour(),startTime.minute(),startTime.second()),
-                                     query.createTime(endDate.year(),endDate.month(),endDate.day(),endTime.hour(),endTime.minute(),endTime.second()));
-
-        extraQuery.setPickupTimeInterval(query.createTime(startDate.year(),startDate.month(),startDate.day(),startTime.hour(),startTime.minute(),startTime.second()),
-                                         query.createTime(endDate.year(),endDate.month(),endDate.day(),endTime.hour(),endTime.minute(),endTime.second()));
-        extraQuery.setDropoffTimeInterval(query.createTime(startDate.year(),startDate.month(),startDate.day(),startTime.hour(),startTime.minute(),startTime.second()),
-                                          query.createTime(endDate.year(),endDate.month(),endDate.day(),endTime.hour(),endTime.minute(),endTime.second()));
-
-        //
-        if(node->getSelection()->getType() == Selection::START){
-            QRectF originRect = node->getSelection()->boundingBox();
-            query.setPickupArea(originRect.x(),originRect.y(),originRect.x() + originRect.width(),originRect.y() + originRect.height());
-        }
-        else if(node->getSelection()->getType() == Selection::END){
-            QRectF destinationRect = node->getSelection()->boundingBox();
-            query.setDropoffArea(destinationRect.x(),destinationRect.y(),destinationRect.x() + destinationRect.width(),destinationRect.y() + destinationRect.height());
-        }
-        else if(node->getSelection()->getType() == Selection::START_AND_END){
-            //
-            QRectF originRect = node->getSelection()->boundingBox();
-            query.setPickupArea(originRect.x(),originRect.y(),originRect.x() + originRect.width(),originRect.y() + originRect.height());
-
-            //
-            QRectF destinationRect = node->getSelection()->boundingBox();
-            extraQuery.setDropoffArea(destinationRect.x(),destinationRect.y(),destinationRect.x() + destinationRect.width(),destinationRect.y() + destinationRect.height());
-        }
+static uint64_t toTime(const QDateTime &dateTime) {
+    QDate date = dateTime.date();
+    QTime time = dateTime.time();
+    return KdTrip::Query::createTime(date.year(),date.month(),date.day(),time.hour(),time.minute(),time.second());
+}
 
+KdTrip::Query QueryManager::timeQuery(QDateTime startDateTime, QDateTime endDateTime) {
+    KdTrip::Query timeQuery;
+    timeQuery.setPickupTimeInterval(toTime(startDateTime), toTime(endDateTime));
+    timeQuery.setDropoffTimeInterval(toTime(startDateTime), toTime(endDateTime));
+    return timeQuery;
+}
 
-        KdTrip::QueryResult result = kdtrip->execute(query);
-        KdTrip::QueryResult::iterator it;
-        qDebug() << "Result " << result.size() ;
-        for (it=result.begin(); it<result.end(); ++it) {
-            const KdTrip::Trip *trip = it.trip();
+KdTrip::Query QueryManager::timeQuery(const QList<QPair<QDateTime, QDateTime> > &intervals) {
+    //a single interval needs no range tests on top of the traversal
+    if (intervals.count() == 1)
+        return timeQuery(intervals.at(0).first, intervals.at(0).second);
+    std::vector<std::pair<uint32_t, uint32_t> > ranges;
+    for (int i=0; i<intervals.count(); i++)
+        ranges.push_back(std::make_pair((uint32_t)toTime(intervals.at(i).first), (uint32_t)toTime(intervals.at(i).second)));
+    KdTrip::Query timeQuery;
+    timeQuery.setTimeRanges(ranges);
+    return timeQuery;
+}
 
-            bool startContains = node->getSelection()->contains(QPointF(trip->pickup_lat, trip->pickup_long));
-            bool endContains   = node->getSelection()->contains(QPointF(trip->dropoff_lat, trip->dropoff_long));
+void QueryManager::queryData(SelectionGraph *queryGraph, QDateTime startDateTime,
+                            QDateTime endDateTime, TripResult &result, bool append) {
+    assert(queryGraph != NULL);
+    queryData(QueryPlan(queryGraph), timeQuery(startDateTime, endDateTime), result, append);
+}
 
-            if(node->getSelection()->getType() == Selection::START && !startContains)
-                continue;
-            else if(node->getSelection()->getType() == Selection::END && !endContains)
-                continue;
-            else if(node->getSelection()->getType() == Selection::START_AND_END && !startContains && !endContains)
-                continue;
+void QueryManager::queryData(SelectionGraph *queryGraph, const KdTrip::TimePattern &pattern,
+                            TripResult &result, bool append) {
+    assert(queryGraph != NULL);
+    KdTrip::Query timeQuery;
+    timeQuery.setTimePattern(pattern);
+    queryData(QueryPlan(queryGraph), timeQuery, result, append);
+}
 
-            resultSet.insert(trip);
-        }
+void QueryManager::queryData(const QueryPlan &plan, const KdTrip::Query &timeQuery,
+                            TripResult &result, bool append) {
+    queryPlan(plan, timeQuery, result, append);
+}
 
-        if(node->getSelection()->getType() == Selection::START_AND_END){
-            KdTrip::QueryResult result = kdtrip->execute(extraQuery);
-            KdTrip::QueryResult::iterator it;
-            for (it=result.begin(); it<result.end(); ++it) {
-                const KdTrip::Trip *trip = it.trip();
+void QueryManager::querySample(const QueryPlan &plan, const KdTrip::Query &timeQuery, unsigned sampleStride,
+                               TripResult &result) {
+    KdTrip::Query sampled = timeQuery;
+    sampled.setSampleStride(sampleStride);
+    queryPlan(plan, sampled, result, false);
+}
 
-                bool startContains = node->getSelection()->contains(QPointF(trip->pickup_lat, trip->pickup_long));
-                bool endContains   = node->getSelection()->contains(QPointF(trip->dropoff_lat, trip->dropoff_long));
+void QueryManager::queryPlan(const QueryPlan &plan, const KdTrip::Query &timeQuery,
+                             TripResult &result, bool append) {
+    if (!append) {
+        result.trips.clear();
+        result.pins.clear();
+    }
+    //trips appended by another query keep no mask, and are tested by the
+    //plots instead
+    if (!append || !result.groups.plan || !result.groups.plan->sameQuery(plan)) {
+        result.groups.masks.clear();
+        result.groups.plan.reset(new QueryPlan(plan));
+    }
 
-                if(node->getSelection()->getType() == Selection::START && !startContains)
-                    continue;
-                else if(node->getSelection()->getType() == Selection::END && !endContains)
-                    continue;
-                else if(node->getSelection()->getType() == Selection::START_AND_END && !startContains && !endContains)
-                    continue;
+    //one probe per distinct box pair, each trip tested once against the
+    //terms that probe answers, and tagged with the groups of those that
+    //accept it; the plans are only logged when TAXIVIS_PRINT_PLANS is set
+    static const bool printPlans = getenv("TAXIVIS_PRINT_PLANS")!=NULL;
+    if (printPlans && timeQuery.sampleStride==1)
+        qDebug() << plan.str().c_str();
+    QueryPlan::Evaluator evaluator(plan);
+    for (int p = 0 ; p < (int)plan.getProbes().size() && !timeQuery.isCancelled() ; ++p) {
+        KdTrip::QueryResult probed = execute(plan.probeQuery(p, timeQuery), result);
+        KdTrip::QueryResult::iterator it;
+        for (it=probed.begin(); it<probed.end(); ++it) {
+            const KdTrip::Trip *trip = it.trip();
+            if (plan.isCovered(p, trip))
+                continue;
+            uint64_t groupMask = 0;
+            if (evaluator.tag(p, trip, groupMask)) {
+                result.trips.insert(trip);
+                result.groups.masks[trip] |= groupMask;
+            }
+        }
+    }
+    //the probes also pin the shards of the trips the plan turned down
+    if (!append)
+        result.prunePins();
+}
 
-                resultSet.insert(trip);
+void QueryManager::queryChanges(const QueryPlan &plan, const std::vector<QueryPlan::Probe> &probes,
+                                const KdTrip::Query &timeQuery, TripResult &added, TripResult &removed) {
+    if (!added.groups.plan)
+        added.groups.plan.reset(new QueryPlan(plan));
+    QueryPlan::Evaluator evaluator(plan);
+    for (size_t p = 0 ; p < probes.size() && !timeQuery.isCancelled() ; ++p) {
+        KdTrip::QueryResult probed = execute(QueryPlan::probeQuery(probes[p], timeQuery), added);
+        KdTrip::QueryResult::iterator it;
+        for (it=probed.begin(); it<probed.end(); ++it) {
+            const KdTrip::Trip *trip = it.trip();
+            uint64_t groupMask = 0;
+            if (evaluator.tagAny(trip, groupMask)) {
+                added.trips.insert(trip);
+                added.groups.masks[trip] = groupMask;
             }
+            else
+                removed.trips.insert(trip);
         }
     }
-    //cout << "After node queries " << resultSet.size() << endl;
+    //probes reach shards none of the accepted trips may be in
+    added.prunePins();
+}
+
+void QueryManager::queryTimeChanges(const QueryPlan &plan, const KdTrip::Query &previous,
+                                    const TripResult &previousSet, const KdTrip::Query &timeQuery,
+                                    TripResult &added, TripResult &removed) {
+    // a trip is within an interval when both its times are; those within
+    // [s1, e1] but not [s0, e0] have a pickup before s0 or after e0, or
+    // else a dropoff before s0 or after e0: four disjoint slices, of which
+    // a step forward or back leaves two
+    uint64_t s0 = previous.minPickupTime, e0 = previous.maxPickupTime;
+    uint64_t s1 = timeQuery.minPickupTime, e1 = timeQuery.maxPickupTime;
+    uint64_t slices[4][4] = {
+        {s1,                 std::min(e1, s0-1), s1,                 e1},
+        {std::max(s1, e0+1), e1,                 s1,                 e1},
+        {std::max(s1, s0),   std::min(e1, e0),   s1,                 std::min(e1, s0-1)},
+        {std::max(s1, s0),   std::min(e1, e0),   std::max(s1, e0+1), e1},
+    };
+    //tagged by plan even when no slice is left
+    if (!added.groups.plan)
+        added.groups.plan.reset(new QueryPlan(plan));
+    for (int i=0; i<4 && !timeQuery.isCancelled(); i++) {
+        // s0-1 wraps around when s0 is 0: there is nothing before it
+        if (slices[i][0]>slices[i][1] || slices[i][2]>slices[i][3] || (s0==0 && (i==0 || i==2)))
+            continue;
+        KdTrip::Query slice = timeQuery;
+        slice.setPickupTimeInterval(slices[i][0], slices[i][1]);
+        slice.setDropoffTimeInterval(slices[i][2], slices[i][3]);
+        queryPlan(plan, slice, added, true);
+    }
+
+    KdTrip::TripSet::const_iterator it;
+    for (it=previousSet.trips.begin(); it!=previousSet.trips.end(); ++it) {
+        const KdTrip::Trip *trip = *it;
+        if (trip->pickup_time<s1 || trip->pickup_time>e1 || trip->dropoff_time<s1 || trip->dropoff_time>e1)
+            removed.trips.insert(trip);
+    }
+    //each side only pins the shards of its own trips
+    added.prunePins();
+    removed.pins = previousSet.pins;
+    removed.prunePins();
+    removed.groups.plan = previousSet.groups.plan;
+    boost::unordered_map<const KdTrip::Trip*, uint64_t>::const_iterator mask;
+    for (it=removed.trips.begin(); it!=removed.trips.end(); ++it) {
+        mask = previousSet.groups.masks.find(*it);
+        if (mask!=previousSet.groups.masks.end())
+            removed.groups.masks[*it] = mask->second;
+    }
+}
+
+void QueryManager::applyChanges(const TripResult &added, const TripResult &removed,
+                                TripResult &result) {
+    KdTrip::TripSet::const_iterator it;
+    for (it=removed.trips.begin(); it!=removed.trips.end(); ++it)
+        result.trips.erase(*it);
+    result.trips.insert(added.trips.begin(), added.trips.end());
+    for (size_t i=0; i<added.pins.size(); i++)
+        result.pin(added.pins[i]);
+    //a shard whose trips all left lets go of its mapping
+    result.prunePins(&removed.trips);
+    //the other trips keep their masks: only an end in the changed region
+    //can change the terms accepting a trip
+    for (it=removed.trips.begin(); it!=removed.trips.end(); ++it)
+        result.groups.masks.erase(*it);
+    boost::unordered_map<const KdTrip::Trip*, uint64_t>::const_iterator mask;
+    for (mask=added.groups.masks.begin(); mask!=added.groups.masks.end(); ++mask)
+        result.groups.masks[mask->first] = mask->second;
+    result.groups.plan = added.groups.plan;
 }
@@ -1,18 +1,120 @@
 #ifndef QUERYMANGET_H
 #define QUERYMANGET_H
 
+#include "KdFixedTrip.hpp"
 #include "KdTrip.hpp"
+#include "KdTripShardSet.hpp"
+#include "QueryPlan.h"
 #include "SelectionGraph.h"
 #include <QDateTime>
+#include <QList>
+#include <QPair>
+#include <QPointF>
+#include <QString>
+#include <vector>
+
+// The trips selected by a query, along with the shards holding them, which
+// stay pinned (mapped even if the LRU lets go of them) for as long as the
+// result lives, and the groups the query tagged them with. Copies share
+// the pins. A result is filled by one thread at a time.
+struct TripResult {
+    // a shard (or fixed-point index) holding trips of the result, where
+    // its trips are mapped, and the dataset it belongs to
+    struct Pin {
+        boost::shared_ptr<const void> index;
+        const char                   *begin, *end;
+        int                           source;
+    };
+
+    KdTrip::TripSet  trips;
+    // ordered by where the shards are mapped, so that the shard of a trip
+    // is found with a binary search
+    std::vector<Pin> pins;
+    TripGroups       groups;
+
+    void clear();
+    void swap(TripResult &other);
+    // Pins shard, of dataset source, unless it is pinned already
+    void pin(const KdTripShardSet::KdTripPtr &shard, int source);
+    void pin(const boost::shared_ptr<KdFixedTrip> &index, int source);
+    void pin(const Pin &pin);
+    // Index of the dataset a trip of the result comes from, or -1 when it
+    // is in none of the pinned shards
+    int  sourceOf(const KdTrip::Trip *trip) const;
+    // Index in pins of the shard holding trip, or -1
+    int  pinOf(const KdTrip::Trip *trip) const;
+    // Drops the pins no trip of the result is in. With removed (trips just
+    // taken out of the result) only the shards holding some of those are
+    // checked, as the others still hold the trips they held before
+    void prunePins(const KdTrip::TripSet *removed=NULL);
+    // The group masks of the trips, or NULL when no plan tagged them
+    const TripGroups *tripGroups() const;
+};
 
 class QueryManager
 {
 private:
-    KdTrip*        kdtrip;
+    // a mounted trip dataset (one kdtrip or a set of time shards, or else
+    // one fixed-point kdfixed) and the tag its trips are reported with
+    struct Dataset {
+        QString                        tag;
+        KdTripShardSet*                shards;
+        boost::shared_ptr<KdFixedTrip> fixed;
+    };
+    std::vector<Dataset> datasets;
+
+    void mountDataset(QString tag, const std::string &path);
+    KdTrip::QueryResult execute(const KdTrip::Query &query, TripResult &result);
+    void queryPlan(const QueryPlan &plan, const KdTrip::Query &timeQuery, TripResult &result, bool append);
 public:
     QueryManager();
     ~QueryManager();
-    void queryData(SelectionGraph* queryGraph, QDateTime startTime, QDateTime endTime, KdTrip::TripSet &resultSet);
+    // Fills result with the trips selected by queryGraph in the time
+    // interval; with append the previous content of result is kept
+    void queryData(SelectionGraph* queryGraph, QDateTime startTime, QDateTime endTime, TripResult &result, bool append=false);
+    // Same for every period of a recurring time pattern, in a single pass
+    void queryData(SelectionGraph* queryGraph, const KdTrip::TimePattern &pattern, TripResult &result, bool append=false);
+    // Selects the trips of a plan within the time constraints of timeQuery,
+    // tagging them with the groups accepting them (see TripResult::groups).
+    // Safe to call from a worker thread; when timeQuery is cancelled it
+    // returns early, leaving a partial result
+    void queryData(const QueryPlan &plan, const KdTrip::Query &timeQuery, TripResult &result, bool append=false);
+    // Same with about one in sampleStride of the trips, for a preview. The
+    // sample is taken by the traversal (see KdTrip::Query::setSampleStride),
+    // which skips the rest of the tree, and a trip is always in or out of
+    // it, so successive previews of a selection being dragged do not
+    // flicker
+    void querySample(const QueryPlan &plan, const KdTrip::Query &timeQuery, unsigned sampleStride,
+                     TripResult &result);
+    // Re-tests, against every term of plan, the trips within timeQuery that
+    // the given probes return (see QueryPlan::reshapeProbes), adding the
+    // accepted ones to added and the others to removed
+    void queryChanges(const QueryPlan &plan, const std::vector<QueryPlan::Probe> &probes, const KdTrip::Query &timeQuery,
+                      TripResult &added, TripResult &removed);
+    // Same when the time interval of the query moves from that of previous
+    // to that of timeQuery, overlapping it, and previousSet is the result of
+    // plan there: only the slices of time the interval enters are queried,
+    // into added, and the trips of previousSet outside of it go to removed,
+    // which keeps their pins and group masks
+    void queryTimeChanges(const QueryPlan &plan, const KdTrip::Query &previous, const TripResult &previousSet,
+                          const KdTrip::Query &timeQuery, TripResult &added, TripResult &removed);
+    // Applies the changes found by queryChanges to result, which takes over
+    // the pins and group masks of added
+    void applyChanges(const TripResult &added, const TripResult &removed, TripResult &result);
+    // Time constraints of the interval [startTime, endTime]
+    static KdTrip::Query timeQuery(QDateTime startTime, QDateTime endTime);
+    // Time constraints of a list of intervals (a DateTimeList), selecting
+    // in one traversal the trips of any of them
+    static KdTrip::Query timeQuery(const QList<QPair<QDateTime, QDateTime> > &intervals);
+    // Fills result with the k trips picked up (or dropped off) closest to
+    // location (lat, long, as in Selection) among those matching timeQuery
+    // (see timeQuery; a pattern or several intervals work as well)
+    void queryNearest(QPointF location, bool dropoff, int k, const KdTrip::Query &timeQuery,
+                      TripResult &result);
+
+    int     numDatasets() const;
+    // Tag of a dataset (see TripResult::sourceOf), empty for -1
+    QString datasetTag(int index) const;
 };
 
 #endif // QUERYMANGET_H
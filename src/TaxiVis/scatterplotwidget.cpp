@@ -372,7 +372,7 @@ void ScatterPlotWidget::updatePlot(){
     //int numberOfTrip = selectedTrips->size();
     map<Group,pair<QVector<double>,QVector<double> > > mapGroupData;
     if(buildGlobalPlot){
-        int numberOfTrips = selectedTrips->size();
+        size_t numberOfTrips = selectedTrips->size();
         //QVector<double> x(numberOfTrips), y(numberOfTrips);
         QVector<double> x, y;
         mapGroupData[QColor(0,0,0)] = make_pair(x,y);
@@ -387,8 +387,16 @@ void ScatterPlotWidget::updatePlot(){
         }
     }
 
+    //the groups the query tagged the trips with are read from their masks,
+    //the others tested against the selections
+    ResultStore::SnapshotPtr current = snapshot.lock();
+    const TripGroups *tripGroups = current && &current->trips==selectedTrips ? current->tripGroups() : NULL;
+    map<Group,int> groupBits;
+    if(!buildGlobalPlot)
+        groupBits = TripGroups::bitsFor(tripGroups, selectionGraph, groups);
+
     // add graphs with different scatter styles:
-    KdTrip::TripSet::iterator it = selectedTrips->begin();
+    KdTrip::TripSet::const_iterator it = selectedTrips->begin();
     for (; it != selectedTrips->end(); ++it) {
         const KdTrip::Trip * trip = *it;
         QPointF coords = getCoords(trip);
@@ -402,12 +410,17 @@ void ScatterPlotWidget::updatePlot(){
             y << coords.y();
         }
         else{
+            uint64_t groupMask = 0;
+            bool tagged = tripGroups && tripGroups->maskOf(trip, groupMask);
             for(groupIterator = groups.begin() ; groupIterator != groups.end() ; ++groupIterator){
                 Group currentGroup = *groupIterator;
 
                 assert(mapGroupToNodes.count(currentGroup) > 0 && mapGroupToEdges.count(currentGroup) > 0);
 
-                if(tripSatisfiesConstraints(trip, mapGroupToNodes[currentGroup],mapGroupToEdges[currentGroup])){
+                int bit = groupBits[currentGroup];
+                bool inGroup = (tagged && bit >= 0) ? ((groupMask >> bit) & 1) != 0 :
+                               tripSatisfiesConstraints(trip, mapGroupToNodes[currentGroup],mapGroupToEdges[currentGroup]);
+                if(inGroup){
                     pair<QVector<double>,QVector<double> > &data =
                             mapGroupData[currentGroup.getColor()];
                     QVector<double> &x = data.first;
@@ -600,8 +613,13 @@ QPointF ScatterPlotWidget::getCoords(const KdTrip::Trip *trip){
     return QPointF(coord1,coord2);
 }
 
-void ScatterPlotWidget::setSelectedTripsRepository(KdTrip::TripSet *v){
+void ScatterPlotWidget::setSelectedTripsRepository(const KdTrip::TripSet *v){
     selectedTrips = v;
+    snapshot.reset();
+}
+
+void ScatterPlotWidget::setSnapshot(const ResultStore::SnapshotPtr &s){
+    snapshot = s;
 }
 
 void ScatterPlotWidget::setSelectionGraph(SelectionGraph* g){
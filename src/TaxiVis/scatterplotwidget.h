@@ -5,6 +5,7 @@
 #include <set>
 #include "SelectionGraph.h"
 #include "KdTrip.hpp"
+#include "ResultStore.h"
 
 namespace Ui {
 class ScatterPlotWidget;
@@ -21,7 +22,10 @@ public:
     explicit ScatterPlotWidget(QWidget *parent = 0);
     ~ScatterPlotWidget();
 
-    void setSelectedTripsRepository(KdTrip::TripSet *);
+    void setSelectedTripsRepository(const KdTrip::TripSet *);
+    // The snapshot the trips are those of, if any: its group masks spare
+    // testing the trips against the selections
+    void setSnapshot(const ResultStore::SnapshotPtr &);
     void setSelectionGraph(SelectionGraph*);
     void recomputePlots();
 
@@ -33,8 +37,9 @@ private:
     ScatterPlotAttributes attrib2;
 
     //
-    KdTrip::TripSet      *selectedTrips;
+    const KdTrip::TripSet *selectedTrips;
     SelectionGraph       *selectionGraph;
+    boost::weak_ptr<ResultStore::Snapshot> snapshot;
 
     //
     void                  updatePlot();
@@ -57,6 +57,10 @@ TemporalSeriesPlotWidget::TemporalSeriesPlotWidget(QWidget *parent) :
     QWidget(parent),
     ui(new Ui::PlotWidget),
     selectedTrips(NULL),
+    binnedStart(0),
+    binnedEnd(0),
+    binnedBins(0),
+    binnedGlobal(false),
     _plotAttribute(TemporalSeriesPlotWidget::NUMBER_OF_TRIPS)
 {
     this->setCoordinator(Coordinator::instance());
@@ -96,8 +100,13 @@ TemporalSeriesPlotWidget::~TemporalSeriesPlotWidget()
     delete ui;
 }
 
-void TemporalSeriesPlotWidget::setSelectedTripsRepository(KdTrip::TripSet *v){
+void TemporalSeriesPlotWidget::setSelectedTripsRepository(const KdTrip::TripSet *v){
     selectedTrips = v;
+    snapshot.reset();
+}
+
+void TemporalSeriesPlotWidget::setSnapshot(const ResultStore::SnapshotPtr &s){
+    snapshot = s;
 }
 
 bool TemporalSeriesPlotWidget::tripSatisfiesEdge(const KdTrip::Trip *trip, SelectionGraphEdge* edge){
@@ -187,6 +196,10 @@ void TemporalSeriesPlotWidget::computePlots(){
         HourSlot currentSlot(slotStart,slotEnd);
         templatePlot.push_back(currentSlot);
     }
+    //the trips picked up when the window ends are binned apart
+    vector<HourSlot> templateSlots = templatePlot;
+    templateSlots.push_back(HourSlot(t0 + binSizeInSeconds * numberOfBins, t1));
+    unsigned numberOfSlots = templateSlots.size();
 
     set<Group> groups;
     map<Group,vector<SelectionGraphNode*> > mapGroupToNodes;
@@ -201,7 +214,8 @@ void TemporalSeriesPlotWidget::computePlots(){
 
     //
     if(buildGlobalPlot){
-        groupPlots[Group(Qt::black)] = templatePlot;
+        groups.clear();
+        groups.insert(Group(Qt::black));
     }
     else{
         for(groupIterator = groups.begin() ; groupIterator != groups.end() ; ++groupIterator){
@@ -227,76 +241,147 @@ void TemporalSeriesPlotWidget::computePlots(){
         groups = notEmptyGroups;
         mapGroupToNodes.clear();
         mapGroupToNodes = tempMapGroupToNodes;
+    }
 
-        //
-        for(groupIterator = groups.begin() ; groupIterator != groups.end() ; ++groupIterator){
-            groupPlots[*groupIterator] = templatePlot;
+    //a window stepped by whole bins from the snapshot binned last keeps the
+    //slots of the times it still covers, and only bins the trips that came
+    //in and left (or, going back in the history, undoes such a step)
+    ResultStore::SnapshotPtr current = snapshot.lock();
+    int64_t shift = binSizeInSeconds > 0 ? ((int64_t)t0 - (int64_t)binnedStart)/binSizeInSeconds : 0;
+    const TripResult *added = NULL, *removed = NULL;
+    bool stepped = current && &current->trips==selectedTrips && current->changesFrom(binned, added, removed) &&
+                   binSizeInSeconds > 0 && (t1-t0) % numberOfBins == 0 && numberOfBins == binnedBins &&
+                   t1-t0 == binnedEnd-binnedStart && shift*binSizeInSeconds == (int64_t)t0-(int64_t)binnedStart &&
+                   buildGlobalPlot == binnedGlobal && groupSlots.size() == groups.size();
+    for(groupIterator = groups.begin() ; stepped && groupIterator != groups.end() ; ++groupIterator)
+        stepped = groupSlots.count(*groupIterator) > 0;
+    binned = current;
+    binnedStart = t0;
+    binnedEnd = t1;
+    binnedBins = numberOfBins;
+    binnedGlobal = buildGlobalPlot;
+
+    if(stepped){
+        map<Group, vector<HourSlot> >::iterator plot;
+        for(plot = groupSlots.begin() ; plot != groupSlots.end() ; ++plot){
+            vector<HourSlot> slots = templateSlots;
+            for(unsigned i = 0 ; i < numberOfSlots ; ++i){
+                int64_t j = i + shift;
+                if(0 <= j && j < numberOfSlots){
+                    slots[i] = plot->second[j];
+                    slots[i].startTime = templateSlots[i].startTime;
+                    slots[i].endTime   = templateSlots[i].endTime;
+                }
+            }
+            plot->second.swap(slots);
+        }
+        vector<int64_t> crossings(numberOfSlots, 0), backsteps(numberOfSlots, 0);
+        for(unsigned i = 0 ; i < numberOfSlots ; ++i){
+            int64_t j = i + shift;
+            if(0 <= j && j < numberOfSlots){
+                crossings[i] = taxiCrossings[j];
+                backsteps[i] = taxiBacksteps[j];
+            }
         }
+        taxiCrossings.swap(crossings);
+        taxiBacksteps.swap(backsteps);
+    }
+    else{
+        groupSlots.clear();
+        for(groupIterator = groups.begin() ; groupIterator != groups.end() ; ++groupIterator)
+            groupSlots[*groupIterator] = templateSlots;
+        taxiCrossings.assign(numberOfSlots, 0);
+        taxiBacksteps.assign(numberOfSlots, 0);
     }
 
-    //
-    KdTrip::TripSet::iterator it;
-
-    for(it = selectedTrips->begin() ; it != selectedTrips->end() ; ++it){
+    //the groups the query tagged the trips with are read from their masks,
+    //the others tested against the selections
+    const TripGroups *selectedGroups = current && &current->trips==selectedTrips ? current->tripGroups() : NULL;
+    map<Group,int> groupBits;
+    if(!buildGlobalPlot)
+        groupBits = TripGroups::bitsFor(selectedGroups, selectionGraph, groups);
+
+    //slot of a time, past those of the window for the trips that left it;
+    //the last bin also holds what is left over by the bin size
+    auto slotOf = [&](uint32_t time) -> int64_t {
+        int64_t offset = (int64_t)time - (int64_t)t0;
+        if(offset < 0)
+            return -((binSizeInSeconds-1-offset)/binSizeInSeconds);
+        return time <= t1 ? std::min(offset/binSizeInSeconds, (int64_t)numberOfBins) : offset/binSizeInSeconds;
+    };
+
+    //adds (count 1) or removes (count -1) the trips of trips; only the
+    //slots still in the window are updated
+    auto binTrips = [&](const KdTrip::TripSet &trips, const TripGroups *tripGroups, int count) {
+        KdTrip::TripSet::const_iterator it;
+        for(it = trips.begin() ; it != trips.end() ; ++it){
+
+            const KdTrip::Trip *trip = *it;
+            int64_t bin = slotOf(trip->pickup_time);
+            bool inWindow = 0 <= bin && bin < numberOfSlots;
 
-        const KdTrip::Trip *trip = *it;
-        uint64_t bin = (trip->pickup_time - t0)/binSizeInSeconds;
-        if(bin == numberOfBins){//put the trips starting at the final time in the last bin
-            --bin;
-        }
+            //
+            if(buildGlobalPlot){
+                vector<HourSlot> &groupPlot  = groupSlots[Group(Qt::black)];
+                if(inWindow){
+                    if(count > 0)
+                        groupPlot.at(bin).update(trip);
+                    else
+                        groupPlot.at(bin).remove(trip);
+                }
 
-        //
-        if(buildGlobalPlot){
-            vector<HourSlot> &groupPlot  = groupPlots[Group(Qt::black)];
-            HourSlot &currentSlot        = groupPlot.at(bin);
-            currentSlot.update(trip);
-//            currentSlot.num_trips        += 1;
-//            currentSlot.sum_distance     += trip->distance;
-//            currentSlot.sum_fare_amount  += trip->fare_amount;
-//            currentSlot.sum_tips         += trip->tip_amount;
-//            currentSlot.sum_tools_amount += trip->tolls_amount/100.f;
-//            //
-//            currentSlot.sum_field1       += trip->field1;
-//            currentSlot.sum_field2       += trip->field2;
-//            currentSlot.sum_field3       += trip->field3;
-//            currentSlot.sum_field4       += trip->field4;
-
-//            int32_t tripDuration = (trip->dropoff_time- trip->pickup_time);
-//            if(tripDuration > 0){
-//                currentSlot.sum_duration  += tripDuration;
-//                currentSlot.sum_avg_speed += (trip->distance/(tripDuration));
-//            }
-
-            uint64_t binEnd = (trip->dropoff_time-t0)/binSizeInSeconds;
-            if(binEnd>=numberOfBins)
-                binEnd = numberOfBins-1;
-            for (uint64_t b=bin; b<=binEnd; ++b)
-                groupPlot.at(b).num_taxis++;
-        }
-        else{
-            for(groupIterator = groups.begin() ; groupIterator != groups.end() ; ++groupIterator){
-                Group currentGroup = *groupIterator;
-
-                assert(mapGroupToNodes.count(currentGroup) > 0 && mapGroupToEdges.count(currentGroup) > 0);
-
-                if(tripSatisfiesConstraints(trip, mapGroupToNodes[currentGroup],mapGroupToEdges[currentGroup])){
-                    vector<HourSlot> &groupPlot  = groupPlots[currentGroup];
-                    HourSlot &currentSlot        = groupPlot.at(bin);
-                    currentSlot.update(trip);
-//                    currentSlot.num_trips       += 1;
-//                    currentSlot.sum_distance    += trip->distance/100.f;
-//                    currentSlot.sum_fare_amount += trip->fare_amount/100.f;
-//                    currentSlot.sum_tips        += trip->tip_amount/100.f;
-//                    currentSlot.sum_tools_amount += trip->tolls_amount/100.f;
-//
-//                    int32_t tripDuration = (trip->dropoff_time- trip->pickup_time);
-//                    if(tripDuration > 0){
-//                        currentSlot.sum_duration  += tripDuration;
-//                        currentSlot.sum_avg_speed += (trip->distance/(tripDuration));
-//                    }
+                //the cab is on the road from the slot of its pickup to that
+                //of its dropoff
+                int64_t binEnd = slotOf(trip->dropoff_time);
+                for (int64_t b=std::max(bin, (int64_t)0); b<=binEnd && b<numberOfSlots; ++b) {
+                    groupPlot.at(b).num_taxis += count;
+                    if (b<binEnd)
+                        taxiCrossings[b] += count;
+                }
+                if (binEnd+1==bin && 0<=binEnd && binEnd<numberOfSlots)
+                    taxiBacksteps[binEnd] += count;
+            }
+            else if(inWindow){
+                uint64_t groupMask = 0;
+                bool tagged = tripGroups && tripGroups->maskOf(trip, groupMask);
+                for(groupIterator = groups.begin() ; groupIterator != groups.end() ; ++groupIterator){
+                    Group currentGroup = *groupIterator;
+
+                    assert(mapGroupToNodes.count(currentGroup) > 0 && mapGroupToEdges.count(currentGroup) > 0);
+
+                    int bit = groupBits[currentGroup];
+                    bool inGroup = (tagged && bit >= 0) ? ((groupMask >> bit) & 1) != 0 :
+                                   tripSatisfiesConstraints(trip, mapGroupToNodes[currentGroup],mapGroupToEdges[currentGroup]);
+                    if(inGroup){
+                        vector<HourSlot> &groupPlot  = groupSlots[currentGroup];
+                        if(count > 0)
+                            groupPlot.at(bin).update(trip);
+                        else
+                            groupPlot.at(bin).remove(trip);
+                    }
                 }
             }
         }
+    };
+
+    if(stepped){
+        binTrips(removed->trips, removed->tripGroups(), -1);
+        binTrips(added->trips, added->tripGroups(), 1);
+    }
+    else
+        binTrips(*selectedTrips, selectedGroups, 1);
+
+    //the trips picked up when the window ends are put in the last bin, and
+    //so are the cabs still on the road then
+    unsigned last = numberOfBins - 1;
+    map<Group, vector<HourSlot> >::iterator plot;
+    for(plot = groupSlots.begin() ; plot != groupSlots.end() ; ++plot){
+        vector<HourSlot> &groupPlot = groupPlots[plot->first];
+        groupPlot.assign(plot->second.begin(), plot->second.begin() + numberOfBins);
+        groupPlot[last].merge(plot->second[numberOfBins]);
+        groupPlot[last].endTime = t1;
+        if(buildGlobalPlot)
+            groupPlot[last].num_taxis += plot->second[numberOfBins].num_taxis - taxiCrossings[last] + taxiBacksteps[last];
     }
 }
 
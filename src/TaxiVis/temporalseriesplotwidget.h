@@ -7,6 +7,7 @@
 #include <map>
 #include "KdTrip.hpp"
 #include "Group.h"
+#include "ResultStore.h"
 #include "SelectionGraph.h"
 
 namespace Ui {
@@ -83,6 +84,40 @@ struct HourSlot {
             this->sum_avg_speed += (trip->distance/(1.0f*tripDuration));
         }
     }
+    inline void remove(const KdTrip::Trip *trip){
+        this->num_trips        -= 1;
+        this->sum_distance     -= trip->distance;
+        this->sum_fare_amount  -= trip->fare_amount;
+        this->sum_tips         -= trip->tip_amount;
+        this->sum_tools_amount -= trip->tolls_amount/100.f;
+        //
+        this->sum_field1       -= trip->field1;
+        this->sum_field2       -= trip->field2;
+        this->sum_field3       -= trip->field3;
+        this->sum_field4       -= trip->field4;
+        //
+        int32_t tripDuration = (trip->dropoff_time- trip->pickup_time);
+        if(tripDuration > 0){
+            this->sum_duration  -= tripDuration;
+            this->sum_avg_speed -= (trip->distance/(1.0f*tripDuration));
+        }
+    }
+    // adds the trips of slot, not its taxis
+    inline void merge(const HourSlot &slot){
+        this->num_trips        += slot.num_trips;
+        this->sum_distance     += slot.sum_distance;
+        this->sum_fare_amount  += slot.sum_fare_amount;
+        this->sum_tips         += slot.sum_tips;
+        this->sum_tools_amount += slot.sum_tools_amount;
+        //
+        this->sum_field1       += slot.sum_field1;
+        this->sum_field2       += slot.sum_field2;
+        this->sum_field3       += slot.sum_field3;
+        this->sum_field4       += slot.sum_field4;
+        //
+        this->sum_duration     += slot.sum_duration;
+        this->sum_avg_speed    += slot.sum_avg_speed;
+    }
 };
 
 class TemporalSeriesPlotWidget : public QWidget
@@ -100,7 +135,11 @@ public:
     explicit TemporalSeriesPlotWidget(QWidget *parent = 0);
     ~TemporalSeriesPlotWidget();
 
-    void setSelectedTripsRepository(KdTrip::TripSet *);
+    void setSelectedTripsRepository(const KdTrip::TripSet *);
+    // The snapshot the trips are those of, if any: its group masks spare
+    // testing the trips against the selections, and one the time window
+    // stepped to from the one binned last only bins the trips that changed
+    void setSnapshot(const ResultStore::SnapshotPtr &);
 
     float yMin() { return _yMin; }
     float yMax() { return _yMax; }
@@ -108,7 +147,7 @@ public:
 
 private:
     Ui::PlotWidget *ui;
-    KdTrip::TripSet*selectedTrips;
+    const KdTrip::TripSet*selectedTrips;
 
     //
     SelectionGraph* selectionGraph;
@@ -120,6 +159,20 @@ private:
 
     //
     std::map<Group, std::vector<HourSlot> > groupPlots;
+    // the slots the trips are binned in: one per bin, and one more for the
+    // end of the window, put in the last bin of the plots; for the cabs,
+    // those on the road from each slot to the next, and those dropped off
+    // in a slot and picked up in the next
+    std::map<Group, std::vector<HourSlot> > groupSlots;
+    std::vector<int64_t> taxiCrossings;
+    std::vector<int64_t> taxiBacksteps;
+    // the snapshot binned, and the window it was binned over
+    boost::weak_ptr<ResultStore::Snapshot> snapshot;
+    boost::weak_ptr<ResultStore::Snapshot> binned;
+    uint64_t binnedStart;
+    uint64_t binnedEnd;
+    unsigned binnedBins;
+    bool     binnedGlobal;
     PlotAttribute _plotAttribute;
     int numBins;
     float _yMin;
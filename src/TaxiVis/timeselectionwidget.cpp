@@ -38,7 +38,10 @@ int TimeSelectionWidget::getStepSize(){
     int stepSizeInMinutes = -1;
     QString selectedText = ui->comboBox_2->currentText();
 
-    if(!selectedText.compare(QString::fromLatin1("15 min"))){
+    if(!selectedText.compare(QString::fromLatin1("5 min"))){
+        stepSizeInMinutes = 5;
+    }
+    else if(!selectedText.compare(QString::fromLatin1("15 min"))){
         stepSizeInMinutes = 15;
     }
     else if(!selectedText.compare(QString::fromLatin1("30 min"))){
@@ -117,13 +120,12 @@ void TimeSelectionWidget::exploreTime()
 {
   if (this->ui->tabWidget->currentWidget()==this->ui->regularTimeWidget) {
     bool ok;
-    int defaultValue[] = {4, 2, 2, 7, 4};
+    int defaultValue[] = {6, 4, 2, 2, 7, 4};
     int steps = QInputDialog::getInt(this, "Parameter Exploration",
                                      QString("Specify the number of '%1' steps").arg(this->ui->comboBox_2->currentText()),
                                      defaultValue[this->ui->comboBox_2->currentIndex()], 2, 12, 1, &ok);
     if (ok) {
-      uint stepSizes[] = {15, 30, 60, 24*60, 7*24*60};
-      uint delta = stepSizes[this->ui->comboBox_2->currentIndex()]*60;
+      uint delta = this->getStepSize()*60;
       DateTimeList timeRanges;
       QDateTime start = this->getStartTime();
       QDateTime end = this->getEndTime();
@@ -212,6 +212,32 @@ QList<QDate> TimeWidget::getSelectedDays()
   return dRange;
 }
 
+KdTrip::TimePattern TimeWidget::getSelectedPattern()
+{
+  // same selection as getSelectedRanges, where no day or no hour
+  // selected means all of them
+  bool yearFlags[numYears], months[12], days[7], hours[24];
+  this->getSelectedCells(yearFlags, months, days, hours);
+  KdTrip::TimePattern pattern;
+  for (int y=0; y<numYears; y++)
+    if (yearFlags[y])
+      pattern.addYear(years_int[y]);
+  for (int m=0; m<12; m++)
+    if (months[m])
+      pattern.months |= 1<<m;
+  for (int d=0; d<7; d++)
+    if (days[d])
+      pattern.weekdays |= 1<<d;
+  for (int h=0; h<24; h++)
+    if (hours[h])
+      pattern.hours |= 1<<h;
+  if (pattern.weekdays==0)
+    pattern.weekdays = 0x7F;
+  if (pattern.hours==0)
+    pattern.hours = 0xFFFFFF;
+  return pattern;
+}
+
 DateTimeList TimeWidget::getSelectedRanges()
 {
   QList< QPair<QTime,QTime> > hRange = this->getSelectedHours();
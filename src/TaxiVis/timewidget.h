@@ -3,6 +3,7 @@
 
 #include <QWidget>
 #include <QDateTime>
+#include "KdTrip.hpp"
 #include <vector>
 #include <iostream>
 #include <string>
@@ -62,6 +63,7 @@ public:
     void getSelectedCells(bool *years, bool *months, bool *days, bool *hours);
   
     DateTimeList getSelectedRanges();
+    KdTrip::TimePattern getSelectedPattern();
     QList< QDate > getSelectedDays();
     QList< QPair<QTime,QTime> > getSelectedHours();
   
@@ -26,24 +26,23 @@ ViewWidget::ViewWidget(QWidget *parent) :
     ui->setupUi(this);
 
     //
-    ui->geographicalView->setSelectedTripsRepository(&selectedTrips);
     ui->geographicalView->setSelectionGraph(&selectionGraph);
     ui->geographicalView->setSelectionTime(ui->timeSelectionWidget->getStartTime(),ui->timeSelectionWidget->getEndTime());
     ui->geographicalView->updateData();
 
     //
-    ui->timeSeriesWidget->setSelectedTripsRepository(&selectedTrips);
+    ui->timeSeriesWidget->setSelectedTripsRepository(ui->geographicalView->getSelectedTrips());
     ui->timeSeriesWidget->setSelectionGraph(&selectionGraph);
     ui->timeSeriesWidget->setDateTimes(ui->timeSelectionWidget->getStartTime(),ui->timeSelectionWidget->getEndTime());
     ui->timeSeriesWidget->recomputePlots();
 
     //
-    ui->scatterPlotWidget->setSelectedTripsRepository(&selectedTrips);
+    ui->scatterPlotWidget->setSelectedTripsRepository(ui->geographicalView->getSelectedTrips());
     ui->scatterPlotWidget->setSelectionGraph(&selectionGraph);
     ui->scatterPlotWidget->recomputePlots();
 
     //
-    ui->histogramWidget->setSelectedTripsRepository(&selectedTrips);
+    ui->histogramWidget->setSelectedTripsRepository(ui->geographicalView->getSelectedTrips());
     ui->histogramWidget->setSelectionGraph(&selectionGraph);
     ui->histogramWidget->recomputePlots();
 
@@ -76,6 +75,7 @@ ViewWidget::ViewWidget(QWidget *parent) :
     //
     connect(ui->geographicalView,SIGNAL(stepBack()),this,SLOT(stepBack()));
     connect(ui->geographicalView,SIGNAL(stepForward()),this,SLOT(stepForward()));
+    connect(ui->geographicalView,SIGNAL(selectionTimesRestored()),this,SLOT(geoWidgetRestoredTimes()));
 
     //
     connect(ui->exploreButton, SIGNAL(clicked()), this, SLOT(plotAllAttributes()));
@@ -123,6 +123,17 @@ std::cout << "Set selection graph" << std::endl;
 }
 
 void ViewWidget::geoWidgetUpdatedData(){
+    // each result comes in a new snapshot, possibly shared with linked views
+    const KdTrip::TripSet *trips = ui->geographicalView->getSelectedTrips();
+    ui->timeSeriesWidget->setSelectedTripsRepository(trips);
+    ui->scatterPlotWidget->setSelectedTripsRepository(trips);
+    ui->histogramWidget->setSelectedTripsRepository(trips);
+    // with the group masks of the trips; a result stepped in time from the
+    // last one only bins the trips that changed
+    ResultStore::SnapshotPtr snapshot = ui->geographicalView->getSnapshot();
+    ui->timeSeriesWidget->setSnapshot(snapshot);
+    ui->scatterPlotWidget->setSnapshot(snapshot);
+    ui->histogramWidget->setSnapshot(snapshot);
     //
     ui->timeSeriesWidget->setDateTimes(ui->geographicalView->getSelectedStartTime(),
                                        ui->geographicalView->getSelectedEndTime());
@@ -132,6 +143,12 @@ void ViewWidget::geoWidgetUpdatedData(){
     ui->scatterPlotWidget->recomputePlots();
 }
 
+void ViewWidget::geoWidgetRestoredTimes(){
+    // the time dialogs show the span; a recurring pattern keeps its widget
+    ui->timeSelectionWidget->setTimes(ui->geographicalView->getSelectedStartTime(),
+                                      ui->geographicalView->getSelectedEndTime());
+}
+
 void ViewWidget::updateTimes(QDateTime start, QDateTime end){
     //qDebug() << "   After timeSelectionWidget update";
     ui->geographicalView->setSelectionTime(start,end);
@@ -169,6 +186,13 @@ void ViewWidget::exportTrips()
                 << "pickup_lat, dropoff_long, dropoff_lat, distance (in 0.01 miles unit), fare_amount (cents), "
                 << "surcharge (cents), mta_tax (cents), tip_amount (cents), tolls_amount (cents),passengers";
 
+        //the dataset each trip comes from, when several are mounted, as
+        //recorded by the result with the shards it pinned
+        ResultStore::SnapshotPtr snapshot = ui->geographicalView->getSnapshot();
+        bool exportSource = global->numDatasets() > 1;
+        if(exportSource)
+            headerStream << ",source";
+
         for(int i = 0 ; i < numExtraFields ; ++i){
             ExtraField field = global->getExtraField(i);
             if(field.active){
@@ -181,8 +205,8 @@ void ViewWidget::exportTrips()
         std::ofstream out(filename.toLatin1().constData());
         out << header.toStdString() << "\n";
 
-        KdTrip::TripSet *trips = ui->geographicalView->getSelectedTrips();
-        KdTrip::TripSet::iterator it = trips->begin();
+        const KdTrip::TripSet *trips = ui->geographicalView->getSelectedTrips();
+        KdTrip::TripSet::const_iterator it = trips->begin();
 
         for(; it!= trips->end(); ++it) {
           const KdTrip::Trip *trip = *it;
@@ -214,8 +238,10 @@ void ViewWidget::exportTrips()
                 << trip->mta_tax << ","
                 << trip->tip_amount << ","
                 << trip->tolls_amount << ","
-                << (int)trip->passengers
-                << extraFieldsStr.toStdString() //either empty or starts with comman
+                << (int)trip->passengers;
+            if(exportSource)
+                out << "," << global->datasetTag(snapshot ? snapshot->sourceOf(trip) : -1).toStdString();
+            out << extraFieldsStr.toStdString() //either empty or starts with comman
                 << std::endl;
         }
         out.close();
@@ -282,7 +308,7 @@ void ViewWidget::plotAllAttributes()
 
 void ViewWidget::updateRecurrentTimes(TimeWidget *widget)
 {
-  this->ui->geographicalView->setSelectionTimes(widget->getSelectedRanges());
+  this->ui->geographicalView->setSelectionPattern(widget->getSelectedPattern(), widget->getSelectedRanges());
   this->ui->geographicalView->updateData();
 }
 
@@ -307,7 +333,8 @@ void ViewWidget::exploreInTime(const DateTimeList &timeRanges)
   TimeExplorationDialog *dialog = new TimeExplorationDialog(this);
   SelectionGraph selectionGraph, plotGraph;
   selectionGraph.assign(this->ui->geographicalView->getSelectionGraph());
-  KdTrip::TripSet resultSet, plotSet;
+  TripResult resultSet;
+  KdTrip::TripSet plotSet;
   std::vector<KdTrip::Trip> plotTrips;
   KdTrip::TripSet::iterator tripIt;
   std::map<int,SelectionGraphNode*>::iterator beginNodeIterator;
@@ -349,10 +376,10 @@ void ViewWidget::exploreInTime(const DateTimeList &timeRanges)
     dialog->addGeoWidget(timeRanges.at(i).first,
                          timeRanges.at(i).second,
                          &selectionGraph,
-                         resultSet);
+                         resultSet.trips);
 
     int delta = i==0?baseRange.second.secsTo(timeRanges.at(i).second):baseRange.first.secsTo(timeRanges.at(i).first);
-    for (tripIt=resultSet.begin(); tripIt!=resultSet.end(); tripIt++) {
+    for (tripIt=resultSet.trips.begin(); tripIt!=resultSet.trips.end(); tripIt++) {
       KdTrip::Trip trip = *(*tripIt);
       trip.pickup_time -= delta;
       trip.dropoff_time -= delta;
@@ -31,7 +31,6 @@ public:
 private:
     Ui::ViewWidget *ui;
 
-    KdTrip::TripSet           selectedTrips;
     SelectionGraph            selectionGraph;
 
 public slots:
@@ -50,6 +49,7 @@ private slots:
     void on_showAnimationButton_clicked(bool checked);
     void exportTrips();
     void exploreInTime(const DateTimeList &timeRange);
+    void geoWidgetRestoredTimes();
 };
 
 #endif // VIEWWIDGET_H
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "../TaxiVis/KdTrip.hpp"
+#include "radix.h"
+
+// Compares the recursive, the iterative (prefetching), the specialized
+// (per active-dimension kernel) and the batched asynchronous-read KD-tree
+// traversals on a set of random spatio-temporal box queries, with a warm
+// and a cold page cache. The cold runs ask the kernel to drop the cached
+// pages of the index before each query; for a truly cold cache run as root
+// after "echo 3 > /proc/sys/vm/drop_caches".
+
+enum Traversal { RECURSIVE, ITERATIVE, SPECIALIZED, ASYNC };
+const char *traversalNames[] = { "recursive", "iterative", "specialized", "async" };
+
+void dropFileCache(const std::string &fileName) {
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd<0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+std::vector<KdTrip::Query> createQueries(const KdTrip &kdtrip, int numQueries) {
+  // Draw query centers from actual trips so the boxes hit populated regions
+  KdTrip::QueryResult all = kdtrip.executeKdTree(KdTrip::Query());
+  std::vector<KdTrip::Query> queries;
+  if (all.size()==0)
+    return queries;
+  for (int i=0; i<numQueries; i++) {
+    const KdTrip::Trip *trip = (*all.trips)[rand()%all.size()];
+    float delta = 0.002f*(1+rand()%10);
+    uint32_t window = 3600*(1+rand()%(24*7));
+    KdTrip::Query query;
+    query.setPickupTimeInterval(trip->pickup_time-window/2, trip->pickup_time+window/2);
+    query.setDropoffTimeInterval(trip->pickup_time-window/2, trip->pickup_time+window/2);
+    query.setPickupArea(trip->pickup_lat-delta, trip->pickup_long-delta,
+                        trip->pickup_lat+delta, trip->pickup_long+delta);
+    queries.push_back(query);
+  }
+  return queries;
+}
+
+void runBenchmark(const std::string &fileName, const std::vector<KdTrip::Query> &queries,
+                  Traversal traversal, bool cold) {
+  double total = 0;
+  size_t numTrips = 0;
+  if (!cold) {
+    // One untimed pass to bring the index into the page cache
+    KdTrip kdtrip(fileName);
+    for (size_t i=0; i<queries.size(); i++)
+      kdtrip.executeKdTree(queries[i]);
+  }
+  for (size_t i=0; i<queries.size(); i++) {
+    if (cold)
+      dropFileCache(fileName);
+    KdTrip kdtrip(fileName);
+    double t0 = WALLCLOCK();
+    KdTrip::QueryResult result = traversal==RECURSIVE?kdtrip.executeRecursive(queries[i]):
+      traversal==ITERATIVE?kdtrip.executeIterative(queries[i]):
+      traversal==ASYNC?kdtrip.executeAsync(queries[i]):kdtrip.executeKdTree(queries[i]);
+    total += WALLCLOCK()-t0;
+    numTrips += result.size();
+  }
+  fprintf(stdout, "%-11s %-5s %10.3f ms/query %12lu trips\n",
+          traversalNames[traversal], cold?"cold":"warm",
+          1000*total/std::max<size_t>(1, queries.size()), (unsigned long)numTrips);
+}
+
+int main(int argc, char **argv) {
+  if (argc<2 || argc>4) {
+    fprintf(stderr, "Usage: %s  <IN_KDTRIP_FILE>  [NUM_QUERIES]  [SEED]\n", argv[0]);
+    return -1;
+  }
+  std::string fileName(argv[1]);
+  int numQueries = argc>2?atoi(argv[2]):100;
+  srand(argc>3?atoi(argv[3]):1);
+
+  std::vector<KdTrip::Query> queries;
+  {
+    KdTrip kdtrip(fileName);
+    queries = createQueries(kdtrip, numQueries);
+  }
+  for (int cold=0; cold<2; cold++) {
+    runBenchmark(fileName, queries, RECURSIVE, cold);
+    runBenchmark(fileName, queries, ITERATIVE, cold);
+    runBenchmark(fileName, queries, SPECIALIZED, cold);
+    runBenchmark(fileName, queries, ASYNC, cold);
+  }
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 #include <limits.h>
 #include <float.h>
@@ -8,93 +9,29 @@
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/timer/timer.hpp>
 #include "../TaxiVis/KdTrip.hpp"
-#include "radix.h"
+#include "../TaxiVis/KdFixedTrip.hpp"
 
 #define xDEBUG
 
-int numNodesPerTrip = 1+((sizeof(KdTrip::Trip) + 8)/sizeof(KdTrip::KdNode));
+typedef KdTrip::Tree Tree;
 
-inline uint32_t float2uint(float f) {
-  register uint32_t t(*((uint32_t*)&f));
-  return t ^ ((-(t >> 31)) | 0x80000000);
-}
-
-inline float uint2float(uint32_t f) {
-  register uint32_t u = f ^ (((f >> 31) - 1) | 0x80000000);
-  return *((float*)&u);
-}
+template <typename TreeType, typename Record>
+void writeKdTree(Record *records, uint64_t n, const char *outFileName) {
+  typename TreeType::Node *nodes = (typename TreeType::Node*)malloc(sizeof(typename TreeType::Node)*TreeType::maxNodes(n));
+  uint32_t *tmp = (uint32_t*)malloc(sizeof(uint32_t)*n);
 
-#pragma pack(push, 1)
-struct KdNode {
-  uint64_t child_node;
-  uint32_t median_value;
-};
-#pragma pack(pop)
+  assert(nodes != NULL);
+  assert(tmp!= NULL);
 
-inline uint32_t getUKey(const KdTrip::Trip &trip, int keyIndex)
-{
-  switch (keyIndex) {
-  case 0:
-    return trip.pickup_time;
-  case 1:
-    return trip.dropoff_time;
-  case 2:
-    return float2uint(trip.pickup_long);
-  case 3:
-    return float2uint(trip.pickup_lat);
-  case 4:
-    return float2uint(trip.dropoff_long);
-  case 5:
-    return float2uint(trip.dropoff_lat);
-  case 6:
-    return trip.id_taxi;
-  default:
-    break;
-  }
-  return 0;
-}
+  uint64_t freeNode = TreeType::build(records, n, nodes, tmp);
 
-void buildKdTree(KdNode *nodes, uint32_t *tmp, KdTrip::Trip *trips, uint64_t n, int depth, uint64_t thisNode, uint64_t &freeNode) {
-  KdNode *node = nodes + thisNode;
-  if (n<2) {
-    static uint64_t cnt = 0;
-    cnt++;
-    if (cnt%500000==0)
-      fprintf(stderr, "\r%llu", cnt);
-    node->child_node = 0;
-    *reinterpret_cast<KdTrip::Trip*>(&(node->median_value)) = *trips;
-    return;
-  }
-  int keyIndex = depth%7;
-  size_t medianIndex = n/2-1;
-  uint32_t median = getUKey(trips[medianIndex], keyIndex);
-  //if (depth!=0) { //if inpute file is sorted by pickup time, don't need to resort all the time.
-  if (true) {
-    for (size_t i=0; i<n; i++)
-      tmp[i] = getUKey(trips[i], keyIndex);
-    sortArray(tmp, n);
-    median = tmp[n/2-1];
-    int64_t l = 0;
-    int64_t r = n-1;
-    while (l<r) {
-      while (l<n && getUKey(trips[l], keyIndex)<=median) l++;
-      while (r>=0 && getUKey(trips[r], keyIndex)>median) r--;
-      if (l<r)
-        SWAP(KdTrip::Trip, trips[l], trips[r]);
-    }
-    medianIndex = r;
-    if (medianIndex==n-1)
-      medianIndex = n-2;
-  }
-  node->median_value = median;
-  node->child_node = freeNode;
-  freeNode += 2 + ((uint64_t)(medianIndex+1<2))*numNodesPerTrip + ((uint64_t)((n-medianIndex-1<2)&&(n-medianIndex-1>0)))*numNodesPerTrip;
-  buildKdTree(nodes, tmp, trips, medianIndex+1, depth+1, node->child_node, freeNode);
-  if (medianIndex<n-1)
-    buildKdTree(nodes, tmp, trips + medianIndex+1, n-medianIndex-1, depth+1,
-                node->child_node+1+((uint64_t)(medianIndex+1<2))*numNodesPerTrip, freeNode);
-  else
-    nodes[node->child_node+1].child_node = -1;
+  // Writing new indices file
+  fprintf(stderr, "\rWriting %llu nodes to %s\n", (unsigned long long)freeNode, outFileName);
+  FILE *fo = fopen(outFileName, "wb");
+  fwrite(nodes, sizeof(typename TreeType::Node), freeNode, fo);
+  fclose(fo);
+  free(nodes);
+  free(tmp);
 }
 
 void createKdTree(int argc, char **argv) {
@@ -104,9 +41,9 @@ void createKdTree(int argc, char **argv) {
   uint64_t n = mfile.size()/sizeof(KdTrip::Trip);
   KdTrip::Trip *trips = (KdTrip::Trip*)mfile.const_data();
 #ifdef DEBUG
-  for(uint i = 0 ; i < n ; i++){
+  for(uint64_t i = 0 ; i < n ; i++){
       KdTrip::Trip trip = trips[i];
-      printf("Trip %d\n",i);
+      printf("Trip %llu\n",(unsigned long long)i);
       printf("    Taxi ID: %d\n",trip.id_taxi);
       printf("    pickup_time: %d\n",trip.pickup_time);
       printf("    dropoff_time: %d\n",trip.dropoff_time);
@@ -133,29 +70,26 @@ void createKdTree(int argc, char **argv) {
   }
 #endif
 
-  KdNode *nodes = (KdNode*)malloc(sizeof(KdNode)*((numNodesPerTrip+1)*n+n*3/2));
-  uint32_t *tmp = (uint32_t*)malloc(sizeof(uint32_t)*n);
-  
-  assert(nodes != NULL);
-  assert(tmp!= NULL);
-
-  uint64_t freeNode = 1;
-  buildKdTree(nodes, tmp, trips, n, 0, 0, freeNode);
-
-  // Writing new indices file
-  fprintf(stderr, "\rWriting %llu nodes to %s\n", freeNode, argv[2]);
-  FILE *fo = fopen(argv[2], "wb");
-  fwrite(nodes, sizeof(KdNode), freeNode, fo);
-  fclose(fo);  
+  if (argc>3) {
+    // Fixed-point index: both records have the same size, so the trips are
+    // converted in place in the private mapping
+    fprintf(stderr, "Converting coordinates to microdegrees\n");
+    KdFixedTrip::Trip *fixedTrips = reinterpret_cast<KdFixedTrip::Trip*>(trips);
+    for (uint64_t i=0; i<n; i++) {
+      KdFixedTrip::Trip fixed = KdFixedTrip::fromTrip(trips[i]);
+      memcpy(fixedTrips+i, &fixed, sizeof(fixed));
+    }
+    writeKdTree<KdFixedTrip::Tree>(fixedTrips, n, argv[2]);
+  }
+  else
+    writeKdTree<Tree>(trips, n, argv[2]);
   mfile.close();
-  free(nodes);
-  free(tmp);
-
 }
 
 int main(int argc, char **argv) {
-  if (argc!=3) {
-    fprintf(stderr, "Usage: %s  <IN_TAXI_TRIP_RECORDS_FILE>  <<OUT_KDTRIP_FILE>\n", argv[0]);
+  if (argc<3 || argc>4 || (argc==4 && strcmp(argv[3], "fixed")!=0)) {
+    fprintf(stderr, "Usage: %s  <IN_TAXI_TRIP_RECORDS_FILE>  <<OUT_KDTRIP_FILE>  [fixed]\n", argv[0]);
+    fprintf(stderr, "  fixed: store coordinates as int32 microdegrees (KdFixedTrip)\n");
     return -1;
   }  
   createKdTree(argc, argv);
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "../TaxiVis/KdTrip.hpp"
+
+void createLeafDirectory(const char *treeFileName, const char *outFileName) {
+  fprintf(stderr, "Reading trips from %s\n", treeFileName);
+  KdTrip kdtrip(treeFileName);
+  // An unconstrained tree traversal visits every leaf exactly once
+  KdTrip::QueryResult all = kdtrip.executeKdTree(KdTrip::Query());
+  std::vector<uint64_t> leaves(all.size());
+  KdTrip::QueryResult::iterator it = all.begin();
+  for (size_t i=0; i<leaves.size(); i++, ++it)
+    leaves[i] = kdtrip.nodeIndex(it.trip());
+  // File order keeps scans sequential and lets tripOrdinal binary search
+  std::sort(leaves.begin(), leaves.end());
+
+  KdTrip::LeafDirectoryHeader header;
+  memcpy(header.magic, "KDLD", 4);
+  header.version = 1;
+  header.numTrips = leaves.size();
+
+  fprintf(stderr, "Writing %llu leaves to %s\n", (unsigned long long)header.numTrips, outFileName);
+  FILE *fo = fopen(outFileName, "wb");
+  if (!fo) {
+    fprintf(stderr, "Cannot open %s for writing\n", outFileName);
+    exit(1);
+  }
+  fwrite(&header, sizeof(header), 1, fo);
+  if (!leaves.empty())
+    fwrite(&leaves[0], sizeof(uint64_t), leaves.size(), fo);
+  fclose(fo);
+}
+
+int main(int argc, char **argv) {
+  if (argc<2 || argc>3) {
+    fprintf(stderr, "Usage: %s  <IN_KDTRIP_FILE>  [OUT_LEAF_DIRECTORY_FILE]\n", argv[0]);
+    fprintf(stderr, "  The output defaults to <IN_KDTRIP_FILE>.leaves, which KdTrip loads automatically\n");
+    return -1;
+  }
+  std::string outFileName = argc>2?std::string(argv[2]):std::string(argv[1])+".leaves";
+  createLeafDirectory(argv[1], outFileName.c_str());
+  return 0;
+}
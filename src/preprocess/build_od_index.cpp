@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "../TaxiVis/KdTrip.hpp"
+
+// Default grid: the NYC area in cells of about 500m
+const float GRID_MIN_LAT  = 40.45f;
+const float GRID_MAX_LAT  = 41.00f;
+const float GRID_MIN_LONG = -74.30f;
+const float GRID_MAX_LONG = -73.65f;
+
+struct OdEntry {
+  uint64_t pair;
+  uint32_t pickup_time;
+  uint64_t node;
+  bool operator<(const OdEntry &e) const {
+    return (pair<e.pair) || (pair==e.pair && pickup_time<e.pickup_time) ||
+      (pair==e.pair && pickup_time==e.pickup_time && node<e.node);
+  }
+};
+
+void createOdIndex(const char *treeFileName, const char *outFileName, float cellSize) {
+  KdTrip::OdIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "KDOD", 4);
+  header.version = 1;
+  header.minLat = GRID_MIN_LAT;
+  header.minLong = GRID_MIN_LONG;
+  header.cellSize = cellSize;
+  header.rows = (uint32_t)((GRID_MAX_LAT-GRID_MIN_LAT)/cellSize)+1;
+  header.cols = (uint32_t)((GRID_MAX_LONG-GRID_MIN_LONG)/cellSize)+1;
+  uint64_t numKeys = (uint64_t)header.rows*header.cols+1;
+
+  fprintf(stderr, "Reading trips from %s\n", treeFileName);
+  KdTrip kdtrip(treeFileName);
+  // An unconstrained tree traversal visits every leaf exactly once
+  KdTrip::QueryResult all = kdtrip.executeKdTree(KdTrip::Query());
+  std::vector<OdEntry> entries(all.size());
+  KdTrip::QueryResult::iterator it = all.begin();
+  for (size_t i=0; i<entries.size(); i++, ++it) {
+    uint32_t pickupCell  = KdTrip::odCell(header, it->pickup_lat, it->pickup_long);
+    uint32_t dropoffCell = KdTrip::odCell(header, it->dropoff_lat, it->dropoff_long);
+    entries[i].pair = pickupCell*numKeys+dropoffCell;
+    entries[i].pickup_time = it->pickup_time;
+    entries[i].node = kdtrip.nodeIndex(it.trip());
+  }
+  fprintf(stderr, "Sorting %lu trips by cell pair and pickup time\n", (unsigned long)entries.size());
+  std::sort(entries.begin(), entries.end());
+
+  std::vector<uint64_t> pairKeys, pairOffsets;
+  for (size_t i=0; i<entries.size(); i++) {
+    if (i==0 || entries[i].pair!=entries[i-1].pair) {
+      pairKeys.push_back(entries[i].pair);
+      pairOffsets.push_back(i);
+    }
+  }
+  pairOffsets.push_back(entries.size());
+  header.numTrips = entries.size();
+  header.numPairs = pairKeys.size();
+
+  fprintf(stderr, "Writing %llu trips in %llu cell pairs (%ux%u grid) to %s\n",
+          (unsigned long long)header.numTrips, (unsigned long long)header.numPairs,
+          header.rows, header.cols, outFileName);
+  FILE *fo = fopen(outFileName, "wb");
+  if (!fo) {
+    fprintf(stderr, "Cannot open %s for writing\n", outFileName);
+    exit(1);
+  }
+  fwrite(&header, sizeof(header), 1, fo);
+  if (!pairKeys.empty())
+    fwrite(&pairKeys[0], sizeof(uint64_t), pairKeys.size(), fo);
+  fwrite(&pairOffsets[0], sizeof(uint64_t), pairOffsets.size(), fo);
+  for (size_t i=0; i<entries.size(); i++)
+    fwrite(&entries[i].node, sizeof(uint64_t), 1, fo);
+  for (size_t i=0; i<entries.size(); i++)
+    fwrite(&entries[i].pickup_time, sizeof(uint32_t), 1, fo);
+  fclose(fo);
+}
+
+int main(int argc, char **argv) {
+  if (argc<2 || argc>4) {
+    fprintf(stderr, "Usage: %s  <IN_KDTRIP_FILE>  [OUT_OD_INDEX_FILE]  [CELL_SIZE_DEGREES]\n", argv[0]);
+    fprintf(stderr, "  The output defaults to <IN_KDTRIP_FILE>.od, which KdTrip loads automatically\n");
+    return -1;
+  }
+  std::string outFileName = argc>2?std::string(argv[2]):std::string(argv[1])+".od";
+  float cellSize = argc>3?(float)atof(argv[3]):0.005f;
+  if (cellSize<=0) {
+    fprintf(stderr, "CELL_SIZE_DEGREES must be positive\n");
+    return -1;
+  }
+  createOdIndex(argv[1], outFileName.c_str(), cellSize);
+  return 0;
+}
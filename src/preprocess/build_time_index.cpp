@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "../TaxiVis/KdTrip.hpp"
+
+struct TimeEntry {
+  uint32_t pickup_time;
+  uint64_t node;
+  bool operator<(const TimeEntry &e) const {
+    return (pickup_time<e.pickup_time) || (pickup_time==e.pickup_time && node<e.node);
+  }
+};
+
+void createTimeIndex(const char *treeFileName, const char *outFileName, uint32_t bucketSeconds) {
+  fprintf(stderr, "Reading trips from %s\n", treeFileName);
+  KdTrip kdtrip(treeFileName);
+  // An unconstrained tree traversal visits every leaf exactly once
+  KdTrip::QueryResult all = kdtrip.executeKdTree(KdTrip::Query());
+  std::vector<TimeEntry> entries(all.size());
+  KdTrip::QueryResult::iterator it = all.begin();
+  for (size_t i=0; i<entries.size(); i++, ++it) {
+    entries[i].pickup_time = it->pickup_time;
+    entries[i].node = kdtrip.nodeIndex(it.trip());
+  }
+  fprintf(stderr, "Sorting %lu trips by pickup time\n", (unsigned long)entries.size());
+  std::sort(entries.begin(), entries.end());
+
+  KdTrip::TimeIndexHeader header;
+  memcpy(header.magic, "KDTI", 4);
+  header.version = 1;
+  header.numTrips = entries.size();
+  header.bucketSeconds = bucketSeconds;
+  header.baseTime = 0;
+  header.numBuckets = 0;
+  if (!entries.empty()) {
+    header.baseTime = entries.front().pickup_time-entries.front().pickup_time%bucketSeconds;
+    header.numBuckets = (entries.back().pickup_time-header.baseTime)/bucketSeconds+1;
+  }
+
+  // directory[b] is the first entry picked up at or after baseTime+b*bucketSeconds
+  std::vector<uint64_t> directory(header.numBuckets+1);
+  uint64_t pos = 0;
+  for (uint64_t b=0; b<=header.numBuckets; b++) {
+    uint64_t bucketStart = header.baseTime+b*bucketSeconds;
+    while (pos<entries.size() && entries[pos].pickup_time<bucketStart) pos++;
+    directory[b] = pos;
+  }
+  directory[header.numBuckets] = entries.size();
+
+  fprintf(stderr, "Writing %llu trips in %llu buckets to %s\n",
+          (unsigned long long)header.numTrips, (unsigned long long)header.numBuckets, outFileName);
+  FILE *fo = fopen(outFileName, "wb");
+  if (!fo) {
+    fprintf(stderr, "Cannot open %s for writing\n", outFileName);
+    exit(1);
+  }
+  fwrite(&header, sizeof(header), 1, fo);
+  fwrite(&directory[0], sizeof(uint64_t), directory.size(), fo);
+  for (size_t i=0; i<entries.size(); i++)
+    fwrite(&entries[i].node, sizeof(uint64_t), 1, fo);
+  for (size_t i=0; i<entries.size(); i++)
+    fwrite(&entries[i].pickup_time, sizeof(uint32_t), 1, fo);
+  fclose(fo);
+}
+
+int main(int argc, char **argv) {
+  if (argc<2 || argc>4) {
+    fprintf(stderr, "Usage: %s  <IN_KDTRIP_FILE>  [OUT_TIME_INDEX_FILE]  [BUCKET_SECONDS]\n", argv[0]);
+    fprintf(stderr, "  The output defaults to <IN_KDTRIP_FILE>.tidx, which KdTrip loads automatically\n");
+    return -1;
+  }
+  std::string outFileName = argc>2?std::string(argv[2]):std::string(argv[1])+".tidx";
+  uint32_t bucketSeconds = argc>3?(uint32_t)atoi(argv[3]):3600;
+  if (bucketSeconds==0) {
+    fprintf(stderr, "BUCKET_SECONDS must be positive\n");
+    return -1;
+  }
+  createTimeIndex(argv[1], outFileName.c_str(), bucketSeconds);
+  return 0;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "../TaxiVis/KdTrip.hpp"
+#include "../TaxiVis/ThreadPool.hpp"
+
+// Links every trip to the same taxi's next trip. Trips are numbered in
+// file order (the order of the leaf directory), bucketed by taxi with a
+// counting sort and each taxi's trips sorted by pickup time in parallel.
+
+struct TaxiTrip {
+  uint32_t pickupTime;
+  uint64_t ordinal;
+  bool operator<(const TaxiTrip &t) const {
+    return pickupTime<t.pickupTime || (pickupTime==t.pickupTime && ordinal<t.ordinal);
+  }
+};
+
+void createChainTable(const char *treeFileName, const char *outFileName) {
+  fprintf(stderr, "Reading trips from %s\n", treeFileName);
+  KdTrip kdtrip(treeFileName);
+  KdTrip::QueryResult all = kdtrip.executeParallel(KdTrip::Query());
+  std::vector<const KdTrip::Trip*> trips(all.trips->begin(), all.trips->end());
+  // File order, the order of the leaf directory and of the chain table
+  std::sort(trips.begin(), trips.end());
+  uint64_t n = trips.size();
+
+  std::vector<uint64_t> taxiBegin(USHRT_MAX+2, 0);
+  for (uint64_t i=0; i<n; i++)
+    taxiBegin[trips[i]->id_taxi+1]++;
+  for (size_t t=1; t<taxiBegin.size(); t++)
+    taxiBegin[t] += taxiBegin[t-1];
+  std::vector<TaxiTrip> byTaxi(n);
+  std::vector<uint64_t> fill(taxiBegin.begin(), taxiBegin.end()-1);
+  for (uint64_t i=0; i<n; i++) {
+    TaxiTrip &t = byTaxi[fill[trips[i]->id_taxi]++];
+    t.pickupTime = trips[i]->pickup_time;
+    t.ordinal = i;
+  }
+
+  fprintf(stderr, "Chaining %llu trips\n", (unsigned long long)n);
+  std::vector<KdTrip::ChainEntry> chain(n);
+  ThreadPool::shared().parallelFor(USHRT_MAX+1, [&](size_t taxi) {
+    TaxiTrip *begin = &byTaxi[0]+taxiBegin[taxi];
+    TaxiTrip *end   = &byTaxi[0]+taxiBegin[taxi+1];
+    std::sort(begin, end);
+    for (TaxiTrip *t=begin; t<end; t++) {
+      KdTrip::ChainEntry &entry = chain[t->ordinal];
+      if (t+1==end) {
+        entry.next = KdTrip::NoNextTrip;
+        entry.gapSeconds = 0;
+        entry.gapMeters = 0;
+        continue;
+      }
+      const KdTrip::Trip *trip = trips[t->ordinal];
+      const KdTrip::Trip *next = trips[(t+1)->ordinal];
+      entry.next = (t+1)->ordinal;
+      entry.gapSeconds = (int32_t)((int64_t)next->pickup_time-(int64_t)trip->dropoff_time);
+      entry.gapMeters = (float)sqrt(KdTrip::squaredDistance(trip->dropoff_lat, trip->dropoff_long, next, false));
+    }
+  });
+
+  KdTrip::ChainHeader header;
+  memcpy(header.magic, "KDCH", 4);
+  header.version = 1;
+  header.numTrips = n;
+
+  fprintf(stderr, "Writing %llu chain entries to %s\n", (unsigned long long)n, outFileName);
+  FILE *fo = fopen(outFileName, "wb");
+  if (!fo) {
+    fprintf(stderr, "Cannot open %s for writing\n", outFileName);
+    exit(1);
+  }
+  fwrite(&header, sizeof(header), 1, fo);
+  if (n>0)
+    fwrite(&chain[0], sizeof(KdTrip::ChainEntry), n, fo);
+  fclose(fo);
+}
+
+int main(int argc, char **argv) {
+  if (argc<2 || argc>3) {
+    fprintf(stderr, "Usage: %s  <IN_KDTRIP_FILE>  [OUT_CHAIN_FILE]\n", argv[0]);
+    fprintf(stderr, "  The output defaults to <IN_KDTRIP_FILE>.chain, which KdTrip loads automatically\n");
+    fprintf(stderr, "  (it is used together with the leaf directory from build_leaf_directory)\n");
+    return -1;
+  }
+  std::string outFileName = argc>2?std::string(argv[2]):std::string(argv[1])+".chain";
+  createChainTable(argv[1], outFileName.c_str());
+  return 0;
+}
@@ -46,7 +46,7 @@ int main(int argc, char** argv){
     QMap<QString,int> idsSoFar;
     QMap<QString,int> paymentsSoFar;
 
-    int count = 1;
+    uint64_t count = 1;
 
     while(!textStream.atEnd()){
         QString line;
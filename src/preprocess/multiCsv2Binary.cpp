@@ -38,7 +38,7 @@ int main(int argc, char** argv){
 
     //ignore header
     QTextStream mainTextStream(&fileLocations);
-    int count = 1;
+    uint64_t count = 1;
 
     while(!mainTextStream.atEnd()){
         QString filename = mainTextStream.readLine();        
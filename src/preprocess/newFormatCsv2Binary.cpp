@@ -43,7 +43,7 @@ int main(int argc, char** argv){
     }
 
     //
-    int count = 1;
+    uint64_t count = 1;
 
     while(!textStream.atEnd()){
         QString line;
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include "../TaxiVis/KdTrip.hpp"
+#include "radix.h"
+
+// Builds a synthetic index far larger than memory and checks that queries
+// on it return exactly the expected trips. The tree is generated top-down
+// in the layout of KdTree::build without sorting anything: every subtree
+// owns a box of keys, splits it at the middle of its dimension and gives
+// the lower half of its trips to the left child. A trip (a single-trip
+// subtree) takes pseudo-random keys within its box, derived from its
+// ordinal, so the trips inside any query box can be counted from the boxes
+// and ordinals alone. Every trip stores its ordinal in field1 (low) and
+// field2 (high).
+// At the default 3 billion trips the tree has about 2^34.5 nodes and needs
+// about 290 GB of disk; smaller counts past 270 million trips (2^31 nodes)
+// or 540 million trips (2^32 nodes) already cross the old 32-bit limits.
+
+typedef KdTrip::Tree Tree;
+static const uint64_t NodesPerRecord = Tree::NodesPerRecord;
+
+struct Box {
+  uint32_t key[7][2];
+};
+
+static Box initialBox() {
+  Box box;
+  box.key[0][0] = box.key[1][0] = (uint32_t)KdTrip::Query::createTime(2009, 1, 1, 0, 0, 0);
+  box.key[0][1] = box.key[1][1] = (uint32_t)KdTrip::Query::createTime(2016, 12, 31, 23, 59, 59);
+  box.key[2][0] = box.key[4][0] = kdFloatToKey(-74.30f);
+  box.key[2][1] = box.key[4][1] = kdFloatToKey(-73.70f);
+  box.key[3][0] = box.key[5][0] = kdFloatToKey(40.50f);
+  box.key[3][1] = box.key[5][1] = kdFloatToKey(40.95f);
+  box.key[6][0] = 0;
+  box.key[6][1] = USHRT_MAX;
+  return box;
+}
+
+static inline uint32_t splitKey(const Box &box, int dim) {
+  return box.key[dim][0]+(box.key[dim][1]-box.key[dim][0])/2;
+}
+
+// Key of the trip with the given ordinal in dimension dim of its box
+static inline uint32_t tripKey(const Box &box, int dim, uint64_t ordinal) {
+  uint64_t x = ordinal*7+dim+0x9E3779B97F4A7C15ull;
+  x = (x^(x>>30))*0xBF58476D1CE4E5B9ull;
+  x = (x^(x>>27))*0x94D049BB133111EBull;
+  x ^= x>>31;
+  return box.key[dim][0]+(uint32_t)(x%((uint64_t)box.key[dim][1]-box.key[dim][0]+1));
+}
+
+// Nodes used below the root of a subtree of n trips, memoized: a level of
+// the tree only has subtrees of two sizes
+static uint64_t nodesBelow(uint64_t n, std::map<uint64_t, uint64_t> &memo) {
+  if (n<2)
+    return 0;
+  std::map<uint64_t, uint64_t>::iterator it = memo.find(n);
+  if (it!=memo.end())
+    return it->second;
+  uint64_t left = n/2, right = n-left;
+  uint64_t total = 2+(left<2?NodesPerRecord:0)+(right<2?NodesPerRecord:0)+
+                   nodesBelow(left, memo)+nodesBelow(right, memo);
+  memo[n] = total;
+  return total;
+}
+
+static void generate(KdTreeNode *nodes, uint64_t index, uint64_t n, int dim, Box &box,
+                     uint64_t firstOrdinal, uint64_t &freeNode) {
+  KdTreeNode *node = nodes+index;
+  if (n<2) {
+    KdTrip::Trip trip;
+    memset(&trip, 0, sizeof(trip));
+    trip.pickup_time  = tripKey(box, 0, firstOrdinal);
+    trip.dropoff_time = tripKey(box, 1, firstOrdinal);
+    trip.pickup_long  = kdKeyToFloat(tripKey(box, 2, firstOrdinal));
+    trip.pickup_lat   = kdKeyToFloat(tripKey(box, 3, firstOrdinal));
+    trip.dropoff_long = kdKeyToFloat(tripKey(box, 4, firstOrdinal));
+    trip.dropoff_lat  = kdKeyToFloat(tripKey(box, 5, firstOrdinal));
+    trip.id_taxi      = (uint16_t)tripKey(box, 6, firstOrdinal);
+    trip.field1       = (uint32_t)firstOrdinal;
+    trip.field2       = (uint32_t)(firstOrdinal>>32);
+    node->child_node = 0;
+    memcpy(&(node->median_value), &trip, sizeof(trip));
+    return;
+  }
+  uint64_t left = n/2, right = n-left;
+  uint32_t median = splitKey(box, dim);
+  node->median_value = median;
+  node->child_node = freeNode;
+  freeNode += 2+(left<2?NodesPerRecord:0)+(right<2?NodesPerRecord:0);
+  uint64_t leftNode = node->child_node;
+  uint32_t lo = box.key[dim][0], hi = box.key[dim][1];
+  box.key[dim][1] = median;
+  generate(nodes, leftNode, left, Tree::nextDim(dim), box, firstOrdinal, freeNode);
+  box.key[dim][1] = hi;
+  box.key[dim][0] = median+1;
+  generate(nodes, leftNode+1+(left<2?NodesPerRecord:0), right, Tree::nextDim(dim), box, firstOrdinal+left, freeNode);
+  box.key[dim][0] = lo;
+}
+
+// Number of generated trips within range, following the same splits
+static uint64_t expectedCount(uint64_t n, int dim, Box &box, uint64_t firstOrdinal, const uint32_t (*range)[2]) {
+  bool inside = true;
+  for (int d=0; d<7; d++) {
+    if (box.key[d][1]<range[d][0] || range[d][1]<box.key[d][0])
+      return 0;
+    inside = inside && range[d][0]<=box.key[d][0] && box.key[d][1]<=range[d][1];
+  }
+  if (inside)
+    return n;
+  if (n<2) {
+    for (int d=0; d<7; d++) {
+      uint32_t key = tripKey(box, d, firstOrdinal);
+      if (key<range[d][0] || range[d][1]<key)
+        return 0;
+    }
+    return 1;
+  }
+  uint64_t left = n/2, right = n-left;
+  uint32_t median = splitKey(box, dim);
+  uint32_t lo = box.key[dim][0], hi = box.key[dim][1];
+  box.key[dim][1] = median;
+  uint64_t count = expectedCount(left, Tree::nextDim(dim), box, firstOrdinal, range);
+  box.key[dim][1] = hi;
+  box.key[dim][0] = median+1;
+  count += expectedCount(right, Tree::nextDim(dim), box, firstOrdinal+left, range);
+  box.key[dim][0] = lo;
+  return count;
+}
+
+static void buildIndex(const char *fileName, uint64_t numTrips, uint64_t numNodes) {
+  fprintf(stderr, "Generating %llu trips in %llu nodes (%.1f GB) into %s\n",
+          (unsigned long long)numTrips, (unsigned long long)numNodes,
+          numNodes*sizeof(KdTreeNode)/1e9, fileName);
+  boost::iostreams::mapped_file_params params;
+  params.path = fileName;
+  params.flags = boost::iostreams::mapped_file::readwrite;
+  params.new_file_size = numNodes*sizeof(KdTreeNode)+NodesPerRecord*sizeof(KdTreeNode);
+  boost::iostreams::mapped_file mfile(params);
+  KdTreeNode *nodes = reinterpret_cast<KdTreeNode*>(mfile.data());
+  Box box = initialBox();
+  uint64_t freeNode = 1;
+  double t0 = WALLCLOCK();
+  generate(nodes, 0, numTrips, 0, box, 0, freeNode);
+  mfile.close();
+  boost::filesystem::resize_file(fileName, freeNode*sizeof(KdTreeNode));
+  fprintf(stderr, "Wrote %llu nodes in %.1f s\n", (unsigned long long)freeNode, WALLCLOCK()-t0);
+}
+
+// Runs q with every traversal and checks the trips against the generator
+static bool checkQuery(const KdTrip &kdtrip, const KdTrip::Query &q, uint64_t numTrips, uint64_t &maxNode) {
+  uint32_t range[7][2] = {
+    {q.minPickupTime, q.maxPickupTime}, {q.minDropoffTime, q.maxDropoffTime},
+    {kdFloatToKey(q.minPickupLong), kdFloatToKey(q.maxPickupLong)},
+    {kdFloatToKey(q.minPickupLat), kdFloatToKey(q.maxPickupLat)},
+    {kdFloatToKey(q.minDropoffLong), kdFloatToKey(q.maxDropoffLong)},
+    {kdFloatToKey(q.minDropoffLat), kdFloatToKey(q.maxDropoffLat)},
+    {q.minTaxiId, q.maxTaxiId}};
+  Box box = initialBox();
+  uint64_t expected = expectedCount(numTrips, 0, box, 0, range);
+  const char *names[] = {"specialized", "recursive", "iterative", "parallel", "async"};
+  bool ok = true;
+  for (int t=0; t<5; t++) {
+    KdTrip::QueryResult result = t==0?kdtrip.executeKdTree(q):t==1?kdtrip.executeRecursive(q):
+                                 t==2?kdtrip.executeIterative(q):t==3?kdtrip.executeParallel(q):
+                                 kdtrip.executeAsync(q);
+    std::vector<uint64_t> ordinals;
+    ordinals.reserve(result.size());
+    bool valid = result.size()==expected;
+    for (KdTrip::QueryResult::iterator it=result.begin(); it<result.end(); ++it) {
+      const KdTrip::Trip *trip = it.trip();
+      uint64_t ordinal = trip->field1|((uint64_t)trip->field2<<32);
+      valid = valid && q.isMatched(trip) && ordinal<numTrips;
+      ordinals.push_back(ordinal);
+      maxNode = std::max(maxNode, kdtrip.nodeIndex(trip));
+    }
+    std::sort(ordinals.begin(), ordinals.end());
+    valid = valid && std::adjacent_find(ordinals.begin(), ordinals.end())==ordinals.end();
+    if (!valid) {
+      fprintf(stdout, "  %-11s FAILED: %llu trips, %llu expected\n", names[t],
+              (unsigned long long)result.size(), (unsigned long long)expected);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  if (argc<2 || argc>4) {
+    fprintf(stderr, "Usage: %s  <OUT_KDTRIP_FILE>  [NUM_TRIPS]  [NUM_QUERIES]\n", argv[0]);
+    fprintf(stderr, "  NUM_TRIPS defaults to 3000000000; an existing file of the right size is reused\n");
+    return -1;
+  }
+  const char *fileName = argv[1];
+  uint64_t numTrips = argc>2?strtoull(argv[2], NULL, 10):3000000000ull;
+  int numQueries = argc>3?atoi(argv[3]):100;
+  if (numTrips<2) {
+    fprintf(stderr, "NUM_TRIPS must be at least 2\n");
+    return -1;
+  }
+
+  std::map<uint64_t, uint64_t> memo;
+  uint64_t numNodes = 1+nodesBelow(numTrips, memo);
+  boost::system::error_code error;
+  if (boost::filesystem::file_size(fileName, error)!=numNodes*sizeof(KdTreeNode))
+    buildIndex(fileName, numTrips, numNodes);
+  else
+    fprintf(stderr, "Reusing %s\n", fileName);
+
+  KdTrip kdtrip(fileName);
+  Box box = initialBox();
+  srand(1);
+  int failed = 0;
+  uint64_t maxNode = 0, numResults = 0;
+  double t0 = WALLCLOCK();
+  for (int i=0; i<numQueries; i++) {
+    // Boxes of one to a few days around a random instant and location
+    KdTrip::Query q;
+    uint32_t span = box.key[0][1]-box.key[0][0];
+    uint32_t t = box.key[0][0]+(uint32_t)(((uint64_t)rand()*RAND_MAX+rand())%span);
+    uint32_t window = 86400*(1+rand()%4);
+    q.setPickupTimeInterval(t, t+window);
+    float lat = 40.5f+0.45f*rand()/RAND_MAX, lon = -74.3f+0.6f*rand()/RAND_MAX;
+    float delta = 0.01f*(1+rand()%10);
+    q.setPickupArea(lat-delta, lon-delta, lat+delta, lon+delta);
+    if (i%4==3)
+      q.setDropoffArea(lat-delta, lon-delta, lat+delta, lon+delta);
+    if (!checkQuery(kdtrip, q, numTrips, maxNode)) {
+      fprintf(stdout, "Query %d failed\n", i);
+      failed++;
+    }
+    numResults += kdtrip.executeKdTree(q).size();
+  }
+  fprintf(stdout, "%d/%d queries OK, %llu trips, highest node %llu, %.1f s\n",
+          numQueries-failed, numQueries, (unsigned long long)numResults,
+          (unsigned long long)maxNode, WALLCLOCK()-t0);
+  return failed>0?1:0;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include "../TaxiVis/KdTripShardSet.hpp"
+
+// Splits a binary Trip file (the input of build_kdtrip) into one file per
+// day or month of pickup time and writes the shard manifest. Each shard
+// file still has to be indexed with build_kdtrip; the manifest already
+// lists the .kdtrip names. At most MaxOpenFiles shard files are open at
+// a time: when another one is needed, the one written to least recently
+// is closed, and reopened for appending if it gets more trips.
+
+static const size_t MaxOpenFiles = 256;
+
+struct ShardFile {
+  FILE                  *fo;
+  bool                   created;
+  uint64_t               lastWrite;
+  KdTripShardSet::Shard  bounds;
+};
+
+std::string shardKey(uint32_t pickupTime, bool daily) {
+  time_t t = pickupTime;
+  struct tm timeinfo;
+  localtime_r(&t, &timeinfo);
+  // room for any int in each field, which -Wformat-truncation checks
+  char key[3*11+1];
+  if (daily)
+    snprintf(key, sizeof(key), "%04d%02d%02d", timeinfo.tm_year+1900, timeinfo.tm_mon+1, timeinfo.tm_mday);
+  else
+    snprintf(key, sizeof(key), "%04d%02d", timeinfo.tm_year+1900, timeinfo.tm_mon+1);
+  return key;
+}
+
+std::string baseName(const std::string &path) {
+  size_t slash = path.find_last_of('/');
+  return slash==std::string::npos?path:path.substr(slash+1);
+}
+
+int main(int argc, char **argv) {
+  if (argc<3 || argc>4 || (argc==4 && strcmp(argv[3], "day")!=0 && strcmp(argv[3], "month")!=0)) {
+    fprintf(stderr, "Usage: %s  <IN_BINARY_TRIPS>  <OUT_PREFIX>  [day|month]\n", argv[0]);
+    fprintf(stderr, "  Writes <OUT_PREFIX>_<YYYYMM[DD]>.bin shards and <OUT_PREFIX>.manifest\n");
+    return -1;
+  }
+  bool daily = argc==4 && strcmp(argv[3], "day")==0;
+  std::string prefix(argv[2]);
+
+  boost::iostreams::mapped_file_source fTrips(argv[1]);
+  uint64_t n = fTrips.size()/sizeof(KdTrip::Trip);
+  const KdTrip::Trip *trips = reinterpret_cast<const KdTrip::Trip*>(fTrips.data());
+  fprintf(stderr, "Sharding %llu trips by %s\n", (unsigned long long)n, daily?"day":"month");
+
+  std::map<std::string, ShardFile> shards;
+  std::map<std::string, ShardFile>::iterator it;
+  size_t numOpen = 0;
+  for (uint64_t i=0; i<n; i++) {
+    std::string key = shardKey(trips[i].pickup_time, daily);
+    it = shards.find(key);
+    if (it==shards.end()) {
+      ShardFile shard;
+      shard.fo = NULL;
+      shard.created = false;
+      shard.bounds.fileName = baseName(prefix)+"_"+key+".kdtrip";
+      it = shards.insert(std::make_pair(key, shard)).first;
+    }
+    ShardFile &shard = it->second;
+    if (!shard.fo) {
+      if (numOpen==MaxOpenFiles) {
+        std::map<std::string, ShardFile>::iterator lru = shards.end();
+        for (std::map<std::string, ShardFile>::iterator s=shards.begin(); s!=shards.end(); ++s)
+          if (s->second.fo && (lru==shards.end() || s->second.lastWrite<lru->second.lastWrite))
+            lru = s;
+        fclose(lru->second.fo);
+        lru->second.fo = NULL;
+        numOpen--;
+      }
+      std::string fileName = prefix+"_"+key+".bin";
+      shard.fo = fopen(fileName.c_str(), shard.created?"ab":"wb");
+      if (!shard.fo) {
+        fprintf(stderr, "Cannot open %s for writing\n", fileName.c_str());
+        return 1;
+      }
+      shard.created = true;
+      numOpen++;
+    }
+    fwrite(trips+i, sizeof(KdTrip::Trip), 1, shard.fo);
+    shard.lastWrite = i;
+    shard.bounds.add(trips[i]);
+  }
+
+  std::string manifestFileName = prefix+".manifest";
+  FILE *fo = fopen(manifestFileName.c_str(), "w");
+  if (!fo) {
+    fprintf(stderr, "Cannot open %s for writing\n", manifestFileName.c_str());
+    return 1;
+  }
+  KdTripShardSet::writeManifestHeader(fo);
+  for (it=shards.begin(); it!=shards.end(); ++it) {
+    if (it->second.fo)
+      fclose(it->second.fo);
+    KdTripShardSet::writeManifestLine(fo, it->second.bounds);
+  }
+  fclose(fo);
+  fprintf(stderr, "Wrote %lu shards and %s\n", (unsigned long)shards.size(), manifestFileName.c_str());
+  return 0;
+}
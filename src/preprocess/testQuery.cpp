@@ -1,8 +1,78 @@
 #include <iostream>
+#include <thread>
+#include <stdlib.h>
+#include <unistd.h>
 #include "../TaxiVis/KdTrip.hpp"
 
 using namespace std;
 
+static KdTrip::TripVector sortedTrips(const KdTrip::QueryResult &result) {
+    KdTrip::TripVector trips(*result.trips);
+    sort(trips.begin(), trips.end());
+    return trips;
+}
+
+// Runs the query serially, with executeParallel, and from several threads
+// sharing the same KdTrip; every run must return the same trips
+bool checkConcurrentReaders(const KdTrip &kdtrip, const KdTrip::Query &query, size_t numThreads) {
+    KdTrip::TripVector serial = sortedTrips(kdtrip.executeKdTree(query));
+    if (sortedTrips(kdtrip.executeParallel(query)) != serial)
+        return false;
+    vector<char> ok(numThreads, 0);
+    vector<thread> readers;
+    for (size_t i=0; i<numThreads; i++)
+        readers.push_back(thread([&, i]() {
+            ok[i] = (sortedTrips(kdtrip.executeParallel(query, (int)i)) == serial &&
+                     sortedTrips(kdtrip.executeKdTree(query)) == serial);
+        }));
+    for (size_t i=0; i<numThreads; i++)
+        readers[i].join();
+    return find(ok.begin(), ok.end(), 0)==ok.end();
+}
+
+// Builds a tree over numTrips identical trips, which build() chains into a
+// tree about numTrips deep, and searches it with every mask kernel; each
+// one must return all the trips, as search() does. The range reaches past
+// the key, since the single trip right of each split has the median key.
+bool checkRepeatedKeys(uint64_t numTrips) {
+    KdTrip::Trip trip;
+    memset(&trip, 0, sizeof(trip));
+    trip.pickup_time = trip.dropoff_time = 1357000000;
+    trip.pickup_long = trip.dropoff_long = -73.98f;
+    trip.pickup_lat = trip.dropoff_lat = 40.75f;
+    trip.id_taxi = 7;
+    vector<KdTrip::Trip> trips(numTrips, trip);
+    vector<KdTrip::KdNode> nodes(KdTrip::Tree::maxNodes(numTrips));
+    vector<uint32_t> tmp(numTrips);
+    uint64_t numNodes = KdTrip::Tree::build(&trips[0], numTrips, &nodes[0], &tmp[0]);
+
+    char fileName[] = "/tmp/testQueryXXXXXX";
+    int fd = mkstemp(fileName);
+    if (fd<0)
+        return false;
+    bool written = write(fd, &nodes[0], numNodes*sizeof(KdTrip::KdNode))==(ssize_t)(numNodes*sizeof(KdTrip::KdNode));
+    close(fd);
+    bool ok = written;
+    if (written) {
+        KdTrip::Tree tree(fileName);
+        uint32_t range[7][2];
+        for (int d=0; d<7; d++) {
+            range[d][0] = KdTrip::Tree::key(trip, d);
+            range[d][1] = range[d][0]+1;
+        }
+        KdTrip::Tree::RecordVector all;
+        tree.search(0, range, 0, [](const KdTrip::Trip *) { return true; }, all);
+        ok = all.size()==numTrips;
+        for (unsigned mask=0; mask<(1u<<7) && ok; mask++) {
+            KdTrip::Tree::RecordVector out;
+            KdTrip::Tree::kernel(mask)(tree, 0, range, 0, out);
+            ok = out==all;
+        }
+    }
+    unlink(fileName);
+    return ok;
+}
+
 int main(int argc, char** argv){
 
     if(argc != 2){
@@ -21,6 +91,8 @@ int main(int argc, char** argv){
 
     KdTrip::QueryResult result = kdtrip.execute(query);
     cout << "Num Trips " << result.size() << endl;
+    cout << "Concurrent readers " << (checkConcurrentReaders(kdtrip, query, 8)?"OK":"FAILED") << endl;
+    cout << "Repeated keys " << (checkRepeatedKeys(200)?"OK":"FAILED") << endl;
     KdTrip::QueryResult::iterator it;
     for (it=result.begin(); it<result.end(); ++it) {
         const KdTrip::Trip trip = *it;
@@ -59,8 +59,8 @@ int main(int argc, char **argv)
 {
   FILE *fi = fopen(argv[1], "rb");
   FILE *fo = fopen(argv[2], "wb");
-  int totalCount = 0;
-  int validCount = 0;
+  uint64_t totalCount = 0;
+  uint64_t validCount = 0;
   Trip t;
   KdTrip::Trip to;
   uint32_t MASK = ~0x3dce1b;
@@ -86,7 +86,7 @@ int main(int argc, char **argv)
       fwrite(&to, 1, sizeof(to), fo);
     }
     if (totalCount%1000000==0) {
-      fprintf(stderr, "\r%d/%d", validCount, totalCount);
+      fprintf(stderr, "\r%llu/%llu", (unsigned long long)validCount, (unsigned long long)totalCount);
     }
   }
   fprintf(stderr, "\n");